@@ -97,6 +97,14 @@ extern "C" {
 #define RADIO_ANT_SWITCH_PORT_TX_RFO              GPIOC //CRF2
 #define RADIO_ANT_SWITCH_PIN_TX_RFO               GPIO_PIN_2
 
+/* PM sensor supply, load switch enables, active high */
+
+#define HONEY_PWR_PORT                            GPIOA
+#define HONEY_PWR_PIN                             GPIO_PIN_8
+
+#define HONEY2_PWR_PORT                           GPIOA
+#define HONEY2_PWR_PIN                            GPIO_PIN_9
+
 /*  SPI MACRO redefinition */
 
 #define SPI_CLK_ENABLE()                __HAL_RCC_SPI1_CLK_ENABLE()
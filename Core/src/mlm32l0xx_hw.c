@@ -36,6 +36,7 @@ Maintainer: Miguel Luis and Gregory Cristian
 #include "debug.h"
 #include "bsp.h"
 #include "vcom.h"
+#include "ct_energy.h"
 
 /*!
  *  \brief Unique Devices IDs register set ( STM32L0xxx )
@@ -87,6 +88,11 @@ static bool AdcInitialized = false;
  */
 static bool McuInitialized = false;
 
+/*!
+ * UART kept running in stop mode, NULL if none
+ */
+static UART_HandleTypeDef *StopWakeUart = NULL;
+
 /**
   * @brief This function initializes the hardware
   * @param None
@@ -462,9 +468,18 @@ void LPM_EnterStopMode(void)
 
   HW_AdcDeInit();
 
+  if (StopWakeUart != NULL)
+  {
+    /* the UART keeps its kernel clock and its pins, HW_IoDeInit leaves them
+       alone, and its start bit detection wakes the MCU */
+    HAL_UARTEx_EnableStopMode(StopWakeUart);
+  }
+
   /*clear wake up flag*/
   SET_BIT(PWR->CR, PWR_CR_CWUF);
 
+  energy_mcu(ENERGY_STOP);
+
   RESTORE_PRIMASK();
 
   /* Enter Stop Mode */
@@ -505,9 +520,27 @@ void LPM_ExitStopMode(void)
   /*initilizes the peripherals*/
   HW_IoInit();
 
+  if (StopWakeUart != NULL)
+  {
+    HAL_UARTEx_DisableStopMode(StopWakeUart);
+  }
+
+  energy_mcu(ENERGY_RUN);
+
   RESTORE_PRIMASK();
 }
 
+/**
+  * @brief Selects the UART allowed to wake the MCU from stop mode
+  * @note LPUART1 clocked from LSE, the wake-up event is set by its user
+  * @param huart UART handle, NULL if no UART should run in stop mode
+  * @retval none
+  */
+void HW_SetStopWakeUart(UART_HandleTypeDef *huart)
+{
+  StopWakeUart = huart;
+}
+
 /**
   * @brief Enters Low Power Sleep Mode
   * @note ARM exits the function when waking up
@@ -516,7 +549,11 @@ void LPM_ExitStopMode(void)
   */
 void LPM_EnterSleepMode(void)
 {
+  energy_mcu(ENERGY_SLEEP);
+
   HAL_PWR_EnterSLEEPMode(PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFI);
+
+  energy_mcu(ENERGY_RUN);
 }
 
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
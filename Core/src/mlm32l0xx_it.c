@@ -35,6 +35,7 @@ Maintainer: Miguel Luis and Gregory Cristian
 #include "hw.h"
 #include "vcom.h"
 #include "mlm32l0xx_it.h"
+#include "ct_cli.h"
 
 
 /** @addtogroup STM32L1xx_HAL_Examples
@@ -183,6 +184,9 @@ void USARTx_IRQHandler(void)
 void USARTx_DMA_TX_IRQHandler(void)
 {
   vcom_DMA_TX_IRQHandler();
+
+  // the channel group also holds USART1 RX, channel 5
+  cli_dma_irq_handler();
 }
 
 void RTC_IRQHandler(void)
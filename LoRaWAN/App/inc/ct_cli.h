@@ -0,0 +1,40 @@
+/*
+ * ct_cli.h
+ *
+ *  Setting mode console input. USART1 receives into a ring by circular
+ *  DMA, the DMA half/full and UART idle-line interrupts only move the
+ *  producer index and call notify(). cli_poll() consumes the ring from the
+ *  main loop, echoes and assembles lines, so input pasted at line rate is
+ *  kept while a command runs.
+ */
+
+#ifndef CT_CLI_H_
+#define CT_CLI_H_
+
+#include "hw_conf.h"
+
+#define CLI_RING_SIZE     256     // 267 ms of input at 9600 baud
+#define CLI_LINE_SIZE     80      // NUL included
+#define CLI_ECHO_SIZE     32      // echo is written out in chunks of this
+#define CLI_TX_TIMEOUT(n) (2 * (n) + 10) // ms for n bytes, 1.04 ms a byte at 9600
+
+typedef enum {
+  CLI_LINE_NONE = 0,    // ring consumed, no complete line
+  CLI_LINE_READY,       // a line ended by CR, NUL terminated, maybe empty
+  CLI_LINE_OVERFLOW     // a line too long, the rest of it up to CR is dropped
+} cli_line_t;
+
+void              cli_init(UART_HandleTypeDef *huart, void (*notify)(void));
+HAL_StatusTypeDef cli_start(void);
+void              cli_stop(void);
+cli_line_t        cli_poll(const uint8_t **line);
+HAL_StatusTypeDef cli_write(const uint8_t *data, uint16_t len);
+uint16_t          cli_dropped(void);
+
+/* Interrupt Hooks */
+void              cli_irq_handler(void);
+void              cli_dma_irq_handler(void);
+void              cli_rx_callback(UART_HandleTypeDef *huart);
+void              cli_error_callback(UART_HandleTypeDef *huart);
+
+#endif /* CT_CLI_H_ */
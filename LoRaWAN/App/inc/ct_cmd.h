@@ -0,0 +1,21 @@
+/*
+ * ct_cmd.h
+ *
+ *  Setting mode command parsing: a line split into the command and its
+ *  argument, and the argument as a decimal number. No HAL dependency, it
+ *  builds on the host, see tools/cmd.
+ */
+
+#ifndef CT_CMD_H_
+#define CT_CMD_H_
+
+#include <stdint.h>
+
+#define CMD_TYPE_SIZE     10    // NUL included, the longest command is readcoef
+#define CMD_ARG_SIZE      12    // NUL included, a longitude in 1e-5 degree has 9 digits and a sign
+#define CMD_NUMBER_DIGITS 9     // digits of a number, so it cannot overflow 32 bits
+
+uint8_t cmd_extract(const uint8_t *line, uint8_t *type, uint8_t type_size, uint8_t *arg, uint8_t arg_size);
+uint8_t cmd_number(const uint8_t *src, int32_t *value);
+
+#endif /* CT_CMD_H_ */
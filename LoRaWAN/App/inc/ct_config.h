@@ -0,0 +1,26 @@
+/*
+ * ct_config.h
+ *
+ *  Node settings kept in the data EEPROM words below the log, see
+ *  LOG_EEPROM_START. The customer coefficient of setcoef is the byte at
+ *  the base, the rest is laid out here.
+ */
+
+#ifndef CT_CONFIG_H_
+#define CT_CONFIG_H_
+
+#include <stdint.h>
+
+#define CONFIG_EEPROM_START (DATA_EEPROM_BASE)
+#define CONFIG_LOC_ADDR     (CONFIG_EEPROM_START + 0x04) // magic, latitude, longitude
+#define CONFIG_LOC_MAGIC    0x4C4F4331                   // "LOC1", the words after it are set
+#define CONFIG_DEFAULT_LAT  1373654                      // 1e-5 degree, CU Engineering
+#define CONFIG_DEFAULT_LON  10052877
+#define CONFIG_LAT_MAX      9000000                      // 90 degrees
+#define CONFIG_LON_MAX      18000000                     // 180 degrees
+
+void     config_location(int32_t *latitude, int32_t *longitude);
+uint8_t  config_set_location(int32_t latitude, int32_t longitude);
+uint8_t  config_location_set(void);
+
+#endif /* CT_CONFIG_H_ */
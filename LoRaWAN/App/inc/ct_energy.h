@@ -0,0 +1,49 @@
+/*
+ * ct_energy.h
+ *
+ *  Time and estimated charge per activity phase, from RTC tick deltas
+ *  times a per-phase current. The MCU is in one of run, sleep or STOP,
+ *  loads such as the fan or the radio add on top.
+ */
+
+#ifndef CT_ENERGY_H_
+#define CT_ENERGY_H_
+
+#include <stdint.h>
+
+/* Currents, uA, board figures to adjust from a bench measurement */
+#define ENERGY_I_RUN        3000    // MCU at 32 MHz
+#define ENERGY_I_SLEEP      1000    // MCU in sleep, peripherals clocked
+#define ENERGY_I_STOP       2       // STOP with RTC, radio asleep
+#define ENERGY_I_FAN        80000   // sensor fan and laser, per sensor
+#define ENERGY_I_TX         44000   // radio at 14 dBm
+#define ENERGY_I_RX         11000   // radio listening
+#define ENERGY_I_CLI        200     // USART1 transceiver while the CLI is open
+
+/* Radio airtime estimate, the radio driver gives no TX or RX events */
+#define ENERGY_LORA_OVERHEAD 13     // MHDR, FHDR, FPort and MIC bytes
+#define ENERGY_RX_SYMBOLS   8       // symbols an empty receive window listens
+#define ENERGY_RX2_DR       2       // data rate of the second window
+
+typedef enum {
+  ENERGY_RUN = 0,     // MCU states, exactly one is current
+  ENERGY_SLEEP,
+  ENERGY_STOP,
+  ENERGY_FAN,         // loads, counted once per user that started them
+  ENERGY_TX,
+  ENERGY_RX,
+  ENERGY_CLI,
+  ENERGY_PHASE_COUNT
+} energy_phase_t;
+
+void        energy_init(void);
+void        energy_mcu(energy_phase_t state);
+void        energy_start(energy_phase_t phase);
+void        energy_stop(energy_phase_t phase);
+void        energy_add(energy_phase_t phase, uint32_t ms);
+void        energy_uplink(uint8_t size, int8_t dr);
+uint32_t    energy_time_s(energy_phase_t phase);
+uint32_t    energy_charge_uah(energy_phase_t phase);
+const char* energy_name(energy_phase_t phase);
+
+#endif /* CT_ENERGY_H_ */
@@ -0,0 +1,38 @@
+/*
+ * ct_log.h
+ *
+ *  Persistent PM2.5 log in the data EEPROM. One 32-bit word per reading,
+ *  written in a ring, so readings taken while the network is out survive
+ *  until they are sent as backfill.
+ */
+
+#ifndef CT_LOG_H_
+#define CT_LOG_H_
+
+#include <stdint.h>
+
+#define LOG_EEPROM_START  (DATA_EEPROM_BASE + 0x40) // the words below hold settings
+#define LOG_EEPROM_END    (DATA_EEPROM_END + 1)     // first byte past the log
+#define LOG_TIME_UNIT     16                        // s per timestamp step
+#define LOG_TIME_BITS     19                        // 97 days before a timestamp wraps, a full
+                                                    // ring at the slowest tier spans 42
+#define LOG_PM_BITS       10                        // PM2.5 saturates at 1023 ug/m3
+#define LOG_WEAR_LIMIT    100000                    // writes a data EEPROM word endures
+
+/* Record word: lap (2 bits, 0 is an empty slot), sent (1), time, PM2.5 */
+typedef struct {
+  uint16_t slot;    // ring position, for log_mark_sent()
+  uint32_t word;    // record as read, a slot rewritten since is left alone
+  uint16_t pm2_5;
+  uint32_t age;     // s since the reading, LOG_TIME_UNIT resolution
+} log_record_t;
+
+void     log_init(void);
+void     log_push(uint16_t pm2_5, log_record_t *rec);
+uint8_t  log_read(log_record_t *recs, uint8_t max);
+void     log_mark_sent(const log_record_t *recs, uint8_t count);
+uint16_t log_backlog(void);
+uint16_t log_size(void);
+uint32_t log_wear(void);
+
+#endif /* CT_LOG_H_ */
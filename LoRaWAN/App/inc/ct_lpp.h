@@ -0,0 +1,62 @@
+/*
+ * ct_lpp.h
+ *
+ *  Cayenne LPP encoder: channel, type and a big-endian value of the
+ *  type's size, repeated. Sizes and ranges come from one table, values
+ *  saturate to the range of their type and a channel that does not fit
+ *  the payload limit is left out whole. No HAL dependency, the ingest
+ *  side reads the same table, see tools/fleet_decode.
+ */
+
+#ifndef CT_LPP_H_
+#define CT_LPP_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Data types, IPSO object ID - 3200, and the value units */
+#define LPP_DATATYPE_DIGITAL_INPUT    0x00  // 1 byte
+#define LPP_DATATYPE_DIGITAL_OUTPUT   0x01  // 1 byte
+#define LPP_DATATYPE_ANALOG_INPUT     0x02  // 0.01, signed
+#define LPP_DATATYPE_ANALOG_OUTPUT    0x03  // 0.01, signed
+#define LPP_DATATYPE_ILLUMINANCE      0x65  // 1 lux
+#define LPP_DATATYPE_PRESENCE         0x66  // 1 byte
+#define LPP_DATATYPE_TEMPERATURE      0x67  // 0.1 C, signed
+#define LPP_DATATYPE_HUMIDITY         0x68  // 0.5 %
+#define LPP_DATATYPE_ACCELEROMETER    0x71  // x, y, z in 0.001 G, signed
+#define LPP_DATATYPE_BAROMETER        0x73  // 0.1 hPa
+#define LPP_DATATYPE_CONCENTRATION    0x7D  // 1 unit, 16 bits, extended LPP, myDevices does not know it
+#define LPP_DATATYPE_GYROMETER        0x86  // x, y, z in 0.01 deg/s, signed
+#define LPP_DATATYPE_GPS              0x88  // latitude, longitude in 1e-4 degree, altitude in 0.01 m, signed
+
+#define LPP_VALUES_MAX      3       // values of the widest type
+#define LPP_SIZE_MAX        11      // bytes of the widest channel, GPS
+
+/* Channels of this node */
+#define LPP_CH_PM2_5        0
+#define LPP_CH_PM10_0       1
+#define LPP_CH_BATTERY      2       // level in percent, a digital input
+#define LPP_CH_STATUS       3       // PAYLOAD_S_* flags, a digital input
+#define LPP_CH_LED          4
+
+typedef struct {
+  uint8_t *buff;
+  uint8_t  size;        // bytes written
+  uint8_t  max;         // payload limit of the data rate
+} lpp_t;
+
+void    lpp_init(lpp_t *lpp, uint8_t *buff, uint8_t max);
+uint8_t lpp_size(uint8_t type);
+uint8_t lpp_values(uint8_t type);
+uint8_t lpp_add(lpp_t *lpp, uint8_t channel, uint8_t type, int32_t value);
+uint8_t lpp_add_values(lpp_t *lpp, uint8_t channel, uint8_t type, const int32_t *values);
+int32_t lpp_value(const uint8_t *data, uint8_t type, uint8_t k);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CT_LPP_H_ */
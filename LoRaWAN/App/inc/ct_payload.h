@@ -0,0 +1,76 @@
+/*
+ * ct_payload.h
+ *
+ *  Versioned, bit-packed uplink payload for a single reading. The same
+ *  code encodes on the node and decodes on the ingest side, it has no
+ *  HAL dependency and builds on the host, see tools/payload.
+ *
+ *  Frame: byte 0 is PAYLOAD_TAG in bits 0..4 and the schema version in
+ *  bits 5..7, then fields MSB first with no byte alignment, zero padded
+ *  to a whole byte.
+ *
+ *  v1: fields mask (4), status (6), then the fields present in mask
+ *      order: PM2.5 (10), PM10 (10), battery (8), latitude (25, signed),
+ *      longitude (26, signed). PM values saturate at 1023.
+ *  v2: as v1 with PM values in a variable-length code of a 2-bit class
+ *      and 6, 8, 10 or 16 value bits, from 0, 64, 320 and 0, so both
+ *      channels carry the full 16-bit range and common values stay short.
+ *      PM2.5, PM10, battery and status take at most 8 bytes, the US915
+ *      DR0 payload is 11.
+ */
+
+#ifndef CT_PAYLOAD_H_
+#define CT_PAYLOAD_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PAYLOAD_TAG         21      // low 5 bits of byte 0, 17 to 20 and 22 are taken
+#define PAYLOAD_VERSION     2       // schema written by payload_encode(), v1 still decodes
+#define PAYLOAD_SIZE_MAX    15      // bytes with every field present and both PM values at 16 bits
+
+/* Fields, bit set when present */
+#define PAYLOAD_F_PM2_5     0x08
+#define PAYLOAD_F_PM10_0    0x04
+#define PAYLOAD_F_BATTERY   0x02
+#define PAYLOAD_F_LOCATION  0x01
+
+/* Status flags, the battery tier goes in bits 4..5 */
+#define PAYLOAD_S_SENSOR_ERR  0x01  // no reading this period
+#define PAYLOAD_S_LOW_BATT    0x02  // battery level below 5
+#define PAYLOAD_S_ALARM       0x04  // PM2.5 above the alarm threshold
+#define PAYLOAD_S_DISAGREE    0x08  // redundant sensors out of tolerance
+#define PAYLOAD_S_TIER_SHIFT  4
+#define PAYLOAD_S_TIER_MASK   0x30
+
+typedef struct {
+  uint8_t  fields;      // PAYLOAD_F_* present
+  uint8_t  status;      // PAYLOAD_S_* flags
+  uint16_t pm2_5;       // ug/m3, full range
+  uint16_t pm10_0;      // ug/m3, full range
+  uint8_t  battery;     // 1 (very low) to 254 (full), 0 unknown, 255 external supply
+  int32_t  latitude;    // 1e-5 degree
+  int32_t  longitude;   // 1e-5 degree
+} payload_t;
+
+typedef enum {
+  PAYLOAD_OK = 0,
+  PAYLOAD_ERR_SIZE,     // frame too short for the fields it announces, or buffer too small
+  PAYLOAD_ERR_TAG,      // not a payload frame
+  PAYLOAD_ERR_VERSION,  // schema version this decoder does not know
+  PAYLOAD_ERR_RANGE     // a location out of range
+} payload_result_t;
+
+uint8_t          payload_size(const payload_t *p);
+uint8_t          payload_encode(const payload_t *p, uint8_t *buff, uint8_t max);
+payload_result_t payload_decode(const uint8_t *buff, uint8_t size, payload_t *p);
+payload_result_t payload_decode_frame(const uint8_t *buff, uint8_t size, payload_t *p, uint8_t *used);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CT_PAYLOAD_H_ */
@@ -0,0 +1,63 @@
+/*
+ * ct_report.h
+ *
+ *  What the report timer sends. Send-on-delta and alarm policy against the
+ *  last accepted report, the batch of buffered readings with its step
+ *  encoding, and the choice of optional reading fields by data rate. The
+ *  log records of the readings wait here until the frame carrying them has
+ *  been accepted.
+ */
+
+#ifndef CT_REPORT_H_
+#define CT_REPORT_H_
+
+#include <stdint.h>
+#include "ct_stats.h"
+#include "ct_log.h"
+#include "ct_payload.h"
+
+#define REPORT_DELTA          5     // ug/m3, PM2.5 this far from the last report is sent
+#define REPORT_DELTA_PCT      20    // or this percent of the last report, if larger
+#define REPORT_MAX_SILENCE    (60 * 60000) // ms, a report goes out at least this often
+#define REPORT_ALARM          50    // ug/m3, crossing it is reported at once
+#define REPORT_ALARM_HYST     5     // ug/m3 below REPORT_ALARM that clears the alarm
+#define FIT_PM2_5             0x01  // optional parts of a reading frame, in priority order
+#define FIT_PM10_0            0x02
+#define FIT_BATTERY           0x04
+#define FIT_STATS             0x08  // burst stats after the frame, with SEND_BURST_STATS
+#define FIT_COUNT             4
+#define BATCH_MAX             24    // readings held, the oldest is dropped when full
+#define BATCH_TAG             18    // first byte of a batch frame, 17 starts a single reading
+#define BATCH_HEAD_SIZE       6     // tag, count, age of the first reading in s, its PM2.5
+#define BATCH_STEP_UNIT       LOG_TIME_UNIT // s per time step, backfill steps are exact
+#define BATCH_ENTRY_MAX       7     // bytes of a further reading with both steps escaped
+#define BATCH_ESC_DT          0xFF  // time step escape, the step follows in 24 bits
+#define BATCH_ESC_DV          0x80  // PM2.5 step escape, the value follows in 16 bits
+
+/* send-on-delta, period is the report timer's */
+void    report_init(uint32_t period);
+uint8_t report_alarm_check(uint16_t pm2_5);
+uint8_t report_alarm(void);
+uint8_t report_urgent(void);
+uint8_t report_due(uint8_t err, uint16_t pm2_5);
+void    report_sent(uint8_t err, uint16_t pm2_5);
+
+/* log records of the readings the next report stands for */
+void    report_log_push(const log_record_t *rec);
+void    report_log_reset(void);
+void    report_log_mark(void);
+
+/* buffered readings */
+void    report_batch_enable(uint8_t on);
+uint8_t report_batch_on(void);
+uint8_t report_batch_count(void);
+void    report_batch_push(uint16_t pm2_5, const log_record_t *rec);
+uint8_t report_batch_due(uint8_t max);
+uint8_t report_batch_encode(uint8_t *buff, uint8_t max, uint8_t tag, uint8_t *dropped);
+void    report_batch_sent(uint8_t carried);
+
+/* reading frame */
+uint8_t report_fit(payload_t *reading, uint8_t offer, uint8_t max, uint8_t stats_size);
+uint8_t report_step_encode(uint8_t *buff, uint32_t dt, uint16_t pm2_5, uint16_t prev);
+
+#endif /* CT_REPORT_H_ */
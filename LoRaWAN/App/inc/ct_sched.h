@@ -0,0 +1,34 @@
+/*
+ * ct_sched.h
+ *
+ *  Run-to-completion event scheduler for the main loop. ISRs and timer
+ *  callbacks post events, sched_run() serves them by priority and puts the
+ *  MCU in low power once none is pending.
+ */
+
+#ifndef CT_SCHED_H_
+#define CT_SCHED_H_
+
+#include <stdint.h>
+
+/* Events, in priority order, a lower value is always served first */
+typedef enum {
+  SCHED_EV_MAC = 0,   // LoRaMacProcess(), never waits behind sensor work
+  SCHED_EV_HONEY,     // Honeywell command results and stream bytes
+  SCHED_EV_WARMUP,    // warm-up read is due
+  SCHED_EV_BURST,     // burst read is due
+  SCHED_EV_REPORT,    // TX timer or an early report, sends the sample store
+  SCHED_EV_APP,       // sample timer, start of a measurement cycle
+  SCHED_EV_CLI,       // setting mode console input or timeout
+  SCHED_EV_COUNT
+} sched_event_t;
+
+typedef void (*sched_handler_t)(void);
+
+void    sched_init(void);
+void    sched_register(sched_event_t ev, sched_handler_t handler);
+void    sched_post(sched_event_t ev);
+uint8_t sched_pending(void);
+void    sched_run(void);
+
+#endif /* CT_SCHED_H_ */
@@ -0,0 +1,34 @@
+/*
+ * ct_stats.h
+ *
+ *  Fixed-point burst statistics over a small integer ring buffer.
+ *  No floats, no heap, safe to use on the measurement path.
+ */
+
+#ifndef CT_STATS_H_
+#define CT_STATS_H_
+
+#include <stdint.h>
+
+#define STATS_RING_SIZE 16 // max samples kept per burst
+
+typedef struct {
+  uint16_t buff[STATS_RING_SIZE];
+  uint8_t  head;  // next write index
+  uint8_t  count; // samples in the ring, saturates at STATS_RING_SIZE
+} stats_ring_t;
+
+typedef struct {
+  uint16_t median;
+  uint16_t mean_x10; // mean in 0.1 units, rounded
+  uint16_t min;
+  uint16_t max;
+  uint8_t  count;
+} stats_summary_t;
+
+void    stats_reset(stats_ring_t *ring);
+void    stats_push(stats_ring_t *ring, uint16_t value);
+void    stats_merge(stats_ring_t *dst, const stats_ring_t *src);
+uint8_t stats_summarise(const stats_ring_t *ring, stats_summary_t *summary);
+
+#endif /* CT_STATS_H_ */
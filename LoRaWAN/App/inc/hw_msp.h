@@ -138,6 +138,13 @@ void HW_ExitStopMode(void);
   */
 void HW_EnterSleepMode(void);
 
+/*!
+ * \brief Keeps a UART running through stop mode so that it can wake the MCU
+ *
+ * \param [IN] huart UART clocked from LSE or HSI16, NULL to release it
+ */
+void HW_SetStopWakeUart(UART_HandleTypeDef *huart);
+
 typedef enum
 {
   e_LOW_POWER_RTC = (1 << 0),
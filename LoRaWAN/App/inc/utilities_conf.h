@@ -34,6 +34,8 @@ typedef enum
   LPM_GPS_Id = (1 << 3),
   LPM_UART_RX_Id = (1 << 4),
   LPM_UART_TX_Id = (1 << 5),
+  LPM_HONEY_Id = (1 << 6),
+  LPM_CLI_Id = (1 << 7),
 } LPM_Id_t;
 
 #define OutputInit  vcom_Init
@@ -46,6 +46,13 @@ void vcom_Init(void (*Txcb)(void));
 */
 void vcom_Trace(uint8_t *p_data, uint16_t size);
 
+/**
+* @brief  enable or drop the trace, dropping it keeps the DMA and the port idle
+* @param  enable 0 to drop the trace
+* @return None
+*/
+void vcom_TraceEnable(uint8_t enable);
+
 /**
 * @brief  DeInit the VCOM.
 * @param  None
@@ -81,6 +88,14 @@ void vcom_IRQHandler(void);
 */
 void vcom_DMA_TX_IRQHandler(void);
 
+/**
+* @brief  a transmission has completed on a UART other than the vcom one,
+*         weak, the application overrides it
+* @param  huart handle of that UART
+* @return None
+*/
+void vcom_UartTxCpltCallback(UART_HandleTypeDef *huart);
+
 #ifdef __cplusplus
 }
 #endif
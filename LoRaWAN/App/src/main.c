@@ -27,6 +27,16 @@
 #include "version.h"
 
 #include "ct_honey.h"
+#include "ct_stats.h"
+#include "ct_sched.h"
+#include "ct_log.h"
+#include "ct_energy.h"
+#include "ct_payload.h"
+#include "ct_config.h"
+#include "ct_lpp.h"
+#include "ct_cli.h"
+#include "ct_report.h"
+#include "ct_cmd.h"
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
@@ -37,17 +47,23 @@
  * CAYENNE_LPP is myDevices Application server.
  */
 //#define CAYENNE_LPP
-#define LPP_DATATYPE_DIGITAL_INPUT  0x0
-#define LPP_DATATYPE_DIGITAL_OUTPUT 0x1
-#define LPP_DATATYPE_HUMIDITY       0x68
-#define LPP_DATATYPE_TEMPERATURE    0x67
-#define LPP_DATATYPE_BAROMETER      0x73
+//#define LPP_PM_CONCENTRATION      // PM in the extended LPP concentration type at full range, else analog inputs that saturate at 327
 #define LPP_APP_PORT 99
 /*!
- * Defines the application data transmission duty cycle. 5s, value in [ms].
+ * Defines the application data transmission duty cycle. 15min, value in [ms].
  */
-#define APP_TX_DUTYCYCLE                            60000
+#define APP_TX_DUTYCYCLE                            900000
+/*!
+ * Defines the measurement duty cycle, readings wait in the sample store
+ * for the next transmission. 5min, value in [ms].
+ */
+#define APP_SAMPLE_DUTYCYCLE                        300000
 #define SETTING_MODE_DUTYCYCLE						5000
+/*!
+ * HONEY_STREAMING makes the sensor autosend during warm-up, frames are received
+ * by circular DMA instead of being polled. DMA keeps the MCU out of STOP mode.
+ */
+//#define HONEY_STREAMING
 /*!
  * LoRaWAN Adaptive Data Rate
  * @note Please note that when ADR is enabled the end-device should be static
@@ -113,9 +129,89 @@ static void LoraStartTx(TxEventType_t EventType);
 /* tx timer callback function*/
 static void OnTxTimerEvent(void *context);
 
+/* sample timer callback*/
+static void OnSampleTimerEvent(void *context);
+
 /* tx timer callback function*/
 static void LoraMacProcessNotify(void);
 
+/* call back when a Honeywell command result is pending*/
+static void HoneyProcessNotify(void);
+static void CliNotify(void);
+
+/* scheduler event handlers, run to completion from sched_run()*/
+static void OnMacEvent(void);
+static void OnHoneyEvent(void);
+static void OnWarmupEvent(void);
+static void OnBurstEvent(void);
+static void OnReportEvent(void);
+static void OnAppEvent(void);
+static void OnCliEvent(void);
+
+/* a cycle step issued to one sensor, the signature of honey_start_async and friends*/
+typedef honey_cmd_resp_t (*honey_step_t)(honey_t *honey, honey_cb_t cb);
+
+/* operating tiers, LORA_GetBatteryLevel() below level enters a tier*/
+typedef enum {
+  BATT_TIER_NORMAL = 0,
+  BATT_TIER_SAVE,
+  BATT_TIER_LOW,
+  BATT_TIER_CRITICAL,
+  BATT_TIER_COUNT
+} batt_tier_t;
+
+typedef struct {
+  uint8_t  level;       // battery level, 1 to 254, below which the tier applies
+  uint32_t sample_ms;   // measurement period
+  uint16_t warmup_max;  // ms, longest warm-up
+  uint8_t  trace;       // debug trace on the VCOM port
+  uint8_t  batch;       // readings go out batched
+} batt_tier_conf_t;
+
+/* run a step on all sensors and join their completions*/
+static uint8_t HoneyActive(uint8_t i);
+static void HoneyCycleStart(void);
+static void HoneyStep(honey_step_t step, honey_cb_t cb);
+static uint8_t HoneyStepDone(honey_t *sensor, honey_cmd_resp_t resp);
+static honey_cmd_resp_t HoneyReadStep(honey_t *sensor, honey_cb_t cb);
+static honey_cmd_resp_t HoneyPowerOffStep(honey_t *sensor, honey_cb_t cb);
+static uint8_t HoneyGate(void);
+static void HoneyErrorTotals(honey_errors_t *total);
+static uint8_t HoneyDiagAppend(uint8_t *buff);
+
+/* send-on-delta reporting, the sampling keeps the TX timer pace*/
+static void ReadingFill(payload_t *reading, uint8_t sensor_err, uint8_t low_batt);
+static uint8_t TxMaxPayload(void);
+static uint8_t FrameTag(uint8_t tag);
+static void BattTierUpdate(void);
+static uint8_t LogBacklog(void);
+static void LogDrain(void);
+static uint8_t LogEncode(uint8_t *buff, uint8_t max, const log_record_t *rec, uint8_t n, uint8_t *count);
+static void EnergyUplink(void);
+static uint8_t EnergyDiagDue(void);
+static uint8_t DevInfoDue(void);
+static void DevInfoSend(void);
+static void EnergyDiagSend(void);
+
+/* measurement cycle steps, called on Honeywell command completion*/
+static void OnHoneyPowered(honey_t *honey, honey_cmd_resp_t resp);
+static void OnHoneyStarted(honey_t *honey, honey_cmd_resp_t resp);
+static void OnWarmupTimerEvent(void *context);
+static void HoneyWarmupPoll(void);
+static void OnWarmupRead(honey_t *honey, honey_cmd_resp_t resp);
+static void HoneyBurstStart(void);
+static void OnBurstTimerEvent(void *context);
+static void HoneyBurstDone(void);
+static void OnHoneyRead(honey_t *honey, honey_cmd_resp_t resp);
+static void OnHoneyStopped(honey_t *honey, honey_cmd_resp_t resp);
+static void CliMeasureDone(void);
+static uint8_t CliSensorBusy(void);
+static void OnCliCoefSet(honey_t *honey, honey_cmd_resp_t resp);
+static void OnCliChecked(honey_t *honey, honey_cmd_resp_t resp);
+#ifdef HONEY_STREAMING
+static void OnHoneyStreamStopped(honey_t *honey, honey_cmd_resp_t resp);
+#endif
+
 /* Private variables ---------------------------------------------------------*/
 /* load Main call backs structure*/
 static LoRaMainCallback_t LoRaMainCallbacks = { LORA_GetBatteryLevel,
@@ -128,15 +224,16 @@ static LoRaMainCallback_t LoRaMainCallbacks = { LORA_GetBatteryLevel,
                                                 LORA_TxNeeded,
                                                 LoraMacProcessNotify
                                               };
-LoraFlagStatus LoraMacProcessRequest = LORA_RESET;
-LoraFlagStatus AppProcessRequest = LORA_RESET;
 /*!
  * Specifies the state of the application LED
  */
 static uint8_t AppLedStateOn = RESET;
 
 static TimerEvent_t TxTimer;
+static TimerEvent_t SampleTimer;
 static TimerEvent_t SettingTimer;
+static TimerEvent_t WarmupTimer;
+static TimerEvent_t BurstTimer;
 
 #ifdef USE_B_L072Z_LRWAN1
 /*!
@@ -163,19 +260,12 @@ static void initTim6(void);
 static void OnSettingModeElapsed(void *context);
 static void StartSettingModeElapsed();
 
-// CLI fns
-void extractCmd(uint8_t cmd[], uint8_t* cmdtype, uint8_t* cmdarg);
-int32_t ascii2hex_num(uint8_t src[]);
-
 
 /* Private Vars --------------------------------------------------------------*/
 UART_HandleTypeDef huart1;
 UART_HandleTypeDef hlpuart1;
 TIM_HandleTypeDef  htim6;
 
-//#define SEND_GEO_DATA // for sending only geo data
-//#define DATA_TOGGLING // for toggling data sending between pm2.5 and geolocation
-uint8_t send_pm_toggler = 1;
 
 // mode control
 volatile uint8_t setting_mode = 0;
@@ -183,31 +273,110 @@ volatile uint8_t setting_mode_timeout_count = 0;
 #define SETTING_MODE_TIMEOUT_COUNT_MAX 25
 
 // honey vars
-#define HONEY_WARMUP_DURATION 10000
-honey_t honey;
+#define HONEY_WARMUP_DURATION 10000 // max total fan-on time, the MCU sleeps through it
+#define HONEY_BURST_COUNT     5     // reads per cycle, at most STATS_RING_SIZE
+#define HONEY_BURST_SPACING   1000  // ms between burst reads, the burst ends the fan-on time
+#define HONEY_WARMUP_MIN      2000  // ms, warm-up is never shorter than this
+#define HONEY_WARMUP_MAX      (HONEY_WARMUP_DURATION - (HONEY_BURST_COUNT - 1) * HONEY_BURST_SPACING)
+#define HONEY_WARMUP_POLL     1000  // ms between warm-up reads
+#define HONEY_WARMUP_TOL      2     // ug/m3, successive reads within this are settled
+#define HONEY_WARMUP_TOL_PCT  10    // or within this percent of the previous read, if larger
+#define HONEY_WARMUP_SETTLED  2     // settled steps in a row that end the warm-up
+//#define SEND_BURST_STATS          // append mean, min, max and count of the stored readings, and warm-up, to the uplink
+//#define HONEY_REDUNDANT           // second sensor on USART1, the setting mode CLI takes the port over
+#ifdef HONEY_REDUNDANT
+#define HONEY_SENSOR_COUNT    2
+#else
+#define HONEY_SENSOR_COUNT    1
+#endif
+#define HONEY_VOTE_TOL        5     // ug/m3, sensor medians further apart than this disagree
+#define HONEY_VOTE_TOL_PCT    20    // or this percent of the fused value, if larger
+#if (HONEY_BURST_COUNT * HONEY_SENSOR_COUNT) > STATS_RING_SIZE
+#error "the pooled burst does not fit in a stats ring"
+#endif
+#define BURST_STATS_SIZE      8     // bytes of burst stats in the parts section
+#define PARTS_TAG             22    // parts section after the reading or batch, bits 5..7 list what follows
+#define PARTS_STATS           0x20  // burst stats, SEND_BURST_STATS
+#define PARTS_SENSORS         0x40  // sensors byte, HONEY_REDUNDANT
+#define HONEY_DIAG_EVERY      24    // every Nth uplink carries the error counters
+#define HONEY_DIAG_PORT       4     // port of uplinks that carry them
+#define HONEY_DIAG_SIZE       5     // bytes of error counters
+#define HONEY_GATE_MIN_OFF    20000 // ms, a sensor idle longer than this is powered off, else its fan is stopped
+#define TX_FALLBACK_SIZE      11    // bytes, smallest payload of any data rate, US915 DR0 and AS923 DR2 with dwell time
+//#define SEND_BATCH                // every reading is buffered, they go out together in one frame, else from BATT_TIER_LOW
+#define LOG_DRAIN_PORT        5     // port of backfill uplinks
+#define LOG_DRAIN_TAG         19    // first byte of a backfill frame
+#define LOG_DRAIN_MAX         24    // readings per backfill frame, at most
+#define LOG_HEAD_SIZE         7     // tag, count, age of the first reading in s (24 bits), its PM2.5
+#define ENERGY_DIAG_PORT      6     // port of energy accounting uplinks
+#define ENERGY_DIAG_TAG       20    // first byte of an energy frame
+#define ENERGY_DIAG_PERIOD    (6 * 3600000UL) // ms, energy totals go out this often
+#define ENERGY_DIAG_UNIT      10    // uAh per count of the 16-bit totals, they wrap
+#define DEVINFO_PORT          7     // port of device info uplinks, a ct_payload frame
+#define DEVINFO_PERIOD        (24 * 3600000UL) // ms, device info goes out this often
+#define SLOT_WAIT_MAX         4     // report slots a due info frame yields to readings, then it takes one
+#if (APP_TX_DUTYCYCLE / APP_SAMPLE_DUTYCYCLE) > STATS_RING_SIZE
+#error "the sample store holds STATS_RING_SIZE readings per report"
+#endif
+#define BATT_TIER_HYST        8     // battery levels above its threshold that leave a tier
+#define BATT_TIER_SHIFT       5     // the tier goes in bits 5..6 of the first payload byte
+honey_t honey[HONEY_SENSOR_COUNT];                  // honey[0] on LPUART1, honey[1] on USART1
+#ifdef HONEY_STREAMING
+uint8_t honey_stream_buff[HONEY_SENSOR_COUNT][2 * HONEY_AUTOSEND_FRAME_SIZE];
+#endif
+uint8_t          honey_cycle = 0;                   // a measurement cycle is running
+uint8_t          cli_measure = 0;                   // the console waits for the cycle's result
+uint8_t          cli_honey = 0;                     // a console command is on the sensor
+TimerTime_t      honey_cycle_start = 0;             // power-up time of this cycle
+uint8_t          honey_pending = 0;                 // sensors yet to complete the current step
+honey_cmd_resp_t honey_step_resp[HONEY_SENSOR_COUNT]; // per-sensor result of the current step
+honey_cmd_resp_t honey_read_status = CMD_RESP_IDLE; // result of the last cycle's burst
+uint8_t          honey_sensors_ok = 0;              // sensors with at least one burst read
+uint8_t          honey_disagree = 0;                // sensor medians are out of tolerance
+uint8_t          burst_reads = 0;                   // reads attempted in this burst
+uint16_t         honey_last_frame[HONEY_SENSOR_COUNT]; // stream frame count at the last read
+uint8_t          honey_diag_count = 0;              // uplinks since the last error report
+honey_errors_t   honey_errors_sent;                 // totals at the last error report
+TimerTime_t      warmup_start = 0;                  // fan start time of this cycle
+uint16_t         warmup_last = 0;                   // previous warm-up PM2.5 read
+uint8_t          warmup_valid = 0;                  // warmup_last holds a read
+uint8_t          warmup_settled = 0;                // settled steps in a row
+uint16_t         warmup_ms = 0;                     // warm-up time of the last cycle
+uint16_t         warmup_avg_ms = HONEY_WARMUP_MAX;  // learned warm-up time, 1/8 moving average
+stats_ring_t     pm2_5_ring[HONEY_SENSOR_COUNT];
+stats_ring_t     pm10_0_ring[HONEY_SENSOR_COUNT];
+stats_summary_t  pm2_5_stats;
+stats_summary_t  pm10_0_stats;
+stats_ring_t     sample_store;                      // cycle medians since the last report
+stats_summary_t  sample_stats;                      // summary of the store when it is reported
+stats_ring_t     sample_store10_0;                  // PM10 cycle medians, alongside sample_store
+stats_summary_t  sample_stats10_0;
+honey_cmd_resp_t sample_status = CMD_RESP_IDLE;     // the store held a reading
+uint8_t          sample_failed = 0;                 // a cycle since the last report had no reading
+uint32_t         sample_ms = APP_SAMPLE_DUTYCYCLE;  // measurement period of the tier
+uint16_t         warmup_max = HONEY_WARMUP_MAX;     // longest warm-up of the tier
+batt_tier_t      batt_tier = BATT_TIER_NORMAL;
+TimerTime_t      energy_diag_time = 0;              // time the last energy frame completed
+uint8_t          energy_diag_phase = 0;             // first phase of the next energy frame
+uint8_t          energy_diag_waited = 0;            // report slots the energy frame was due but held back
+TimerTime_t      devinfo_time = 0;                  // time of the last device info frame
+uint8_t          devinfo_pending = 1;               // config changed, device info is due now
+uint8_t          devinfo_waited = 0;                // report slots device info was due but held back
+
+/* each tier stretches the previous one, a level below 5 is flagged in the status*/
+static const batt_tier_conf_t batt_tiers[BATT_TIER_COUNT] = {
+  { 255, APP_SAMPLE_DUTYCYCLE,     HONEY_WARMUP_MAX, 1, 0 },  // above 2.5 V on a CR2032 scale
+  { 150, 2 * APP_SAMPLE_DUTYCYCLE, 4000,             1, 0 },
+  {  80, 4 * APP_SAMPLE_DUTYCYCLE, 3000,             0, 1 },  // below 2.2 V
+  {  30, 8 * APP_SAMPLE_DUTYCYCLE, HONEY_WARMUP_MIN, 0, 1 },  // below 1.95 V
+};
 
 /* CLI VARS Begin ------------------------------------------------------------*/
-#define RX_BUFF_SIZE 80
-
-typedef struct lineBuff {
-  uint8_t fullFlag;
-  uint8_t cmdReady;
-  uint8_t count;
-  uint8_t buff[RX_BUFF_SIZE];
-} lineBuff;
-
-lineBuff cmdBuff;
-uint8_t* ptrBuff = &cmdBuff.buff[0];
-
 HAL_StatusTypeDef status = HAL_OK;
 
 // cmd prompts
 uint8_t prompt[] = "\r\nchulanaruk > ";
-uint8_t cmd_fail[] = "Error! Command not recognised.";
 uint8_t cmd_overflow[] = "Error! Buffer overflowed. Restarting buffer...";
-
-uint8_t reflect_ch = 0; // used for character reflection
-uint8_t backspace_ch = 0;
 /* CLI VARS End --------------------------------------------------------------*/
 
 /**
@@ -232,17 +401,24 @@ int main(void)
   /* Configure the hardware*/
   HW_Init();
 
+  /* Main loop events, MAC first so that sensor work never delays it*/
+  sched_init();
+  sched_register(SCHED_EV_MAC, OnMacEvent);
+  sched_register(SCHED_EV_HONEY, OnHoneyEvent);
+  sched_register(SCHED_EV_WARMUP, OnWarmupEvent);
+  sched_register(SCHED_EV_BURST, OnBurstEvent);
+  sched_register(SCHED_EV_REPORT, OnReportEvent);
+  sched_register(SCHED_EV_APP, OnAppEvent);
+  sched_register(SCHED_EV_CLI, OnCliEvent);
+
   // Init connectivity peripherals
   initTim6();
   initUart1();
+  cli_init(&huart1, CliNotify);
   initLpUart1();
   initUserBtn();
 
   /* USER CODE BEGIN 1 */
-  volatile uint32_t time = 0;
-  volatile uint32_t time_tick = 0;
-  volatile uint32_t time_ms = 0;
-
 
   /* USER CODE END 1 */
 
@@ -259,247 +435,1091 @@ int main(void)
 
   LoraStartTx(TX_ON_TIMER);
 
-  	if (honey_init(hlpuart1, &honey) != CMD_RESP_SUCCESS) {
+  	// sensors are powered through load switches, honey_init() boots them
+  	honey_set_power(&honey[0], HONEY_PWR_PORT, HONEY_PWR_PIN);
+#ifdef HONEY_REDUNDANT
+  	honey_set_power(&honey[1], HONEY2_PWR_PORT, HONEY2_PWR_PIN);
+#endif
+  	if (honey_init(&hlpuart1, &honey[0]) != CMD_RESP_SUCCESS) {
   		PRINTF("[e] ERROR! Cannot init Honeywell Sensor.\r\n");
   	}
+  	// LPUART1 runs on LSE, STOP while the sensor prepares its answer
+  	honey_set_stop_wake(&honey[0], 1);
+#ifdef HONEY_REDUNDANT
+  	if (honey_init(&huart1, &honey[1]) != CMD_RESP_SUCCESS) {
+  		PRINTF("[e] ERROR! Cannot init second Honeywell Sensor.\r\n");
+  	}
+#endif
+  	for (uint8_t i = 0; i < HONEY_SENSOR_COUNT; ++i) {
+  		honey_set_notify(&honey[i], HoneyProcessNotify);
+  	}
 
-  // LOOP
+  	// time and charge per phase from here on
+  	energy_init();
+
+  	// readings from before a reset that never went out are backfilled
+  	log_init();
+  	PRINTF("[i] Log holds %u unsent readings, wear %lu writes\r\n", log_backlog(), (unsigned long) log_wear());
+
+  	// the first report is due, later ones are compared with the last sent
+  	report_init(APP_TX_DUTYCYCLE);
+#ifdef SEND_BATCH
+  	report_batch_enable(1);
+#endif
+
+  	TimerInit(&WarmupTimer, OnWarmupTimerEvent);
+  	TimerSetValue(&WarmupTimer, HONEY_WARMUP_MIN);
+  	TimerInit(&BurstTimer, OnBurstTimerEvent);
+  	TimerSetValue(&BurstTimer, HONEY_BURST_SPACING);
+
+  // LOOP, events are served by priority, the MCU sleeps when none is left
   while (1)
   {
-	if (!setting_mode) {
-	/* Normal Mode Start ---------------------------------------------------- */
-		if (AppProcessRequest == LORA_SET)
-		{
-		  /*reset notification flag*/
-		  AppProcessRequest = LORA_RESET;
-		  /*Send*/
-		  PRINTF("STARTING UP PM2.5 MEASUREMENT...\r\n");
-		  honey_start(&honey);
-		  HAL_Delay(HONEY_WARMUP_DURATION);
-
-		  PRINTF("Transmitting PM2.5 Concentration...\r\n");
-		  Send(NULL);
-
-		  honey_stop(&honey);
-		  PRINTF("---TRANSMISSION COMPLETED---\r\n");
-		}
-		if (LoraMacProcessRequest == LORA_SET)
-		{
-		  /*reset notification xcflag*/
-		  LoraMacProcessRequest = LORA_RESET;
-		  LoRaMacProcess();
-		}
-		/*If a flag is set at this point, mcu must not enter low power and must loop*/
-		DISABLE_IRQ();
-
-	    /* if an interrupt has occurred after DISABLE_IRQ, it is kept pending
-	     * and cortex will not enter low power anyway  */
-		if ((LoraMacProcessRequest != LORA_SET) && (AppProcessRequest != LORA_SET))
-		{
-
-		LPM_EnterLowPower();
-//#ifndef LOW_POWER_DISABLE
-//    LPM_EnterLowPower();
-//#endif
-	    }
+	sched_run();
+  }
+}
 
-	    ENABLE_IRQ();
-	/* Normal Mode End ------------------------------------------------------ */
-	}
-	else {
-	/* Setting Mode Start --------------------------------------------------- */
-		// timeout control
-		if (setting_mode_timeout_count == SETTING_MODE_TIMEOUT_COUNT_MAX) {
-			PRINTF("\r\n[i] SETTING MODE TIMEOUT, entering normal mode...\r\n");
-			status = HAL_UART_Transmit(&huart1, (uint8_t*) "\r\nSETTING MODE TIMEOUT, entering normal mode...\r\n", \
-				strlen("\r\nSETTING MODE TIMEOUT, entering normal mode...\r\n"), 100);
-			assert_param(status == HAL_OK);
 
-			TimerStop(&SettingTimer); // stop setting mode timer
-			TimerReset(&SettingTimer);
-			setting_mode = 0; // change mode to normal
-			LoraStartTx(TX_ON_TIMER); // start txtimer
+static void OnMacEvent(void)
+{
+  LoRaMacProcess();
+}
 
-			LPM_EnterLowPower();
-		}
+static void OnHoneyEvent(void)
+{
+  // Honeywell command results are handled in both modes
+  for (uint8_t i = 0; i < HONEY_SENSOR_COUNT; ++i) {
+    honey_process(&honey[i]);
+  }
+}
 
-/* CLI Control Start ---------------------------------------------------------*/
-		// COMMAND PROCESSING
-		if (cmdBuff.fullFlag) {
-			// By this point the UART interrupts have been disabled
-			// Send error message
-			status = HAL_UART_Transmit_IT(&huart1, &cmd_overflow[0], sizeof(cmd_overflow));
-			assert_param(status == HAL_OK);
+static void OnWarmupEvent(void)
+{
+  HoneyWarmupPoll();
+}
 
-			// Clear full flag, count, and buffer
-			cmdBuff.count = 0;
-			cmdBuff.fullFlag = 0;
-			memset(&cmdBuff.buff, 0x00, sizeof(cmdBuff.buff));
+static void OnBurstEvent(void)
+{
+  HoneyStep(HoneyReadStep, OnHoneyRead);
+}
 
-			// Enable reception again
-			status = HAL_UART_Receive_IT(&huart1, &cmdBuff.buff[0], sizeof(uint8_t));
-			assert_param(status == HAL_OK);
-		}
+static void OnReportEvent(void)
+{
+  uint8_t due    = 0;
+  uint8_t report = 0;
+  uint8_t batch  = 0;
+  uint8_t info   = 0;
+  uint8_t energy = 0;
+  uint8_t joined = (LORA_JoinStatus() == LORA_SET);
+
+  // the TX timer is stopped in setting mode, a late event is dropped
+  if (setting_mode) return;
+
+  // the store stands for the period, its median is the report. A tier
+  // that samples less often than it reports leaves periods without a cycle
+  if (stats_summarise(&sample_store, &sample_stats) > 0) {
+    sample_status = CMD_RESP_SUCCESS;
+  } else {
+    sample_status = sample_failed ? CMD_RESP_ERR : CMD_RESP_IDLE;
+  }
+  stats_summarise(&sample_store10_0, &sample_stats10_0);
+  stats_reset(&sample_store);
+  stats_reset(&sample_store10_0);
+  sample_failed = 0;
+
+  // energy totals and device info take a slot without a live report
+  report = (sample_status != CMD_RESP_IDLE &&
+            report_due(sample_status != CMD_RESP_SUCCESS, sample_stats.median));
+
+  // the batch waits until it fills a frame, unless the silence, an alarm
+  // or a sensor error forces a report. One left over from a batching
+  // tier goes out at once
+  batch = (report_batch_count() > 0) &&
+          (report || !report_batch_on() || report_batch_due(TxMaxPayload()));
+  due = report || batch;
+
+  // readings close to an accepted report are covered by it, the others
+  // stay unsent until Send() has a frame carrying them accepted
+  if (!report && joined && !report_batch_on() && sample_status == CMD_RESP_SUCCESS) {
+    report_log_mark();
+  }
+
+  // in changing air every slot carries a report, a frame held back
+  // SLOT_WAIT_MAX slots takes one and the report waits a period. An alarm
+  // is never held back, and an overdue energy frame goes before device
+  // info that is only due
+  info   = (joined && DevInfoDue()) ? 1 : 0;
+  energy = (joined && EnergyDiagDue()) ? 1 : 0;
+  if (info && devinfo_waited >= SLOT_WAIT_MAX && !report_urgent()) info = 2;
+  if (energy && energy_diag_waited >= SLOT_WAIT_MAX && !report_urgent()) energy = 2;
+
+  if (info == 2 || (info && !due && energy < 2)) {
+    DevInfoSend();
+  } else if (energy == 2 || (energy && !due)) {
+    EnergyDiagSend();
+  } else {
+    if (due) {
+      PRINTF("Transmitting PM2.5 Concentration, %u buffered...\r\n", report_batch_count());
+      Send(NULL);
+    } else {
+      if (report_batch_on()) {
+        PRINTF("[i] %u readings buffered, uplink skipped.\r\n", report_batch_count());
+      } else {
+        PRINTF("[i] PM2.5 %u close to the last report, uplink skipped.\r\n", sample_stats.median);
+      }
+    }
+
+    // a report slot left free carries logged readings instead
+    if (!due && joined && LogBacklog() > 0) {
+      LogDrain();
+    }
+  }
+  if (DevInfoDue()) {
+    if (devinfo_waited < SLOT_WAIT_MAX) devinfo_waited++;
+  }
+  if (EnergyDiagDue()) {
+    if (energy_diag_waited < SLOT_WAIT_MAX) energy_diag_waited++;
+  }
+  report_log_reset();
+}
 
-		if (backspace_ch) {
-			status = HAL_UART_Transmit_IT(&huart1, (uint8_t *) "\177", sizeof(uint8_t));
+static void OnAppEvent(void)
+{
+  // the sample timer is stopped in setting mode, a late event is dropped
+  if (setting_mode) return;
+
+  /*Start the measurement, the cycle continues in OnHoneyPowered*/
+  PRINTF("STARTING UP PM2.5 MEASUREMENT...\r\n");
+  if (honey_cycle || cli_honey) {
+	  PRINTF("[e] Sensor busy, measurement skipped.\r\n");
+  } else {
+	  // VDD is read before the fan loads it
+	  BattTierUpdate();
+	  HoneyCycleStart();
+  }
+}
+
+static void OnCliEvent(void)
+{
+	const uint8_t *line = NULL;
+	cli_line_t line_res = CLI_LINE_NONE;
+
+	if (!setting_mode) return;
+
+	// timeout control
+	if (setting_mode_timeout_count == SETTING_MODE_TIMEOUT_COUNT_MAX) {
+		PRINTF("\r\n[i] SETTING MODE TIMEOUT, entering normal mode...\r\n");
+		cli_stop(); // stop reception
+		status = cli_write((uint8_t*) "\r\nSETTING MODE TIMEOUT, entering normal mode...\r\n", \
+			strlen("\r\nSETTING MODE TIMEOUT, entering normal mode...\r\n"));
+		assert_param(status == HAL_OK);
+
+		TimerStop(&SettingTimer); // stop setting mode timer
+		TimerReset(&SettingTimer);
+		setting_mode = 0; // change mode to normal
+		cli_measure = 0;
+		LPM_SetStopMode(LPM_CLI_Id, LPM_Enable);
+		energy_stop(ENERGY_CLI);
+		LoraStartTx(TX_ON_TIMER); // start txtimer
+	}
+
+/* CLI Control Start ---------------------------------------------------------*/
+	// COMMAND PROCESSING, a line at a time of what the DMA has received,
+	// input keeps landing in the ring while a command runs
+	while (setting_mode && (line_res = cli_poll(&line)) != CLI_LINE_NONE) {
+		if (line_res == CLI_LINE_OVERFLOW) {
+			// the rest of the line is dropped up to its CR
+			status = cli_write(&cmd_overflow[0], sizeof(cmd_overflow));
 			assert_param(status == HAL_OK);
-			backspace_ch = 0;
+			continue;
 		}
 
-		if (cmdBuff.cmdReady) {
-			// set the last char of a command to null terminator
-			cmdBuff.buff[cmdBuff.count] = '\0';
-
-			if (cmdBuff.count > 0) {
-				// process command
-				// extract string to command type and positional arguments
-				uint8_t cmd_type[10] = {0};
-				uint8_t cmd_arg[5] = {0};
-				int32_t cmd_argval = 0;
-
-				extractCmd(cmdBuff.buff, cmd_type, cmd_arg);
-				cmd_argval = ascii2hex_num(cmd_arg);
-
-				if(strcmp("setcoef", (const char*)cmd_type) == 0) {
-					if (cmd_argval >= 30 && cmd_argval <= 200) {
-						// argument is correct
-						// unlock eeprom
-						if ((FLASH->PECR & FLASH_PECR_PELOCK) != 0)
-						{
-							FLASH->PEKEYR = FLASH_PEKEY1;
-							FLASH->PEKEYR = FLASH_PEKEY2;
-						}
-
-						// write data to eeprom
-						*(uint8_t *)(DATA_EEPROM_BASE) = cmd_argval;
-
-						// lock eeprom
-						FLASH->PECR |= FLASH_PECR_PELOCK;
-
-						// set coef at sensor
-						honey_set_coef(&honey, cmd_argval);
-
-						status = HAL_UART_Transmit_IT(&huart1, (uint8_t*) "\r\nSet Coef Success!\r\n", \
-							strlen("\r\nSet Coef Success!\r\n"));
-						assert_param(status == HAL_OK);
-					}
-					else {
-						// argument error
-						status = HAL_UART_Transmit_IT(&huart1, (uint8_t*) "\r\nSet Coef Argument Error!\r\n", \
-								strlen("\r\nSet Coef Argument Error!\r\n"));
-						assert_param(status == HAL_OK);
+		if (line[0] != '\0') {
+			// process command
+			// extract string to command type and positional arguments
+			uint8_t cmd_type[CMD_TYPE_SIZE] = {0};
+			uint8_t cmd_arg[CMD_ARG_SIZE] = {0};
+			int32_t cmd_argval = 0;
+			uint8_t cmd_argok = 0;          // the argument is a number, setters need it
+
+			// a command or argument too long is no command, cmd_type stays empty
+			if (!cmd_extract(line, cmd_type, sizeof(cmd_type), cmd_arg, sizeof(cmd_arg))) {
+				cmd_type[0] = '\0';
+			}
+			cmd_argok = cmd_number(cmd_arg, &cmd_argval);
+
+			if(strcmp("setcoef", (const char*)cmd_type) == 0) {
+				if (!cmd_argok || cmd_argval < 30 || cmd_argval > 200) {
+					// argument error
+					status = cli_write((uint8_t*) "\r\nSet Coef Argument Error!\r\n", \
+							strlen("\r\nSet Coef Argument Error!\r\n"));
+					assert_param(status == HAL_OK);
+				}
+				else if (!CliSensorBusy()) {
+					// the result follows in OnCliCoefSet, the MAC is served meanwhile
+					cli_honey = 1;
+					if (honey_cmd_async(&honey[0], HONEY_CMD_SETCOEF, cmd_argval, OnCliCoefSet) != CMD_RESP_SUCCESS) {
+						OnCliCoefSet(&honey[0], CMD_RESP_ERR);
 					}
 				}
-				else if (strcmp("readcoef", (const char*)cmd_type) == 0) {
-					uint8_t temp_resp[50] = {0};
-
-					// read from eeprom
-					uint32_t eepromread = *((uint32_t*) DATA_EEPROM_BASE);
-					sprintf(temp_resp, "\r\nCustomer Coefficient is %i\r\n", eepromread);
-					status = HAL_UART_Transmit_IT(&huart1, (uint8_t*) temp_resp, \
-							strlen(temp_resp));
-					assert_param(status == HAL_OK);
-		        }
-				else if (strcmp("watchpm", (const char*)cmd_type) == 0) {
-					uint8_t temp_resp[50] = {0};
-
-					sprintf(temp_resp, "\r\nPM2.5 concentration is %i ug\r\n", honey.pm2_5);
-					status = HAL_UART_Transmit_IT(&huart1, (uint8_t*) temp_resp, \
+			}
+			else if (strcmp("readcoef", (const char*)cmd_type) == 0) {
+				uint8_t temp_resp[50] = {0};
+
+				// read from eeprom
+				uint32_t eepromread = *((uint32_t*) DATA_EEPROM_BASE);
+				sprintf(temp_resp, "\r\nCustomer Coefficient is %i\r\n", eepromread);
+				status = cli_write((uint8_t*) temp_resp, \
 						strlen(temp_resp));
+				assert_param(status == HAL_OK);
+	        }
+			else if (strcmp("watchpm", (const char*)cmd_type) == 0) {
+				uint8_t temp_resp[50] = {0};
+
+				sprintf(temp_resp, "\r\nPM2.5 concentration is %i ug\r\n", honey[0].pm2_5);
+				status = cli_write((uint8_t*) temp_resp, \
+					strlen(temp_resp));
+				assert_param(status == HAL_OK);
+			}
+			else if (strcmp("errors", (const char*)cmd_type) == 0) {
+				uint8_t temp_resp[120] = {0};
+
+				for (uint8_t s = 0; s < HONEY_SENSOR_COUNT; ++s) {
+					sprintf(temp_resp, "\r\nSensor %u: timeout %u, header %u, checksum %u, nack %u, uart %u, retries %u, failed %u\r\n",
+						s, honey[s].errors.timeout, honey[s].errors.header, honey[s].errors.checksum, honey[s].errors.nack,
+						honey[s].errors.uart, honey[s].errors.retries, honey[s].errors.failed);
+					status = cli_write((uint8_t*) temp_resp, strlen(temp_resp));
 					assert_param(status == HAL_OK);
 				}
-				else if (strcmp("measure", (const char*)cmd_type) == 0) {
-					HAL_UART_Transmit_IT(&huart1, (uint8_t*) "\r\nStarting sensor..., measuring...\r\n",
+				sprintf(temp_resp, "\r\nConsole: dropped %u\r\n", cli_dropped());
+				status = cli_write((uint8_t*) temp_resp, strlen(temp_resp));
+				assert_param(status == HAL_OK);
+			}
+			else if (strcmp("battery", (const char*)cmd_type) == 0) {
+				uint8_t temp_resp[60] = {0};
+
+				sprintf(temp_resp, "\r\nBattery %u mV, level %u, tier %u\r\n",
+					HW_GetBatteryLevel(), LORA_GetBatteryLevel(), batt_tier);
+				status = cli_write((uint8_t*) temp_resp, \
+					strlen(temp_resp));
+				assert_param(status == HAL_OK);
+			}
+			else if (strcmp("warmup", (const char*)cmd_type) == 0) {
+				uint8_t temp_resp[60] = {0};
+
+				sprintf(temp_resp, "\r\nWarm-up last %u ms, learned %u ms\r\n", warmup_ms, warmup_avg_ms);
+				status = cli_write((uint8_t*) temp_resp, \
+					strlen(temp_resp));
+				assert_param(status == HAL_OK);
+			}
+			else if (strcmp("log", (const char*)cmd_type) == 0) {
+				uint8_t temp_resp[80] = {0};
+
+				sprintf(temp_resp, "\r\nLog %u slots, %u unsent, wear %lu of %lu writes\r\n",
+					log_size(), log_backlog(), (unsigned long) log_wear(), (unsigned long) LOG_WEAR_LIMIT);
+				status = cli_write((uint8_t*) temp_resp, \
+					strlen(temp_resp));
+				assert_param(status == HAL_OK);
+			}
+			else if (strcmp("energy", (const char*)cmd_type) == 0) {
+				uint8_t temp_resp[60] = {0};
+
+				for (uint8_t p = 0; p < ENERGY_PHASE_COUNT; ++p) {
+					sprintf(temp_resp, "\r\n%-5s %10lu s %10lu uAh",
+						energy_name(p), (unsigned long) energy_time_s(p), (unsigned long) energy_charge_uah(p));
+					status = cli_write((uint8_t*) temp_resp, strlen(temp_resp));
+					assert_param(status == HAL_OK);
+				}
+				status = cli_write((uint8_t*) "\r\n", 2);
+				assert_param(status == HAL_OK);
+			}
+			else if (strcmp("setlat", (const char*)cmd_type) == 0 || strcmp("setlon", (const char*)cmd_type) == 0) {
+				int32_t lat = 0;
+				int32_t lon = 0;
+
+				// in 1e-5 degree, the other coordinate is kept
+				config_location(&lat, &lon);
+				if (strcmp("setlat", (const char*)cmd_type) == 0) {
+					lat = cmd_argval;
+				} else {
+					lon = cmd_argval;
+				}
+
+				if (cmd_argok && lat >= -CONFIG_LAT_MAX && lat <= CONFIG_LAT_MAX && lon >= -CONFIG_LON_MAX && lon <= CONFIG_LON_MAX) {
+					// a new location goes out in the next free report slot
+					if (config_set_location(lat, lon)) {
+						devinfo_pending = 1;
+					}
+					status = cli_write((uint8_t*) "\r\nSet Location Success!\r\n", \
+						strlen("\r\nSet Location Success!\r\n"));
+				}
+				else {
+					status = cli_write((uint8_t*) "\r\nSet Location Argument Error!\r\n", \
+						strlen("\r\nSet Location Argument Error!\r\n"));
+				}
+				assert_param(status == HAL_OK);
+			}
+			else if (strcmp("location", (const char*)cmd_type) == 0) {
+				uint8_t temp_resp[70] = {0};
+				int32_t lat = 0;
+				int32_t lon = 0;
+
+				config_location(&lat, &lon);
+				sprintf(temp_resp, "\r\nLocation %ld %ld (1e-5 deg), %s\r\n", (long) lat, (long) lon,
+					config_location_set() ? "stored" : "default");
+				status = cli_write((uint8_t*) temp_resp, \
+					strlen(temp_resp));
+				assert_param(status == HAL_OK);
+			}
+			else if (strcmp("measure", (const char*)cmd_type) == 0) {
+				// a normal cycle, the MAC and the console are served while the
+				// fan runs. A cycle already running gives its result instead
+				if (cli_honey) {
+					CliSensorBusy();
+				} else if (honey_cycle) {
+					cli_measure = 1;
+					cli_write((uint8_t*) "\r\nMeasurement running, waiting for it...\r\n",
+						strlen("\r\nMeasurement running, waiting for it...\r\n"));
+				} else {
+					cli_measure = 1;
+					cli_write((uint8_t*) "\r\nStarting sensor..., measuring...\r\n",
 						strlen("\r\nStarting sensor..., measuring...\r\n"));
-					honey_start(&honey);
-					HAL_Delay(HONEY_WARMUP_DURATION);
+					HoneyCycleStart();
+				}
+			}
+			else if (strcmp("check", (const char*)cmd_type) == 0) {
+				// a fan stop the sensor answers, the result follows in OnCliChecked
+				if (!CliSensorBusy()) {
+					cli_honey = 1;
+					if (honey_stop_async(&honey[0], OnCliChecked) != CMD_RESP_SUCCESS) {
+						OnCliChecked(&honey[0], CMD_RESP_ERR);
+					}
+				}
+			}
+			else if (strcmp("exit", (const char*)cmd_type) == 0) {
+				cli_stop(); // stop reception
+				status = cli_write((uint8_t*) "\r\nSetting Mode Exited.\r\n", \
+					strlen("\r\nSetting Mode Exited.\r\n"));
+				assert_param(status == HAL_OK);
+
+				TimerStop(&SettingTimer); // stop setting mode timer
+				TimerReset(&SettingTimer);
+				setting_mode = 0; // change mode to normal
+				cli_measure = 0;
+				LPM_SetStopMode(LPM_CLI_Id, LPM_Enable);
+				energy_stop(ENERGY_CLI);
+				LoraStartTx(TX_ON_TIMER); // start txtimer
+			}
+	        else {
+	          status = cli_write((uint8_t*) "\r\nCommand Error, Please retry.\r\n", \
+	          strlen("\r\nCommand Error, Please retry.\r\n"));
+	          assert_param(status == HAL_OK);
+	        }
+	      }
+	      else {
+	        // nothing to process, give prompt
+	        status = cli_write(&prompt[0], sizeof(prompt));
+	        assert_param(status == HAL_OK);
+	      }
+	    }
+/* CLI Control End -----------------------------------------------------------*/
+}
+
+void LoraMacProcessNotify(void)
+{
+  sched_post(SCHED_EV_MAC);
+}
 
-					HAL_UART_Abort(&huart1); // stop any interrupt on uart1
+static void HoneyProcessNotify(void)
+{
+  sched_post(SCHED_EV_HONEY);
+}
 
-					if (honey_read(&honey) == CMD_RESP_SUCCESS) {
-						uint8_t pm2_5 = 0;
-						uint8_t temp_resp[50] = {0};
+static void CliNotify(void)
+{
+  // any input holds the setting mode open
+  setting_mode_timeout_count = 0;
+  sched_post(SCHED_EV_CLI);
+}
 
-						pm2_5 = honey.pm2_5;
-						if (pm2_5 == 191) {
-							pm2_5 = 190;
-						}
+static uint8_t HoneyActive(uint8_t i)
+{
+  // the setting mode CLI owns USART1, only the LPUART1 sensor is left
+  return (i == 0) || !setting_mode;
+}
 
-						sprintf(temp_resp, "\r\nMeauring completed. PM2.5 is %i ug\r\n", pm2_5);
-						HAL_UART_Transmit_IT(&huart1, (uint8_t*) temp_resp,	strlen(temp_resp));
-					} else {
-						HAL_UART_Transmit_IT(&huart1, (uint8_t*) "Sensor Error!\r\n", \
-							strlen("Sensor Error!\r\n"));
-					}
+static void HoneyCycleStart(void)
+{
+  // power on, start, warm-up and burst, the cycle continues in OnHoneyPowered
+  honey_cycle = 1;
+  honey_cycle_start = TimerGetCurrentTime();
+  HoneyStep(honey_power_on, OnHoneyPowered);
+}
 
-					honey_stop(&honey);
-				}
-				else if (strcmp("check", (const char*)cmd_type) == 0) {
-					if (honey_stop(&honey) == CMD_RESP_SUCCESS) {
-						HAL_UART_Transmit_IT(&huart1, (uint8_t*) "\r\nSensor OK.\r\n",	strlen("\r\nSensor OK.\r\n"));
-					}
-					else {
-						HAL_UART_Transmit_IT(&huart1, (uint8_t*) "\r\nSensor Error! Please Check Connection.\r\n",	strlen("\r\nSensor Error! Please Check Connection.\r\n"));
-					}
-				}
-				else if (strcmp("exit", (const char*)cmd_type) == 0) {
-					HAL_UART_Abort(&huart1); // stop interrupts
-					status = HAL_UART_Transmit(&huart1, (uint8_t*) "\r\nSetting Mode Exited.\r\n", \
-						strlen("\r\nSetting Mode Exited.\r\n"), 100);
-					assert_param(status == HAL_OK);
+static void HoneyStep(honey_step_t step, honey_cb_t cb)
+{
+  /* run one cycle step on every sensor at once, cb is called per sensor
+   * and HoneyStepDone() tells the last call apart */
+  uint8_t i = 0;
+
+  honey_pending = HONEY_SENSOR_COUNT;
+  for (i = 0; i < HONEY_SENSOR_COUNT; ++i) {
+    honey_step_resp[i] = CMD_RESP_IDLE;
+    if (!HoneyActive(i) || step(&honey[i], cb) != CMD_RESP_SUCCESS) {
+      cb(&honey[i], CMD_RESP_ERR);
+    }
+  }
+}
 
-					TimerStop(&SettingTimer); // stop setting mode timer
-					TimerReset(&SettingTimer);
-					setting_mode = 0; // change mode to normal
-					LoraStartTx(TX_ON_TIMER); // start txtimer
+static uint8_t HoneyStepDone(honey_t *sensor, honey_cmd_resp_t resp)
+{
+  honey_step_resp[sensor - honey] = resp;
 
-					LPM_EnterLowPower();
-				}
-		        else {
-		          status = HAL_UART_Transmit_IT(&huart1, (uint8_t*) "\r\nCommand Error, Please retry.\r\n", \
-		          strlen("\r\nCommand Error, Please retry.\r\n"));
-		          assert_param(status == HAL_OK);
-		        }
-		      }
-		      else {
-		        // nothing to process, give prompt
-		        status = HAL_UART_Transmit(&huart1, &prompt[0], sizeof(prompt), 100);
-		        assert_param(status == HAL_OK);
-		      }
-
-		      // Clear ready flag, count, and buffer
-		      cmdBuff.count = 0;
-		      cmdBuff.cmdReady = 0;
-		      memset(&cmdBuff.buff, 0x00, sizeof(cmdBuff.buff));
-
-		      // Enable reception again
-		      status = HAL_UART_Receive_IT(&huart1, &cmdBuff.buff[0], sizeof(uint8_t));
-		      assert_param(status == HAL_OK);
-		    }
-		    else {
-		      if (reflect_ch) {
-		        // reflect character back to terminal
-		        status = HAL_UART_Transmit_IT(&huart1, &cmdBuff.buff[cmdBuff.count - 1], sizeof(uint8_t));
-		        assert_param(status == HAL_OK);
-
-		        reflect_ch = 0;
-		      }
-		    }
-/* CLI Control End -----------------------------------------------------------*/
+  return (honey_pending > 0) && (--honey_pending == 0);
+}
 
-	/* Setting Mode End ----------------------------------------------------- */
-	}
+static honey_cmd_resp_t HoneyReadStep(honey_t *sensor, honey_cb_t cb)
+{
+  uint16_t frames = 0;
+  uint8_t  i      = sensor - honey;
 
+  // sensors that could not start streaming are polled
+  if (sensor->state != HONEY_STATE_STREAM) {
+    return honey_read_async(sensor, cb);
   }
+
+  // take the newest frame if one came in since the last read
+  honey_stream_parse(sensor);
+  frames = sensor->stream_frames;
+  cb(sensor, (frames != honey_last_frame[i]) ? CMD_RESP_SUCCESS : CMD_RESP_ERR);
+  honey_last_frame[i] = frames;
+
+  return CMD_RESP_SUCCESS;
 }
 
+static honey_cmd_resp_t HoneyPowerOffStep(honey_t *sensor, honey_cb_t cb)
+{
+  honey_cmd_resp_t resp = honey_power_off(sensor);
 
-void LoraMacProcessNotify(void)
+  // switching off is immediate, no command to wait for
+  if (resp == CMD_RESP_SUCCESS) {
+    cb(sensor, CMD_RESP_SUCCESS);
+  }
+
+  return resp;
+}
+
+static uint8_t HoneyGate(void)
+{
+  /* power the sensors off when they would idle long enough to pay back the
+   * next boot, else only stop the fan. The CLI needs the sensor powered. */
+  TimerTime_t busy = TimerGetElapsedTime(honey_cycle_start);
+
+  return !setting_mode && (busy < sample_ms) &&
+         (sample_ms - busy >= HONEY_GATE_MIN_OFF);
+}
+
+static void OnHoneyPowered(honey_t *sensor, honey_cmd_resp_t resp)
+{
+  uint8_t i = 0;
+
+  if (!HoneyStepDone(sensor, resp)) return;
+
+  for (i = 0; i < HONEY_SENSOR_COUNT; ++i) {
+    if (honey_step_resp[i] != CMD_RESP_SUCCESS) {
+      PRINTF("[w] Sensor %u did not come up.\r\n", i);
+    } else if (honey[i].boot_ms > 0 &&
+               TimerGetElapsedTime(honey[i].power_on) <= TimerGetElapsedTime(honey_cycle_start)) {
+      PRINTF("[i] Sensor %u answered %u ms after power-up.\r\n", i, honey[i].boot_ms);
+    }
+  }
+
+  HoneyStep(honey_start_async, OnHoneyStarted);
+}
+
+static void OnHoneyStarted(honey_t *sensor, honey_cmd_resp_t resp)
+{
+  uint8_t i = 0;
+
+  if (!HoneyStepDone(sensor, resp)) return;
+
+  for (i = 0; i < HONEY_SENSOR_COUNT; ++i) {
+#ifdef HONEY_STREAMING
+    // frames keep coming in by DMA during warm-up, the last one is used
+    if (honey_step_resp[i] == CMD_RESP_SUCCESS &&
+        honey_stream_start(&honey[i], honey_stream_buff[i], sizeof(honey_stream_buff[i])) != CMD_RESP_SUCCESS) {
+      PRINTF("[w] Sensor %u cannot stream, polling it.\r\n", i);
+    }
+#endif
+    honey_last_frame[i] = honey[i].stream_frames;
+  }
+
+  // sleep until the first warm-up read, skipping the part that never settled recently
+  warmup_start   = TimerGetCurrentTime();
+  warmup_valid   = 0;
+  warmup_settled = 0;
+  TimerSetValue(&WarmupTimer, (warmup_avg_ms > HONEY_WARMUP_MIN + HONEY_WARMUP_POLL) ?
+		  ((warmup_avg_ms < warmup_max) ? warmup_avg_ms : warmup_max) - HONEY_WARMUP_POLL : HONEY_WARMUP_MIN);
+  TimerStart(&WarmupTimer);
+}
+
+static void OnWarmupTimerEvent(void *context)
+{
+  sched_post(SCHED_EV_WARMUP);
+}
+
+static void HoneyWarmupPoll(void)
+{
+  HoneyStep(HoneyReadStep, OnWarmupRead);
+}
+
+static void OnWarmupRead(honey_t *sensor, honey_cmd_resp_t resp)
+{
+  TimerTime_t elapsed = 0;
+  uint32_t sum = 0;
+  uint16_t value = 0;
+  uint16_t tol = HONEY_WARMUP_TOL;
+  uint16_t diff = 0;
+  uint8_t  n = 0;
+  uint8_t  i = 0;
+
+  if (!HoneyStepDone(sensor, resp)) return;
+
+  elapsed = TimerGetElapsedTime(warmup_start);
+
+  // settling is judged on the mean of the sensors that answered
+  for (i = 0; i < HONEY_SENSOR_COUNT; ++i) {
+    if (honey_step_resp[i] == CMD_RESP_SUCCESS) {
+      sum += honey[i].pm2_5;
+      n++;
+    }
+  }
+
+  if (n > 0) {
+    value = sum / n;
+    if (warmup_last * HONEY_WARMUP_TOL_PCT / 100 > tol) {
+      tol = warmup_last * HONEY_WARMUP_TOL_PCT / 100;
+    }
+    diff = (value > warmup_last) ? (value - warmup_last) : (warmup_last - value);
+    if (warmup_valid && diff <= tol) {
+      warmup_settled++;
+    } else {
+      warmup_settled = 0;
+    }
+    warmup_last  = value;
+    warmup_valid = 1;
+  }
+
+  if (warmup_settled < HONEY_WARMUP_SETTLED && elapsed + HONEY_WARMUP_POLL <= warmup_max) {
+    TimerSetValue(&WarmupTimer, HONEY_WARMUP_POLL);
+    TimerStart(&WarmupTimer);
+    return;
+  }
+
+  // a warm-up cut by the max counts as the max, so the average recovers
+  warmup_ms = (warmup_settled >= HONEY_WARMUP_SETTLED) ? elapsed : warmup_max;
+  warmup_avg_ms = warmup_avg_ms - (warmup_avg_ms >> 3) + (warmup_ms >> 3);
+  PRINTF("[i] Warm-up %u ms (%s), learned %u ms\r\n", warmup_ms,
+		  (warmup_settled >= HONEY_WARMUP_SETTLED) ? "settled" : "max", warmup_avg_ms);
+
+  HoneyBurstStart();
+}
+
+static void HoneyBurstStart(void)
+{
+  uint8_t i = 0;
+
+  PRINTF("Reading PM2.5 burst...\r\n");
+  for (i = 0; i < HONEY_SENSOR_COUNT; ++i) {
+    stats_reset(&pm2_5_ring[i]);
+    stats_reset(&pm10_0_ring[i]);
+
+    // the last warm-up read is the first burst sample
+    if (warmup_valid && honey_step_resp[i] == CMD_RESP_SUCCESS) {
+      stats_push(&pm2_5_ring[i], honey[i].pm2_5);
+      stats_push(&pm10_0_ring[i], honey[i].pm10_0);
+    }
+  }
+  burst_reads = 0;
+
+  if (warmup_valid) {
+    burst_reads = 1;
+    TimerStart(&BurstTimer);
+  } else {
+    HoneyStep(HoneyReadStep, OnHoneyRead);
+  }
+}
+
+static void OnBurstTimerEvent(void *context)
+{
+  sched_post(SCHED_EV_BURST);
+}
+
+static void OnHoneyRead(honey_t *sensor, honey_cmd_resp_t resp)
+{
+  uint8_t i = 0;
+
+  if (!HoneyStepDone(sensor, resp)) return;
+
+  for (i = 0; i < HONEY_SENSOR_COUNT; ++i) {
+    if (honey_step_resp[i] == CMD_RESP_SUCCESS) {
+      stats_push(&pm2_5_ring[i], honey[i].pm2_5);
+      stats_push(&pm10_0_ring[i], honey[i].pm10_0);
+    }
+  }
+
+  if (++burst_reads < HONEY_BURST_COUNT) {
+    TimerStart(&BurstTimer);
+    return;
+  }
+
+#ifdef HONEY_STREAMING
+  HoneyStep(honey_stream_stop, OnHoneyStreamStopped);
+#else
+  HoneyBurstDone();
+#endif
+}
+
+#ifdef HONEY_STREAMING
+static void OnHoneyStreamStopped(honey_t *sensor, honey_cmd_resp_t resp)
+{
+  if (!HoneyStepDone(sensor, resp)) return;
+
+  HoneyBurstDone();
+}
+#endif
+
+static void HoneyBurstDone(void)
+{
+  stats_ring_t    pool2_5;
+  stats_ring_t    pool10_0;
+  stats_summary_t sensor_stats;
+  log_record_t    rec;
+  uint16_t lo  = 0xFFFF;
+  uint16_t hi  = 0;
+  uint16_t tol = 0;
+  uint8_t  i   = 0;
+  uint16_t pm  = 0;
+
+  // every sensor's burst goes into one pool, its median is the vote
+  stats_reset(&pool2_5);
+  stats_reset(&pool10_0);
+  honey_sensors_ok = 0;
+
+  for (i = 0; i < HONEY_SENSOR_COUNT; ++i) {
+    if (stats_summarise(&pm2_5_ring[i], &sensor_stats) > 0) {
+      if (sensor_stats.median < lo) lo = sensor_stats.median;
+      if (sensor_stats.median > hi) hi = sensor_stats.median;
+      honey_sensors_ok++;
+    }
+    stats_merge(&pool2_5, &pm2_5_ring[i]);
+    stats_merge(&pool10_0, &pm10_0_ring[i]);
+  }
+
+  // the burst is good if at least one read succeeded
+  honey_read_status = (stats_summarise(&pool2_5, &pm2_5_stats) > 0) ? CMD_RESP_SUCCESS : CMD_RESP_ERR;
+  stats_summarise(&pool10_0, &pm10_0_stats);
+
+  // sensor medians further apart than the tolerance are flagged, not hidden
+  tol = pm2_5_stats.median * HONEY_VOTE_TOL_PCT / 100;
+  if (tol < HONEY_VOTE_TOL) tol = HONEY_VOTE_TOL;
+  honey_disagree = (honey_sensors_ok > 1) && (hi - lo > tol);
+  if (honey_disagree) {
+    PRINTF("[w] Sensors disagree, PM2.5 medians %u to %u\r\n", lo, hi);
+  }
+
+  if (honey_read_status == CMD_RESP_SUCCESS) {
+    pm = pm2_5_stats.median;
+
+    // every reading is logged unsent, it is backfilled unless the frame
+    // carrying it is accepted
+    log_push(pm, &rec);
+
+    // the reading waits in the store for the report timer, unless it
+    // crossed the alarm, then it is reported alone and at once. Those
+    // dropped from the store are left to the backfill
+    if (report_alarm_check(pm)) {
+      PRINTF("[w] PM2.5 alarm %s at %u\r\n", report_alarm() ? "raised" : "cleared", pm);
+      stats_reset(&sample_store);
+      stats_reset(&sample_store10_0);
+      report_log_reset();
+      sched_post(SCHED_EV_REPORT);
+    }
+    stats_push(&sample_store, pm);
+    stats_push(&sample_store10_0, pm10_0_stats.median);
+    if (report_batch_on()) {
+      report_batch_push(pm, &rec);
+      if (report_batch_due(TxMaxPayload())) {
+        sched_post(SCHED_EV_REPORT);
+      }
+    } else {
+      report_log_push(&rec);
+    }
+    PRINTF("[i] PM2.5 %u stored, %u readings to report.\r\n", pm, sample_store.count);
+  } else {
+    sample_failed = 1;
+  }
+
+  HoneyStep(HoneyGate() ? HoneyPowerOffStep : honey_stop_async, OnHoneyStopped);
+}
+
+static void ReadingFill(payload_t *reading, uint8_t sensor_err, uint8_t low_batt)
+{
+  /* the reported PM2.5 and PM10 medians at full range, what went wrong
+   * is flagged in the status rather than sent in place of a value */
+  memset(reading, 0x00, sizeof(payload_t));
+  reading->status = (batt_tier << PAYLOAD_S_TIER_SHIFT) & PAYLOAD_S_TIER_MASK;
+
+  if (sensor_err) {
+    reading->status |= PAYLOAD_S_SENSOR_ERR;
+  } else {
+    reading->fields = PAYLOAD_F_PM2_5 | PAYLOAD_F_PM10_0;
+    reading->pm2_5  = sample_stats.median;
+    reading->pm10_0 = sample_stats10_0.median;
+  }
+  if (low_batt) {
+    reading->status |= PAYLOAD_S_LOW_BATT;
+  }
+  if (report_alarm()) {
+    reading->status |= PAYLOAD_S_ALARM;
+  }
+  if (honey_disagree) {
+    reading->status |= PAYLOAD_S_DISAGREE;
+  }
+}
+
+static uint8_t FrameTag(uint8_t tag)
+{
+  // the server sees the node degrade before it runs flat
+  return tag | (batt_tier << BATT_TIER_SHIFT);
+}
+
+static void BattTierUpdate(void)
+{
+  /* drop at once to the tier the battery level is in, climb back one
+   * tier at a time once the level is BATT_TIER_HYST above its threshold */
+  uint8_t     level = LORA_GetBatteryLevel();
+  batt_tier_t tier  = batt_tier;
+
+  while (tier + 1 < BATT_TIER_COUNT && level < batt_tiers[tier + 1].level) {
+    tier++;
+  }
+  if (tier == batt_tier && tier > BATT_TIER_NORMAL &&
+      level >= batt_tiers[tier].level + BATT_TIER_HYST) {
+    tier--;
+  }
+  if (tier == batt_tier) return;
+
+  PRINTF("[w] Battery level %u, tier %u to %u\r\n", level, batt_tier, tier);
+  batt_tier  = tier;
+  sample_ms  = batt_tiers[tier].sample_ms;
+  warmup_max = batt_tiers[tier].warmup_max;
+#ifdef SEND_BATCH
+  report_batch_enable(1);
+#else
+  report_batch_enable(batt_tiers[tier].batch);
+#endif
+  vcom_TraceEnable(batt_tiers[tier].trace);
+
+  // TimerSetValue() stops the timer, the new period runs from this cycle
+  TimerSetValue(&SampleTimer, sample_ms);
+  TimerStart(&SampleTimer);
+}
+
+static uint8_t TxMaxPayload(void)
+{
+  /* application bytes the current data rate carries, less the MAC
+   * commands waiting to piggyback on the next uplink */
+  LoRaMacTxInfo_t txInfo = { 0 };
+
+  if (LoRaMacQueryTxPossible(0, &txInfo) != LORAMAC_STATUS_OK) {
+    // never more than the slowest data rate carries, less if the MAC
+    // got as far as the current one
+    if (txInfo.CurrentPossiblePayloadSize > 0 && txInfo.CurrentPossiblePayloadSize < TX_FALLBACK_SIZE) {
+      return txInfo.CurrentPossiblePayloadSize;
+    }
+    return TX_FALLBACK_SIZE;
+  }
+  if (txInfo.CurrentPossiblePayloadSize > LORAWAN_APP_DATA_BUFF_SIZE) {
+    return LORAWAN_APP_DATA_BUFF_SIZE;
+  }
+
+  return txInfo.CurrentPossiblePayloadSize;
+}
+
+static uint8_t LogBacklog(void)
+{
+  /* logged readings to backfill, at most LOG_DRAIN_MAX. The newest unsent
+   * ones wait in the batch and go out with it */
+  uint16_t backlog = log_backlog();
+  uint8_t  held    = report_batch_count();
+
+  backlog = (backlog > held) ? backlog - held : 0;
+
+  return (backlog > LOG_DRAIN_MAX) ? LOG_DRAIN_MAX : backlog;
+}
+
+static void LogDrain(void)
+{
+  /* one backfill frame per cycle without a live report, so the backlog
+   * drains at the cycle rate and never holds back live data */
+  log_record_t rec[LOG_DRAIN_MAX];
+  uint8_t k = 0;
+
+  AppData.Port = LOG_DRAIN_PORT;
+  AppData.BuffSize = LogEncode(AppData.Buff, TxMaxPayload(), rec, log_read(rec, LogBacklog()), &k);
+  if (k == 0) return;
+
+  PRINTF("[i] Backfilling %u of %u logged readings...\r\n", k, log_backlog());
+  if (LORA_send(&AppData, LORAWAN_DEFAULT_CONFIRM_MSG_STATE) == LORA_SUCCESS) {
+    EnergyUplink();
+    log_mark_sent(rec, k);
+  }
+}
+
+static uint8_t LogEncode(uint8_t *buff, uint8_t max, const log_record_t *rec, uint8_t n, uint8_t *count)
+{
+  /* the batch layout with a 24-bit age, oldest reading first, as many of
+   * the n records as fit max. Returns the bytes written, 0 if none fit */
+  uint8_t k = 0;
+  uint8_t i = 0;
+
+  *count = 0;
+  if (n == 0 || max < LOG_HEAD_SIZE) return 0;
+
+  buff[i++] = FrameTag(LOG_DRAIN_TAG);
+  buff[i++] = 0;
+  buff[i++] = (rec[0].age >> 16) & 0xFF;
+  buff[i++] = (rec[0].age >> 8) & 0xFF;
+  buff[i++] = rec[0].age & 0xFF;
+  buff[i++] = (rec[0].pm2_5 >> 8) & 0xFF;
+  buff[i++] = rec[0].pm2_5 & 0xFF;
+
+  for (k = 1; k < n; ++k) {
+    // ages count down, a reading from before a reset may look newer. They
+    // are whole LOG_TIME_UNIT steps, so the time step is exact
+    uint32_t dt = (rec[k - 1].age > rec[k].age) ? (rec[k - 1].age - rec[k].age) / BATCH_STEP_UNIT : 0;
+    if (i + report_step_encode(NULL, dt, rec[k].pm2_5, rec[k - 1].pm2_5) > max) break;
+    i += report_step_encode(&buff[i], dt, rec[k].pm2_5, rec[k - 1].pm2_5);
+  }
+  buff[1] = k;
+  *count = k;
+
+  return i;
+}
+
+static void EnergyUplink(void)
+{
+  /* the radio driver reports no TX or RX edges, the uplink just queued
+   * in AppData is booked from its airtime at the current data rate */
+  MibRequestConfirm_t mib;
+
+  mib.Type = MIB_CHANNELS_DATARATE;
+  if (LoRaMacMibGetRequestConfirm(&mib) != LORAMAC_STATUS_OK) {
+    mib.Param.ChannelsDatarate = LORAWAN_DEFAULT_DATA_RATE;
+  }
+
+  energy_uplink(AppData.BuffSize, mib.Param.ChannelsDatarate);
+}
+
+static uint8_t DevInfoDue(void)
+{
+  // after a reset or a config change, then once a period
+  return devinfo_pending || TimerGetElapsedTime(devinfo_time) >= DEVINFO_PERIOD;
+}
+
+static void DevInfoSend(void)
+{
+  /* slow-changing metadata on its own port: location from the config
+   * and battery level, a ct_payload frame without readings */
+  payload_t info;
+  uint8_t size = 0;
+
+  memset(&info, 0x00, sizeof(payload_t));
+  info.fields  = PAYLOAD_F_LOCATION | PAYLOAD_F_BATTERY;
+  info.status  = (batt_tier << PAYLOAD_S_TIER_SHIFT) & PAYLOAD_S_TIER_MASK;
+  info.battery = LORA_GetBatteryLevel();
+  config_location(&info.latitude, &info.longitude);
+
+  size = payload_encode(&info, AppData.Buff, TxMaxPayload());
+  if (size == 0) return;
+
+  AppData.Port = DEVINFO_PORT;
+  AppData.BuffSize = size;
+
+  PRINTF("[i] Sending device info, location %ld %ld...\r\n", (long) info.latitude, (long) info.longitude);
+  if (LORA_send(&AppData, LORAWAN_DEFAULT_CONFIRM_MSG_STATE) == LORA_SUCCESS) {
+    EnergyUplink();
+    devinfo_pending = 0;
+    devinfo_waited = 0;
+    devinfo_time = TimerGetCurrentTime();
+  }
+}
+
+static uint8_t EnergyDiagDue(void)
+{
+  // a frame the data rate cut short is finished first
+  return energy_diag_phase > 0 || TimerGetElapsedTime(energy_diag_time) >= ENERGY_DIAG_PERIOD;
+}
+
+static void EnergyDiagSend(void)
+{
+  /* charge per phase since the start, in ENERGY_DIAG_UNIT, 16 bits each.
+   * Byte 1 is the first phase in the frame, the phases that do not fit
+   * follow in the next free slot */
+  uint8_t max = TxMaxPayload();
+  uint8_t phase = energy_diag_phase;
+  uint16_t q = 0;
+  uint8_t i = 0;
+
+  if (max < 4) return;
+
+  AppData.Port = ENERGY_DIAG_PORT;
+  AppData.Buff[i++] = FrameTag(ENERGY_DIAG_TAG);
+  AppData.Buff[i++] = phase;
+  for (; phase < ENERGY_PHASE_COUNT && i + 2 <= max; ++phase) {
+    q = energy_charge_uah(phase) / ENERGY_DIAG_UNIT;
+    AppData.Buff[i++] = (q >> 8) & 0xFF;
+    AppData.Buff[i++] = q & 0xFF;
+  }
+  AppData.BuffSize = i;
+
+  PRINTF("[i] Sending energy totals from phase %u...\r\n", energy_diag_phase);
+  if (LORA_send(&AppData, LORAWAN_DEFAULT_CONFIRM_MSG_STATE) == LORA_SUCCESS) {
+    EnergyUplink();
+    energy_diag_waited = 0;
+    if (phase == ENERGY_PHASE_COUNT) {
+      energy_diag_phase = 0;
+      energy_diag_time = TimerGetCurrentTime();
+    } else {
+      energy_diag_phase = phase;
+    }
+  }
+}
+
+static void HoneyErrorTotals(honey_errors_t *total)
+{
+  uint8_t i = 0;
+
+  memset(total, 0x00, sizeof(honey_errors_t));
+  for (i = 0; i < HONEY_SENSOR_COUNT; ++i) {
+    total->timeout  += honey[i].errors.timeout;
+    total->header   += honey[i].errors.header + honey[i].errors.uart;
+    total->checksum += honey[i].errors.checksum;
+    total->nack     += honey[i].errors.nack;
+    total->failed   += honey[i].errors.failed;
+  }
+}
+
+static uint8_t HoneyDiagAppend(uint8_t *buff)
+{
+  /* errors of all sensors since the last report, one byte per cause,
+   * saturated: timeout, header (uart included), checksum, nack, failed */
+  honey_errors_t total;
+  uint16_t delta[HONEY_DIAG_SIZE];
+  uint8_t i = 0;
+
+  HoneyErrorTotals(&total);
+  delta[0] = total.timeout  - honey_errors_sent.timeout;
+  delta[1] = total.header   - honey_errors_sent.header;
+  delta[2] = total.checksum - honey_errors_sent.checksum;
+  delta[3] = total.nack     - honey_errors_sent.nack;
+  delta[4] = total.failed   - honey_errors_sent.failed;
+  honey_errors_sent = total;
+
+  for (i = 0; i < HONEY_DIAG_SIZE; ++i) {
+    buff[i] = (delta[i] > 0xFF) ? 0xFF : delta[i];
+  }
+
+  return HONEY_DIAG_SIZE;
+}
+
+static void OnHoneyStopped(honey_t *sensor, honey_cmd_resp_t resp)
+{
+  if (!HoneyStepDone(sensor, resp)) return;
+
+  honey_cycle = 0;
+  PRINTF("---TRANSMISSION COMPLETED---\r\n");
+
+  if (cli_measure) {
+    CliMeasureDone();
+  }
+}
+
+static void CliMeasureDone(void)
+{
+  /* the result of the cycle the measure command started or joined,
+   * the console may have been left meanwhile */
+  uint8_t temp_resp[70] = {0};
+
+  cli_measure = 0;
+  if (!setting_mode) return;
+
+  if (honey_read_status == CMD_RESP_SUCCESS) {
+    sprintf(temp_resp, "\r\nMeasuring completed. PM2.5 is %u ug, PM10 is %u ug\r\n",
+            pm2_5_stats.median, pm10_0_stats.median);
+  } else {
+    sprintf(temp_resp, "\r\nSensor Error!\r\n");
+  }
+  cli_write(temp_resp, strlen(temp_resp));
+  cli_write(prompt, sizeof(prompt));
+}
+
+static uint8_t CliSensorBusy(void)
+{
+  /* a command or a cycle holds the sensor, a console command would get
+   * CMD_RESP_BAD from the driver and look like a sensor fault */
+  if (!honey_cycle && !cli_honey && !honey_busy(&honey[0])) return 0;
+
+  cli_write((uint8_t*) "\r\nSensor busy, please retry shortly.\r\n",
+    strlen("\r\nSensor busy, please retry shortly.\r\n"));
+  return 1;
+}
+
+static void OnCliCoefSet(honey_t *sensor, honey_cmd_resp_t resp)
 {
-  LoraMacProcessRequest = LORA_SET;
+  /* the coefficient is kept over resets only once the sensor has it,
+   * the console may have been left meanwhile */
+  cli_honey = 0;
+
+  if (resp == CMD_RESP_SUCCESS) {
+    // unlock eeprom
+    if ((FLASH->PECR & FLASH_PECR_PELOCK) != 0)
+    {
+      FLASH->PEKEYR = FLASH_PEKEY1;
+      FLASH->PEKEYR = FLASH_PEKEY2;
+    }
+
+    // write data to eeprom
+    *(uint8_t *)(DATA_EEPROM_BASE) = sensor->customer_coef;
+
+    // lock eeprom
+    FLASH->PECR |= FLASH_PECR_PELOCK;
+  }
+  if (!setting_mode) return;
+
+  if (resp == CMD_RESP_SUCCESS) {
+    cli_write((uint8_t*) "\r\nSet Coef Success!\r\n", strlen("\r\nSet Coef Success!\r\n"));
+  } else {
+    cli_write((uint8_t*) "\r\nSet Coef Failed! Sensor did not accept it.\r\n",
+      strlen("\r\nSet Coef Failed! Sensor did not accept it.\r\n"));
+  }
+  cli_write(prompt, sizeof(prompt));
 }
 
+static void OnCliChecked(honey_t *sensor, honey_cmd_resp_t resp)
+{
+  cli_honey = 0;
+  if (!setting_mode) return;
+
+  if (resp == CMD_RESP_SUCCESS) {
+    cli_write((uint8_t*) "\r\nSensor OK.\r\n", strlen("\r\nSensor OK.\r\n"));
+  } else {
+    cli_write((uint8_t*) "\r\nSensor Error! Please Check Connection.\r\n",
+      strlen("\r\nSensor Error! Please Check Connection.\r\n"));
+  }
+  cli_write(prompt, sizeof(prompt));
+}
 
 static void LORA_HasJoined(void)
 {
@@ -512,12 +1532,12 @@ static void LORA_HasJoined(void)
 static void Send(void *context)
 {
   /* USER CODE BEGIN 3 */
-//  uint16_t pressure;
-//  int16_t temperature;
-//  uint16_t humidity;
-//  sensor_t sensor_data;
   uint8_t  batteryLevel;
-  uint16_t pm2_5;			// pm2.5 concentration
+  uint8_t  batched = 0;     // the buffered readings are done with
+  uint8_t  batch_carried = 0; // and the frame carries them, not only the latest
+  uint8_t  backlog = 0;     // logged readings appended to the frame
+  uint8_t  fit = FIT_PM2_5; // FIT_ parts that made it into the frame
+  log_record_t backlog_rec[LOG_DRAIN_MAX];
   uint8_t  sensor_err = 0;  // if sensor has error
   uint8_t  lowBatt = 0; 	// Indicates that battery is low
 
@@ -529,10 +1549,6 @@ static void Send(void *context)
   }
 
   TVL1(PRINTF("SEND REQUEST\n\r");)
-#ifndef CAYENNE_LPP
-  int32_t latitude, longitude = 0;
-//  uint16_t altitudeGps = 0;
-#endif
 
 #ifdef USE_B_L072Z_LRWAN1
   TimerInit(&TxLedTimer, OnTimerLedEvent);
@@ -546,62 +1562,54 @@ static void Send(void *context)
 
 //  BSP_sensor_Read(&sensor_data);
 
-  // read pm2.5 from Honeywell sensor
-  if (honey_read(&honey) == CMD_RESP_SUCCESS) {
-	  PRINTF("[s] Read PM2.5 Success!\r\n");
-	  pm2_5 = honey.pm2_5;
-	  if (pm2_5 == 191) {
-		  pm2_5 = 190;
-	  }
+  // pm2.5 is the median of the burst read by OnHoneyRead
+  if (sample_status == CMD_RESP_SUCCESS) {
+	  PRINTF("[s] Read PM2.5 Success! median %u of %u stored readings\r\n", sample_stats.median, sample_stats.count);
   } else {
 	  PRINTF("[e] Read PM2.5 Error!\r\n");
 	  sensor_err = 1;
   }
 
 #ifdef CAYENNE_LPP
-  uint8_t cchannel = 0;
-  temperature = (int16_t)(sensor_data.temperature * 10);         /* in �C * 10 */
-  pressure    = (uint16_t)(sensor_data.pressure * 100 / 10);      /* in hPa / 10 */
-  humidity    = (uint16_t)(sensor_data.humidity * 2);            /* in %*2     */
+  // channels in priority order, one that does not fit the data rate is left out
+  lpp_t lpp;
+  payload_t reading;
   uint32_t i = 0;
 
   batteryLevel = LORA_GetBatteryLevel();                      /* 1 (very low) to 254 (fully charged) */
+  if (batteryLevel < 5) {
+    lowBatt = 1;
+  }
+  ReadingFill(&reading, sensor_err, lowBatt);
 
   AppData.Port = LPP_APP_PORT;
+  lpp_init(&lpp, AppData.Buff, TxMaxPayload());
 
-  AppData.Buff[i++] = cchannel++;
-  AppData.Buff[i++] = LPP_DATATYPE_BAROMETER;
-  AppData.Buff[i++] = (pressure >> 8) & 0xFF;
-  AppData.Buff[i++] = pressure & 0xFF;
-  AppData.Buff[i++] = cchannel++;
-  AppData.Buff[i++] = LPP_DATATYPE_TEMPERATURE;
-  AppData.Buff[i++] = (temperature >> 8) & 0xFF;
-  AppData.Buff[i++] = temperature & 0xFF;
-  AppData.Buff[i++] = cchannel++;
-  AppData.Buff[i++] = LPP_DATATYPE_HUMIDITY;
-  AppData.Buff[i++] = humidity & 0xFF;
-#if defined( REGION_US915 ) || defined ( REGION_AU915 ) || defined ( REGION_AS923 )
-  /* The maximum payload size does not allow to send more data for lowest DRs */
+  fit = 0;
+  if (reading.fields & PAYLOAD_F_PM2_5) {
+#ifdef LPP_PM_CONCENTRATION
+    fit |= lpp_add(&lpp, LPP_CH_PM2_5, LPP_DATATYPE_CONCENTRATION, reading.pm2_5) ? FIT_PM2_5 : 0;
+    fit |= lpp_add(&lpp, LPP_CH_PM10_0, LPP_DATATYPE_CONCENTRATION, reading.pm10_0) ? FIT_PM10_0 : 0;
 #else
-  AppData.Buff[i++] = cchannel++;
-  AppData.Buff[i++] = LPP_DATATYPE_DIGITAL_INPUT;
-  AppData.Buff[i++] = batteryLevel * 100 / 254;
-  AppData.Buff[i++] = cchannel++;
-  AppData.Buff[i++] = LPP_DATATYPE_DIGITAL_OUTPUT;
-  AppData.Buff[i++] = AppLedStateOn;
-#endif  /* REGION_XX915 */
+    fit |= lpp_add(&lpp, LPP_CH_PM2_5, LPP_DATATYPE_ANALOG_INPUT, 100L * reading.pm2_5) ? FIT_PM2_5 : 0;
+    fit |= lpp_add(&lpp, LPP_CH_PM10_0, LPP_DATATYPE_ANALOG_INPUT, 100L * reading.pm10_0) ? FIT_PM10_0 : 0;
+#endif
+  }
+  fit |= lpp_add(&lpp, LPP_CH_BATTERY, LPP_DATATYPE_DIGITAL_INPUT, batteryLevel * 100 / LORAWAN_MAX_BAT) ? FIT_BATTERY : 0;
+  lpp_add(&lpp, LPP_CH_STATUS, LPP_DATATYPE_DIGITAL_INPUT, reading.status);
+  lpp_add(&lpp, LPP_CH_LED, LPP_DATATYPE_DIGITAL_OUTPUT, AppLedStateOn);
+  i = lpp.size;
+
+  // LPP has no layout for buffered readings, the latest stands for them
+  batched = (report_batch_count() > 0);
 #else  /* not CAYENNE_LPP */
 
 
 //  temperature = (int16_t)(sensor_data.temperature * 100);         /* in �C * 100 */
 //  pressure    = (uint16_t)(sensor_data.pressure * 100 / 10);      /* in hPa / 10 */
 //  humidity    = (uint16_t)(sensor_data.humidity * 10);            /* in %*10     */
-//  latitude = sensor_data.latitude;
-//  longitude = sensor_data.longitude;
 
-//lat 13.73654, long 100.52877 of CU Engineering
-  latitude = 1373654;
-  longitude = 10052877;
+  // the location goes out in the device info frame, see DevInfoSend
   uint32_t i = 0;
 
   // check battery level
@@ -612,61 +1620,113 @@ static void Send(void *context)
 
   AppData.Port = LORAWAN_APP_PORT;
 
-#if defined( REGION_US915 ) || defined ( REGION_AU915 ) || defined ( REGION_AS923 )
-  if (lowBatt || sensor_err) {
-	// if sensor is error or battery is low send 191
-	AppData.Buff[i++] = 17;
-	AppData.Buff[i++] = 191;
-  } else {
+  // error counters are due, they take the place of the burst stats and the
+  // backlog. The count holds at HONEY_DIAG_EVERY until a frame has room for them
+  if (honey_diag_count < HONEY_DIAG_EVERY) {
+    honey_diag_count++;
+  }
+  uint8_t diag = (honey_diag_count >= HONEY_DIAG_EVERY);
+  // the limit of the data rate ADR picked, whatever the region
+  uint8_t max = TxMaxPayload();
+  uint8_t room = max;                 // for the reading or the batch
+  uint8_t offer = FIT_BATTERY;
+  uint8_t size = 0;
+  uint8_t dropped = 0;                // oldest buffered readings the frame had no room for
+  uint8_t parts = 0;                  // PARTS_ sections after the reading or batch
+  uint8_t parts_size = 1;             // the parts header is paid by the first section
+  payload_t reading;
+
+  // PM values at full range, errors and low battery in the status flags
+  ReadingFill(&reading, sensor_err, lowBatt);
+  reading.battery = batteryLevel;
+
+#ifdef HONEY_REDUNDANT
+  // the parts header and the sensors byte go after the frame whatever else fits
+  room = (max > 2) ? max - 2 : 0;
+  parts |= PARTS_SENSORS;
+  parts_size = 0;
+#endif
 
-#ifdef DATA_TOGGLING
-	if (send_pm_toggler) {
-		PRINTF("[i] sending pm2.5 data...\r\n");
-		AppData.Buff[i++] = 17;
-		AppData.Buff[i++] = pm2_5;
-	} else {
-		PRINTF("[i] sending geolocation data...\r\n");
-		AppData.Buff[i++] = 17;
-		AppData.Buff[i++] = (latitude >> 16) & 0xFF;
-		AppData.Buff[i++] = (latitude >> 8) & 0xFF;
-		AppData.Buff[i++] = latitude & 0xFF;
-		AppData.Buff[i++] = (longitude >> 16) & 0xFF;
-		AppData.Buff[i++] = (longitude >> 8) & 0xFF;
-		AppData.Buff[i++] = longitude & 0xFF;
+  PRINTF("[i] sending pm2.5 data...\r\n");
+  if (report_batch_count() > 0) {
+	i += report_batch_encode(&AppData.Buff[i], room, FrameTag(BATCH_TAG), &dropped);
+	if (dropped > 0) {
+	  PRINTF("[w] %u buffered readings do not fit the data rate, dropped\r\n", dropped);
 	}
-	send_pm_toggler = !send_pm_toggler;
-#else
-  	PRINTF("[i] sending pm2.5 data...\r\n");
-  	AppData.Buff[i++] = 17;
-  	AppData.Buff[i++] = pm2_5;
+	// no room for even the batch head, the latest reading goes alone and
+	// the batch waits for a faster data rate
+	batched = (i > 0);
+	batch_carried = batched;
+  }
+  if (!batched) {
+	if (!sensor_err) {
+	  offer |= FIT_PM2_5 | FIT_PM10_0;
+#ifdef SEND_BURST_STATS
+	  if (!diag) offer |= FIT_STATS;
 #endif
-}
+	}
+	fit = report_fit(&reading, offer, room, parts_size + BURST_STATS_SIZE);
+	if (offer & ~fit) {
+	  PRINTF("[w] %u bytes at this data rate, fields %02x deferred\r\n", room, offer & ~fit);
+	}
+	i += payload_encode(&reading, &AppData.Buff[i], room);
+	if (fit & FIT_STATS) {
+	  parts |= PARTS_STATS;
+	}
+  }
+
+  // the frame says which sections follow, the decoder needs no build flags
+  if (parts) {
+	AppData.Buff[i++] = PARTS_TAG | parts;
+	if (parts & PARTS_STATS) {
+	  AppData.Buff[i++] = (sample_stats.mean_x10 >> 8) & 0xFF;
+	  AppData.Buff[i++] = sample_stats.mean_x10 & 0xFF;
+	  AppData.Buff[i++] = (sample_stats.min >> 8) & 0xFF;
+	  AppData.Buff[i++] = sample_stats.min & 0xFF;
+	  AppData.Buff[i++] = (sample_stats.max >> 8) & 0xFF;
+	  AppData.Buff[i++] = sample_stats.max & 0xFF;
+	  AppData.Buff[i++] = sample_stats.count;
+	  AppData.Buff[i++] = warmup_ms / 100; // in 0.1 s
+	}
+#ifdef HONEY_REDUNDANT
+	// sensors that answered in bits 1..7, disagreement in bit 0
+	AppData.Buff[i++] = (honey_sensors_ok << 1) | honey_disagree;
+#endif
+  }
+
+  // error counters go last, on their own port, whenever they fit
+  if (diag && i + HONEY_DIAG_SIZE <= max) {
+	AppData.Port = HONEY_DIAG_PORT;
+	i += HoneyDiagAppend(&AppData.Buff[i]);
+	honey_diag_count = 0;
+  } else if (!diag && !batched && i + LOG_HEAD_SIZE <= max && LogBacklog() > 0) {
+	// room left at a fast data rate carries logged readings, tag 19 after the frame
+	size = LogEncode(&AppData.Buff[i], max - i, backlog_rec, log_read(backlog_rec, LogBacklog()), &backlog);
+	i += size;
+  }
 
-#else  /* not REGION_XX915 */
-  // AppData.Buff[i++] = AppLedStateOn;
-  // AppData.Buff[i++] = (pressure >> 8) & 0xFF;
-  // AppData.Buff[i++] = pressure & 0xFF;
-  if (lowBatt) {
-    AppData.Buff[i++] = 191;
-  } else {
-    AppData.Buff[i++] = (temperature >> 8) & 0xFF;
-    AppData.Buff[i++] = temperature & 0xFF;
-    AppData.Buff[i++] = (humidity >> 8) & 0xFF;
-    AppData.Buff[i++] = humidity & 0xFF;
-    AppData.Buff[i++] = batteryLevel;
-    AppData.Buff[i++] = (latitude >> 16) & 0xFF;
-    AppData.Buff[i++] = (latitude >> 8) & 0xFF;
-    AppData.Buff[i++] = latitude & 0xFF;
-    AppData.Buff[i++] = (longitude >> 16) & 0xFF;
-    AppData.Buff[i++] = (longitude >> 8) & 0xFF;
-    AppData.Buff[i++] = longitude & 0xFF;
-  }
-
-#endif  /* REGION_XX915 */
 #endif  /* CAYENNE_LPP */
   AppData.BuffSize = i;
 
-  LORA_send(&AppData, LORAWAN_DEFAULT_CONFIRM_MSG_STATE);
+  if (LORA_send(&AppData, LORAWAN_DEFAULT_CONFIRM_MSG_STATE) == LORA_SUCCESS) {
+    EnergyUplink();
+    // the next cycles are compared with what went out, a reading that
+    // had no room is still due
+    if (batched || sensor_err || (fit & FIT_PM2_5)) {
+      report_sent(sensor_err, sample_stats.median);
+    }
+    // the logged readings in the frame are not backfilled, the report
+    // stands for those of its period
+    if (!batch_carried && (fit & FIT_PM2_5)) {
+      report_log_mark();
+    }
+    if (batched) {
+      report_batch_sent(batch_carried);
+    }
+    if (backlog > 0) {
+      log_mark_sent(backlog_rec, backlog);
+    }
+  }
 
   /* USER CODE END 3 */
 }
@@ -748,6 +1808,7 @@ static void OnSettingModeElapsed(void *context)
 {
 	TimerStart(&SettingTimer);
 	setting_mode_timeout_count++; // increment timeout counter
+	sched_post(SCHED_EV_CLI);
 }
 
 static void StartSettingModeElapsed()
@@ -762,17 +1823,28 @@ static void OnTxTimerEvent(void *context)
   /*Wait for next tx slot*/
   TimerStart(&TxTimer);
 
-  AppProcessRequest = LORA_SET;
+  sched_post(SCHED_EV_REPORT);
+}
+
+static void OnSampleTimerEvent(void *context)
+{
+  /*Wait for next measurement*/
+  TimerStart(&SampleTimer);
+
+  sched_post(SCHED_EV_APP);
 }
 
 static void LoraStartTx(TxEventType_t EventType)
 {
   if (EventType == TX_ON_TIMER)
   {
-    /* send everytime timer elapses */
+    /* measure and send on their own timers, the first report waits for readings */
+    TimerInit(&SampleTimer, OnSampleTimerEvent);
+    TimerSetValue(&SampleTimer,  sample_ms);
     TimerInit(&TxTimer, OnTxTimerEvent);
     TimerSetValue(&TxTimer,  APP_TX_DUTYCYCLE);
-    OnTxTimerEvent(NULL);
+    TimerStart(&TxTimer);
+    OnSampleTimerEvent(NULL);
   }
   else
   {
@@ -797,7 +1869,9 @@ static void LORA_ConfirmClass(DeviceClass_t Class)
   AppData.BuffSize = 0;
   AppData.Port = LORAWAN_APP_PORT;
 
-  LORA_send(&AppData, LORAWAN_UNCONFIRMED_MSG);
+  if (LORA_send(&AppData, LORAWAN_UNCONFIRMED_MSG) == LORA_SUCCESS) {
+    EnergyUplink();
+  }
 }
 
 static void LORA_TxNeeded(void)
@@ -805,7 +1879,9 @@ static void LORA_TxNeeded(void)
   AppData.BuffSize = 0;
   AppData.Port = LORAWAN_APP_PORT;
 
-  LORA_send(&AppData, LORAWAN_UNCONFIRMED_MSG);
+  if (LORA_send(&AppData, LORAWAN_UNCONFIRMED_MSG) == LORA_SUCCESS) {
+    EnergyUplink();
+  }
 }
 
 /**
@@ -884,23 +1960,32 @@ static void enterSettingMode(void *context)
 
 	// stop txtimer and start elapsing timer
 	TimerStop(&TxTimer);
+	TimerStop(&SampleTimer);
 	StartSettingModeElapsed();
 
+	// the button may be pressed again while in setting mode
+	if (!setting_mode) {
+		energy_start(ENERGY_CLI);
+	}
 	setting_mode = 1; // change mode
 
-	// CLI variables init
-	status = HAL_OK;
-	cmdBuff.fullFlag = 0;
-	cmdBuff.cmdReady = 0;
-	cmdBuff.count    = 0;
-	memset(&cmdBuff.buff, 0x00, sizeof(cmdBuff.buff));
+	// USART1 is not clocked in STOP, the CLI keeps the MCU in sleep mode
+	LPM_SetStopMode(LPM_CLI_Id, LPM_Disable);
+
+	// the CLI talks to the sensor, boot it if the last cycle gated it
+	honey_power_on(&honey[0], NULL);
+
+#ifdef HONEY_REDUNDANT
+	// hand USART1 over from the second sensor to the CLI
+	honey_abort(&honey[1]);
+#endif
 
-	// begin reception
-	status = HAL_UART_Receive_IT(&huart1, &cmdBuff.buff[0], sizeof(uint8_t));
+	// begin reception into the DMA ring
+	status = cli_start();
 	assert_param(status == HAL_OK);
 
 	// show prompt
-	status = HAL_UART_Transmit(&huart1, &prompt[0], sizeof(prompt), 100);
+	status = cli_write(&prompt[0], sizeof(prompt));
 	assert_param(status == HAL_OK);
 }
 
@@ -952,128 +2037,83 @@ static void initUart1(void)
 	}
 }
 
+void RNG_LPUART1_IRQHandler(void)
+{
+  honey_irq_handler(&honey[0]);
+}
+
+void DMA1_Channel2_3_IRQHandler(void)
+{
+  honey_dma_irq_handler(&honey[0]);
+}
+
 void USART1_IRQHandler(void)
 {
   /* USER CODE BEGIN USART1_IRQn 0 */
 
   /* USER CODE END USART1_IRQn 0 */
+  // idle line of the console, before the HAL handler sees the flags
+  cli_irq_handler();
+#ifdef HONEY_REDUNDANT
+  // ends in HAL_UART_IRQHandler(&huart1), so the CLI is served too
+  honey_irq_handler(&honey[1]);
+#else
   HAL_UART_IRQHandler(&huart1);
+#endif
   /* USER CODE BEGIN USART1_IRQn 1 */
 
   /* USER CODE END USART1_IRQn 1 */
 }
 
 void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) {
-	HAL_StatusTypeDef status = HAL_OK;
-
-	  if (huart == &huart1) {
-
-		// reset timeout
-		  setting_mode_timeout_count = 0;
-
-	    if (cmdBuff.fullFlag != 1 && cmdBuff.count < RX_BUFF_SIZE) {
-	      // reception
-	      if (cmdBuff.buff[cmdBuff.count] == '\r') {
-	        // disable all interrupts
-	        status = HAL_UART_Abort(huart);
-	        assert_param(status == HAL_OK);
-
-	        // set command ready and reset pointer
-	        cmdBuff.cmdReady = 1;
-	        ptrBuff = &cmdBuff.buff[0];
-	      }
-	      else if (cmdBuff.buff[cmdBuff.count] == '\177') { // backspace
-	        // increment pointer and count
-	        if (cmdBuff.count != 0) { // check if pointer is not at zero index
-	        	cmdBuff.count--;
-	          ptrBuff--;
-	          backspace_ch = 1;
-	        }
+	honey_t *sensor = honey_from_uart(huart);
 
-	        // start reception again
-	        status = HAL_UART_Receive_IT(&huart1, ptrBuff, sizeof(uint8_t));
-	        assert_param(status == HAL_OK);
-	      }
-	      else {
-	        // increment pointer and count
-	        ptrBuff++;
-	        cmdBuff.count++;
-
-	        // set character reflection
-	        reflect_ch = 1;
-
-	        // start reception again
-	        status = HAL_UART_Receive_IT(&huart1, ptrBuff, sizeof(uint8_t));
-	        assert_param(status == HAL_OK);
-	      }
-	    }
-	    else {
-	      // buffer is full abort and restart buffer
-	      status = HAL_UART_Abort(huart);
-	      assert_param(status == HAL_OK);
+	if (sensor != NULL) {
+		honey_rx_cplt_callback(sensor);
+		return;
+	}
 
-	      cmdBuff.fullFlag = 1;
-	      ptrBuff = &cmdBuff.buff[0];
-	    }
-	  }
+	// the console ring wrapped, lines are assembled in OnCliEvent
+	cli_rx_callback(huart);
 }
 
-void extractCmd(uint8_t cmd[], uint8_t* cmdtype, uint8_t* cmdarg)
-{
-    uint8_t cmdtype_len = 0;
-    uint8_t i = 0;
+void vcom_UartTxCpltCallback(UART_HandleTypeDef *huart) {
+	honey_t *sensor = honey_from_uart(huart);
 
-    // read command type until spacebar
-    while (cmdBuff.buff[i] != ' ' && cmdBuff.buff[i] != '\0') {
-      cmdtype[i] = cmdBuff.buff[i];
-      ++i;
-    }
-    cmdtype_len = i + 1; // the length of the command type
-    cmdtype[i] = '\0';
-    i++;
-
-    // read arguments
-    while (cmdBuff.buff[i] != ' ' && cmdBuff.buff[i] != '\0') {
-      cmdarg[i - cmdtype_len] = cmdBuff.buff[i];
-      i++;
-    }
-    cmdarg[i - cmdtype_len] = '\0';
+	if (sensor != NULL) {
+		honey_tx_cplt_callback(sensor);
+	}
 }
 
-int32_t ascii2hex_num(uint8_t src[])
-{
-  uint8_t  i          = 0;
-  uint32_t magnitude  = 1;
-  uint8_t  data_len   = 0;
-  uint8_t  isNeg      = 0;
-  // uint8_t  digits[10] = "0123456789";
-  int32_t  result     = 0;
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart) {
+	honey_t *sensor = honey_from_uart(huart);
 
-  // check for negative
-  if (src[i] == '-') {
-    isNeg = 1;
-    i++;
-    data_len = strlen(src) - 2;
-  }
-  else {
-    data_len = strlen(src) - 1;
-  }
+	if (sensor != NULL) {
+		honey_rx_half_cplt_callback(sensor);
+		return;
+	}
 
-  // get magnitude
-  for (int j = 0; j < data_len; j++) {
-    magnitude *= 10;
-  }
+	cli_rx_callback(huart);
+}
 
-  while (src[i] != '\0') {
-	  result += magnitude * (int) (src[i] - '0');
-	  magnitude /= 10;
-	  i++;
-  }
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart) {
+	honey_t *sensor = honey_from_uart(huart);
 
-  if (isNeg) result = -result;
+	if (sensor != NULL) {
+		honey_error_callback(sensor);
+		return;
+	}
 
-  return result;
+	cli_error_callback(huart);
+}
 
+void honey_fan_callback(honey_t *honey, uint8_t on) {
+	// each sensor's fan counts on its own
+	if (on) {
+		energy_start(ENERGY_FAN);
+	} else {
+		energy_stop(ENERGY_FAN);
+	}
 }
 
 
@@ -28,7 +28,10 @@
 static UART_HandleTypeDef UartHandle;
 
 static void (*TxCpltCallback)(void);
+
+static uint8_t TraceOn = 1;
 /* Private function prototypes -----------------------------------------------*/
+static void vcom_DmaIrqInit(void);
 /* Functions Definition ------------------------------------------------------*/
 void vcom_Init(void (*TxCb)(void))
 {
@@ -61,13 +64,39 @@ void vcom_Init(void (*TxCb)(void))
 
 void vcom_Trace(uint8_t *p_data, uint16_t size)
 {
-  HAL_UART_Transmit_DMA(&UartHandle, p_data, size);
+  if (TraceOn)
+  {
+    HAL_UART_Transmit_DMA(&UartHandle, p_data, size);
+  }
+  else
+  {
+    /* dropped, completing at once frees the trace queue*/
+    TxCpltCallback();
+  }
+}
+
+void vcom_TraceEnable(uint8_t enable)
+{
+  TraceOn = enable;
+}
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+  /* buffer transmission complete, only the trace port reports it*/
+  if (huart->Instance == USARTx)
+  {
+    TxCpltCallback();
+  }
+  else
+  {
+    vcom_UartTxCpltCallback(huart);
+  }
 }
 
-void HAL_UART_TxCpltCallback(UART_HandleTypeDef *UartHandle)
+__weak void vcom_UartTxCpltCallback(UART_HandleTypeDef *huart)
 {
-  /* buffer transmission complete*/
-  TxCpltCallback();
+  /* NOTE: the application overrides it to follow its own ports */
+  UNUSED(huart);
 }
 
 void vcom_DMA_TX_IRQHandler(void)
@@ -88,6 +117,7 @@ void vcom_DeInit(void)
 void HAL_UART_MspInit(UART_HandleTypeDef *huart)
 {
  GPIO_InitTypeDef GPIO_InitStruct = {0};
+ RCC_PeriphCLKInitTypeDef PeriphClkInit = {0};
 
   if (huart->Instance == USARTx)
   {
@@ -129,8 +159,7 @@ void HAL_UART_MspInit(UART_HandleTypeDef *huart)
 
     /*##-4- Configure the NVIC for DMA #########################################*/
     /* NVIC configuration for DMA transfer complete interrupt (USART1_TX) */
-    HAL_NVIC_SetPriority(USARTx_DMA_TX_IRQn, USARTx_Priority, 1);
-    HAL_NVIC_EnableIRQ(USARTx_DMA_TX_IRQn);
+    vcom_DmaIrqInit();
 
     /* NVIC for USART, to catch the TX complete */
     HAL_NVIC_SetPriority(USARTx_IRQn, USARTx_DMA_Priority, 1);
@@ -165,6 +194,31 @@ void HAL_UART_MspInit(UART_HandleTypeDef *huart)
 	      GPIO_InitStruct.Alternate = GPIO_AF4_USART1;
 	      HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
 
+	      /* USART1 DMA Init */
+	      /* USART1_RX on DMA1 channel 5, circular for the setting mode console */
+	      static DMA_HandleTypeDef hdma_usart1_rx;
+
+	      __HAL_RCC_DMA1_CLK_ENABLE();
+
+	      hdma_usart1_rx.Instance                 = DMA1_Channel5;
+	      hdma_usart1_rx.Init.Request             = DMA_REQUEST_3;
+	      hdma_usart1_rx.Init.Direction           = DMA_PERIPH_TO_MEMORY;
+	      hdma_usart1_rx.Init.PeriphInc           = DMA_PINC_DISABLE;
+	      hdma_usart1_rx.Init.MemInc              = DMA_MINC_ENABLE;
+	      hdma_usart1_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+	      hdma_usart1_rx.Init.MemDataAlignment    = DMA_MDATAALIGN_BYTE;
+	      hdma_usart1_rx.Init.Mode                = DMA_CIRCULAR;
+	      hdma_usart1_rx.Init.Priority            = DMA_PRIORITY_LOW;
+	      if (HAL_DMA_Init(&hdma_usart1_rx) != HAL_OK)
+	      {
+	        Error_Handler();
+	      }
+
+	      __HAL_LINKDMA(huart, hdmarx, hdma_usart1_rx);
+
+	      /* DMA1_Channel4_5_6_7_IRQn interrupt configuration, shared with the vcom TX */
+	      vcom_DmaIrqInit();
+
 	      /* USART1 interrupt Init */
 	      HAL_NVIC_SetPriority(USART1_IRQn, 0, 0);
 	      HAL_NVIC_EnableIRQ(USART1_IRQn);
@@ -178,6 +232,14 @@ void HAL_UART_MspInit(UART_HandleTypeDef *huart)
   /* USER CODE BEGIN LPUART1_MspInit 0 */
 
   /* USER CODE END LPUART1_MspInit 0 */
+    /* Kernel clock from LSE so that LPUART1 runs in STOP, 9600 baud at most */
+    PeriphClkInit.PeriphClockSelection = RCC_PERIPHCLK_LPUART1;
+    PeriphClkInit.Lpuart1ClockSelection = RCC_LPUART1CLKSOURCE_LSE;
+    if (HAL_RCCEx_PeriphCLKConfig(&PeriphClkInit) != HAL_OK)
+    {
+      Error_Handler();
+    }
+
     /* Peripheral clock enable */
     __HAL_RCC_LPUART1_CLK_ENABLE();
 
@@ -193,6 +255,35 @@ void HAL_UART_MspInit(UART_HandleTypeDef *huart)
     GPIO_InitStruct.Alternate = GPIO_AF6_LPUART1;
     HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
 
+    /* LPUART1 DMA Init */
+    /* LPUART1_RX on DMA1 channel 3, circular for the sensor autosend stream */
+    static DMA_HandleTypeDef hdma_lpuart1_rx;
+
+    __HAL_RCC_DMA1_CLK_ENABLE();
+
+    hdma_lpuart1_rx.Instance                 = DMA1_Channel3;
+    hdma_lpuart1_rx.Init.Request             = DMA_REQUEST_5;
+    hdma_lpuart1_rx.Init.Direction           = DMA_PERIPH_TO_MEMORY;
+    hdma_lpuart1_rx.Init.PeriphInc           = DMA_PINC_DISABLE;
+    hdma_lpuart1_rx.Init.MemInc              = DMA_MINC_ENABLE;
+    hdma_lpuart1_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_lpuart1_rx.Init.MemDataAlignment    = DMA_MDATAALIGN_BYTE;
+    hdma_lpuart1_rx.Init.Mode                = DMA_CIRCULAR;
+    hdma_lpuart1_rx.Init.Priority            = DMA_PRIORITY_LOW;
+    if (HAL_DMA_Init(&hdma_lpuart1_rx) != HAL_OK)
+    {
+      Error_Handler();
+    }
+
+    __HAL_LINKDMA(huart, hdmarx, hdma_lpuart1_rx);
+
+    /* DMA1_Channel2_3_IRQn interrupt configuration */
+    HAL_NVIC_SetPriority(DMA1_Channel2_3_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Channel2_3_IRQn);
+
+    /* LPUART1 interrupt Init */
+    HAL_NVIC_SetPriority(RNG_LPUART1_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(RNG_LPUART1_IRQn);
   /* USER CODE BEGIN LPUART1_MspInit 1 */
 
   /* USER CODE END LPUART1_MspInit 1 */
@@ -266,6 +357,24 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef *huart)
    }
 }
 
+/**
+  * @brief Set up the DMA1 channel 4 to 7 interrupt, shared by the vcom TX and
+  *        the USART1 RX, once at the vcom TX priority
+  * @param None
+  * @retval None
+  */
+static void vcom_DmaIrqInit(void)
+{
+  static uint8_t done = 0;
+
+  if (!done)
+  {
+    HAL_NVIC_SetPriority(USARTx_DMA_TX_IRQn, USARTx_Priority, 1);
+    done = 1;
+  }
+  HAL_NVIC_EnableIRQ(USARTx_DMA_TX_IRQn);
+}
+
 void vcom_IoInit(void)
 {
   GPIO_InitTypeDef  GPIO_InitStruct = {0};
@@ -0,0 +1,256 @@
+#include "hw.h"
+#include "ct_cli.h"
+
+static UART_HandleTypeDef *cli_huart;
+static void (*cli_notify)(void);
+static uint8_t  cli_ring[CLI_RING_SIZE];
+static volatile uint32_t cli_head;  // producer, bytes the DMA has written, moved in ISR
+static uint32_t cli_tail;           // consumer, bytes cli_poll() has read
+static volatile uint16_t cli_pos;   // DMA write index at the last cli_advance()
+static volatile uint8_t  cli_running;
+static volatile uint8_t  cli_rearm; // an error stopped the DMA, cli_poll() restarts it
+static uint16_t cli_lost;
+static uint8_t  cli_line[CLI_LINE_SIZE];
+static uint8_t  cli_len;
+static uint8_t  cli_done;           // cli_line was handed out, the next byte starts a new one
+static uint8_t  cli_discard;        // dropping the rest of a line too long
+static uint8_t  cli_echo[CLI_ECHO_SIZE];
+static uint8_t  cli_echo_len;
+
+static void cli_advance(void)
+{
+  // from ISR only. CNDTR counts down and reloads in circular mode, the
+  // half and full interrupts keep any step below a whole ring
+  uint16_t pos = CLI_RING_SIZE - __HAL_DMA_GET_COUNTER(cli_huart->hdmarx);
+
+  if (pos >= CLI_RING_SIZE) pos = 0;
+  cli_head += (pos + CLI_RING_SIZE - cli_pos) % CLI_RING_SIZE;
+  cli_pos = pos;
+
+  if (cli_notify != NULL) {
+    cli_notify();
+  }
+}
+
+static HAL_StatusTypeDef cli_receive(void)
+{
+  HAL_StatusTypeDef status = HAL_OK;
+
+  // the DMA starts over at the ring's first byte, reception is stopped
+  cli_head = 0;
+  cli_tail = 0;
+  cli_pos  = 0;
+  status = HAL_UART_Receive_DMA(cli_huart, cli_ring, CLI_RING_SIZE);
+  if (status != HAL_OK) return status;
+
+  __HAL_UART_CLEAR_IDLEFLAG(cli_huart);
+  __HAL_UART_ENABLE_IT(cli_huart, UART_IT_IDLE);
+
+  return HAL_OK;
+}
+
+static void cli_echo_flush(void)
+{
+  // lost if a write of the application is still going
+  if (cli_echo_len > 0) {
+    cli_write(cli_echo, cli_echo_len);
+    cli_echo_len = 0;
+  }
+}
+
+static void cli_echo_put(uint8_t ch)
+{
+  cli_echo[cli_echo_len++] = ch;
+  if (cli_echo_len == CLI_ECHO_SIZE) {
+    cli_echo_flush();
+  }
+}
+
+void cli_init(UART_HandleTypeDef *huart, void (*notify)(void))
+{
+  /*
+      Bind the console to huart, its RX DMA channel must be linked in
+      HAL_UART_MspInit(). notify is called from ISR when input is pending.
+  */
+  cli_huart   = huart;
+  cli_notify  = notify;
+  cli_running = 0;
+}
+
+HAL_StatusTypeDef cli_start(void)
+{
+  /*
+      Start receiving into the ring with an empty line, the port must be
+      free of other users
+  */
+  if (cli_running) {
+    cli_stop();
+  }
+
+  cli_rearm    = 0;
+  cli_len      = 0;
+  cli_done     = 0;
+  cli_discard  = 0;
+  cli_echo_len = 0;
+  cli_running  = 1;
+
+  if (cli_receive() != HAL_OK) {
+    cli_running = 0;
+    return HAL_ERROR;
+  }
+
+  return HAL_OK;
+}
+
+void cli_stop(void)
+{
+  /*
+      Stop reception and any write in flight, hands the port back
+  */
+  cli_running = 0;
+  __HAL_UART_DISABLE_IT(cli_huart, UART_IT_IDLE);
+  HAL_UART_Abort(cli_huart);
+}
+
+cli_line_t cli_poll(const uint8_t **line)
+{
+  /*
+      Consume the ring up to the producer index: echo, apply backspace and
+      collect a line. Call it from the main loop after notify() until it
+      returns CLI_LINE_NONE.
+      params
+          line: set to the NUL terminated line, valid until the next call
+      return
+          CLI_LINE_READY for a line ended by CR
+          CLI_LINE_OVERFLOW once for a line of CLI_LINE_SIZE bytes or more
+          CLI_LINE_NONE once the ring is empty
+  */
+  uint32_t   head = cli_head;
+  cli_line_t res  = CLI_LINE_NONE;
+  uint8_t    ch   = 0;
+
+  *line = cli_line;
+  if (!cli_running) return CLI_LINE_NONE;
+
+  if (cli_done) {
+    cli_len  = 0;
+    cli_done = 0;
+  }
+
+  // the main loop fell a whole ring behind, the DMA wrote over the oldest
+  if (head - cli_tail > CLI_RING_SIZE) {
+    cli_lost += head - cli_tail - CLI_RING_SIZE;
+    cli_tail = head - CLI_RING_SIZE;
+  }
+
+  while (res == CLI_LINE_NONE && cli_tail != head) {
+    ch = cli_ring[cli_tail % CLI_RING_SIZE];
+    cli_tail++;
+
+    if (ch == '\r') {
+      if (cli_discard) {
+        cli_discard = 0;
+        cli_len = 0;
+      } else {
+        cli_line[cli_len] = '\0';
+        cli_done = 1;
+        res = CLI_LINE_READY;
+      }
+    } else if (ch == '\n') {
+      // CR LF terminals, the CR ended the line
+    } else if (ch == '\177' || ch == '\b') {
+      if (!cli_discard && cli_len > 0) {
+        cli_len--;
+        cli_echo_put('\177');
+      }
+    } else if (cli_discard) {
+      // rest of a line too long
+    } else if (cli_len < CLI_LINE_SIZE - 1) {
+      cli_line[cli_len++] = ch;
+      cli_echo_put(ch);
+    } else {
+      cli_discard = 1;
+      cli_len = 0;
+      res = CLI_LINE_OVERFLOW;
+    }
+  }
+  cli_echo_flush();
+
+  // restart after an error once what came before it is read
+  if (cli_rearm && cli_tail == cli_head) {
+    cli_rearm = 0;
+    if (cli_receive() != HAL_OK) {
+      cli_running = 0;
+    }
+  }
+
+  return res;
+}
+
+HAL_StatusTypeDef cli_write(const uint8_t *data, uint16_t len)
+{
+  /*
+      Write to the console and wait for it, from the main loop. Input keeps
+      landing in the ring meanwhile.
+  */
+  return HAL_UART_Transmit(cli_huart, (uint8_t*) data, len, CLI_TX_TIMEOUT(len));
+}
+
+uint16_t cli_dropped(void)
+{
+  /*
+      return bytes the DMA wrote over before the main loop read them
+  */
+  return cli_lost;
+}
+
+
+/* Interrupt Hooks -----------------------------------------------------------*/
+void cli_irq_handler(void)
+{
+  /*
+      Call from USART1_IRQHandler() before HAL_UART_IRQHandler(), the idle
+      line after a burst of input hands it over without waiting for the
+      DMA half or full interrupt
+  */
+  if (cli_running && __HAL_UART_GET_FLAG(cli_huart, UART_FLAG_IDLE)) {
+    __HAL_UART_CLEAR_IDLEFLAG(cli_huart);
+    cli_advance();
+  }
+}
+
+void cli_dma_irq_handler(void)
+{
+  /*
+      Call from the IRQ handler of the USART1 RX DMA channel. Served for
+      whoever has the port, a redundant sensor streams on it too.
+  */
+  if (cli_huart != NULL && cli_huart->hdmarx != NULL) {
+    HAL_DMA_IRQHandler(cli_huart->hdmarx);
+  }
+}
+
+void cli_rx_callback(UART_HandleTypeDef *huart)
+{
+  /*
+      Call from HAL_UART_RxHalfCpltCallback() and HAL_UART_RxCpltCallback()
+  */
+  if (cli_running && huart == cli_huart) {
+    cli_advance();
+  }
+}
+
+void cli_error_callback(UART_HandleTypeDef *huart)
+{
+  /*
+      Call from HAL_UART_ErrorCallback(). An overrun stops the DMA, noise
+      and framing errors leave it running.
+  */
+  if (!cli_running || huart != cli_huart) return;
+
+  if (huart->RxState == HAL_UART_STATE_READY) {
+    __HAL_UART_DISABLE_IT(huart, UART_IT_IDLE);
+    cli_rearm = 1;
+  }
+  cli_advance();
+}
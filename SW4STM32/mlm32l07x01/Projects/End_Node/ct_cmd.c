@@ -0,0 +1,74 @@
+#include <string.h>
+#include "ct_cmd.h"
+
+static uint8_t cmd_token(const uint8_t **src, uint8_t *dst, uint8_t size)
+{
+  /*
+      Copy the token at *src up to a space or the NUL, and move *src past it
+      return
+          1 if it fit dst with its NUL, else 0 and dst holds what did
+  */
+  const uint8_t *p = *src;
+  uint8_t n = 0;
+
+  while (*p != ' ' && *p != '\0') {
+    if (n + 1 >= size) {
+      dst[n] = '\0';
+      return 0;
+    }
+    dst[n++] = *p++;
+  }
+  dst[n] = '\0';
+  *src = p;
+
+  return 1;
+}
+
+uint8_t cmd_extract(const uint8_t *line, uint8_t *type, uint8_t type_size, uint8_t *arg, uint8_t arg_size)
+{
+  /*
+      Split a line into the command up to the first space and the argument
+      after it, anything past the argument is ignored
+      params
+          type_size, arg_size: bytes of type and arg, NUL included
+      return
+          1, else 0 if either did not fit and the line is to be refused
+  */
+  arg[0] = '\0';
+  if (!cmd_token(&line, type, type_size)) return 0;
+
+  if (*line == '\0') return 1;
+  line++;
+
+  return cmd_token(&line, arg, arg_size);
+}
+
+uint8_t cmd_number(const uint8_t *src, int32_t *value)
+{
+  /*
+      Read a decimal number, with an optional leading '-'
+      params
+          value: set only when the number is valid
+      return
+          1, else 0 for an empty string, anything but digits, or more than
+          CMD_NUMBER_DIGITS digits
+  */
+  uint8_t neg = 0;
+  uint8_t n = 0;
+  int32_t result = 0;
+
+  if (*src == '-') {
+    neg = 1;
+    src++;
+  }
+
+  for (n = 0; src[n] != '\0'; ++n) {
+    if (src[n] < '0' || src[n] > '9' || n == CMD_NUMBER_DIGITS) return 0;
+    result = result * 10 + (src[n] - '0');
+  }
+  if (n == 0) return 0;
+
+  *value = neg ? -result : result;
+
+  return 1;
+}
@@ -0,0 +1,59 @@
+#include "hw.h"
+#include "ct_config.h"
+
+#define CONFIG_WORD(addr)   (*(volatile const uint32_t *) (addr))
+
+static void config_put(uint32_t addr, uint32_t data)
+{
+  HAL_FLASHEx_DATAEEPROM_Unlock();
+  HAL_FLASHEx_DATAEEPROM_Program(FLASH_TYPEPROGRAMDATA_WORD, addr, data);
+  HAL_FLASHEx_DATAEEPROM_Lock();
+}
+
+uint8_t config_location_set(void)
+{
+  /*
+      return 1 if a location was stored, else the default is in use
+  */
+  return CONFIG_WORD(CONFIG_LOC_ADDR) == CONFIG_LOC_MAGIC;
+}
+
+void config_location(int32_t *latitude, int32_t *longitude)
+{
+  /*
+      Stored location of the node, 1e-5 degree
+  */
+  if (!config_location_set()) {
+    *latitude  = CONFIG_DEFAULT_LAT;
+    *longitude = CONFIG_DEFAULT_LON;
+    return;
+  }
+
+  *latitude  = (int32_t) CONFIG_WORD(CONFIG_LOC_ADDR + 4);
+  *longitude = (int32_t) CONFIG_WORD(CONFIG_LOC_ADDR + 8);
+}
+
+uint8_t config_set_location(int32_t latitude, int32_t longitude)
+{
+  /*
+      Store the location, 1e-5 degree
+      return
+          1 if the stored location changed, 0 if it was the same or out of range
+  */
+  int32_t lat = 0;
+  int32_t lon = 0;
+
+  if (latitude < -CONFIG_LAT_MAX || latitude > CONFIG_LAT_MAX ||
+      longitude < -CONFIG_LON_MAX || longitude > CONFIG_LON_MAX) return 0;
+
+  config_location(&lat, &lon);
+  if (config_location_set() && lat == latitude && lon == longitude) return 0;
+
+  // the magic goes last, a reset in between leaves the default in use
+  config_put(CONFIG_LOC_ADDR, 0);
+  config_put(CONFIG_LOC_ADDR + 4, (uint32_t) latitude);
+  config_put(CONFIG_LOC_ADDR + 8, (uint32_t) longitude);
+  config_put(CONFIG_LOC_ADDR, CONFIG_LOC_MAGIC);
+
+  return 1;
+}
@@ -0,0 +1,187 @@
+#include "hw.h"
+#include "ct_energy.h"
+
+static const uint32_t energy_current[ENERGY_PHASE_COUNT] = {
+  ENERGY_I_RUN, ENERGY_I_SLEEP, ENERGY_I_STOP,
+  ENERGY_I_FAN, ENERGY_I_TX, ENERGY_I_RX, ENERGY_I_CLI
+};
+
+static const char* const energy_names[ENERGY_PHASE_COUNT] = {
+  "run", "sleep", "stop", "fan", "tx", "rx", "cli"
+};
+
+static uint64_t       energy_ticks[ENERGY_PHASE_COUNT]; // closed time, ticks times users
+static uint32_t       energy_since[ENERGY_PHASE_COUNT]; // start of the open interval
+static uint8_t        energy_users[ENERGY_PHASE_COUNT]; // loads, users that started them
+static energy_phase_t energy_state;                     // current MCU state
+static uint32_t       energy_tps;                       // RTC ticks per second
+
+static void energy_settle(energy_phase_t phase, uint32_t now)
+{
+  // close the open interval of phase at now and open the next one
+  uint8_t users = (phase <= ENERGY_STOP) ? (phase == energy_state) : energy_users[phase];
+
+  energy_ticks[phase] += (uint64_t) (now - energy_since[phase]) * users;
+  energy_since[phase]  = now;
+}
+
+static uint32_t energy_symbol_us(int8_t dr)
+{
+  // DR0 to DR5 are SF12 to SF7 at 125 kHz, 8 us a chip, DR6 is SF7 at 250 kHz
+  if (dr < 0) dr = 0;
+  if (dr > 6) dr = 6;
+
+  return ((uint32_t) 8 << ((dr >= 5) ? 7 : 12 - dr)) / ((dr == 6) ? 2 : 1);
+}
+
+static uint32_t energy_airtime_us(uint16_t size, int8_t dr)
+{
+  /*
+      LoRa time on air, explicit header, CRC on, coding rate 4/5 and an
+      8 symbol preamble
+  */
+  uint8_t sf  = (dr >= 5) ? 7 : 12 - ((dr < 0) ? 0 : dr);
+  uint8_t de  = (sf >= 11);           // low data rate optimisation
+  int32_t num = 8 * (int32_t) size - 4 * sf + 28 + 16;
+  int32_t den = 4 * (sf - 2 * de);
+  int32_t sym = 8 + ((num > 0) ? ((num + den - 1) / den) * 5 : 0);
+
+  // preamble and sync word are 12.25 symbols
+  return (uint32_t) (4 * sym + 49) * energy_symbol_us(dr) / 4;
+}
+
+void energy_init(void)
+{
+  /*
+      Start accounting with the MCU running and no load on, call it once
+      the RTC runs
+  */
+  uint32_t now = HW_RTC_GetTimerValue();
+  uint8_t  i = 0;
+
+  for (i = 0; i < ENERGY_PHASE_COUNT; ++i) {
+    energy_ticks[i] = 0;
+    energy_since[i] = now;
+    energy_users[i] = 0;
+  }
+  energy_state = ENERGY_RUN;
+  energy_tps   = HW_RTC_ms2Tick(1000);
+}
+
+void energy_mcu(energy_phase_t state)
+{
+  /*
+      Switch the MCU state, from the low power hooks with interrupts off
+  */
+  uint32_t now = 0;
+
+  if (state > ENERGY_STOP || state == energy_state || energy_tps == 0) return;
+
+  now = HW_RTC_GetTimerValue();
+  energy_settle(energy_state, now);
+  energy_state = state;
+  energy_since[state] = now;
+}
+
+void energy_start(energy_phase_t phase)
+{
+  /*
+      A user turns a load on, safe from interrupts
+  */
+  BACKUP_PRIMASK();
+
+  if (phase <= ENERGY_STOP || phase >= ENERGY_PHASE_COUNT) return;
+
+  DISABLE_IRQ();
+  energy_settle(phase, HW_RTC_GetTimerValue());
+  energy_users[phase]++;
+  RESTORE_PRIMASK();
+}
+
+void energy_stop(energy_phase_t phase)
+{
+  /*
+      A user turns a load off, a stop without a start is ignored
+  */
+  BACKUP_PRIMASK();
+
+  if (phase <= ENERGY_STOP || phase >= ENERGY_PHASE_COUNT) return;
+
+  DISABLE_IRQ();
+  energy_settle(phase, HW_RTC_GetTimerValue());
+  if (energy_users[phase] > 0) {
+    energy_users[phase]--;
+  }
+  RESTORE_PRIMASK();
+}
+
+void energy_add(energy_phase_t phase, uint32_t ms)
+{
+  /*
+      Book time of a phase that is estimated rather than seen
+  */
+  BACKUP_PRIMASK();
+
+  if (phase >= ENERGY_PHASE_COUNT) return;
+
+  DISABLE_IRQ();
+  energy_ticks[phase] += HW_RTC_ms2Tick(ms);
+  RESTORE_PRIMASK();
+}
+
+void energy_uplink(uint8_t size, int8_t dr)
+{
+  /*
+      Book the airtime of an uplink of size application bytes and the two
+      receive windows that follow it, taken as empty
+      params
+          size: application payload
+          dr: data rate of the uplink, the first window uses it too
+  */
+  uint32_t tx_us = energy_airtime_us(size + ENERGY_LORA_OVERHEAD, dr);
+  uint32_t rx_us = ENERGY_RX_SYMBOLS * (energy_symbol_us(dr) + energy_symbol_us(ENERGY_RX2_DR));
+
+  energy_add(ENERGY_TX, (tx_us + 500) / 1000);
+  energy_add(ENERGY_RX, (rx_us + 500) / 1000);
+}
+
+uint32_t energy_time_s(energy_phase_t phase)
+{
+  /*
+      return time spent in phase, times its users for a load
+  */
+  uint64_t ticks = 0;
+  BACKUP_PRIMASK();
+
+  if (phase >= ENERGY_PHASE_COUNT || energy_tps == 0) return 0;
+
+  DISABLE_IRQ();
+  energy_settle(phase, HW_RTC_GetTimerValue());
+  ticks = energy_ticks[phase];
+  RESTORE_PRIMASK();
+
+  return ticks / energy_tps;
+}
+
+uint32_t energy_charge_uah(energy_phase_t phase)
+{
+  /*
+      return estimated charge drawn in phase, uAh
+  */
+  uint64_t ticks = 0;
+  BACKUP_PRIMASK();
+
+  if (phase >= ENERGY_PHASE_COUNT || energy_tps == 0) return 0;
+
+  DISABLE_IRQ();
+  energy_settle(phase, HW_RTC_GetTimerValue());
+  ticks = energy_ticks[phase];
+  RESTORE_PRIMASK();
+
+  return ticks * energy_current[phase] / ((uint64_t) energy_tps * 3600);
+}
+
+const char* energy_name(energy_phase_t phase)
+{
+  return (phase < ENERGY_PHASE_COUNT) ? energy_names[phase] : "?";
+}
@@ -1,37 +1,107 @@
+#include "hw.h"
+#include "low_power_manager.h"
 #include "ct_honey.h"
 
 
-/* Command List */
-uint8_t CMD_STARTMEAS[4] = { 0x68, 0x01, 0x01, 0x96 };
-uint8_t CMD_STOPMEAS[4]  = { 0x68, 0x01, 0x02, 0x95 };
-uint8_t CMD_READMEAS[4]  = { 0x68, 0x01, 0x04, 0x93 };
-uint8_t CMD_AUTOEN[4]    = { 0x68, 0x01, 0x40, 0x57 };
-uint8_t CMD_AUTOSTOP[4]  = { 0x68, 0x01, 0x20, 0x77 };
-uint8_t CMD_READCOEF[4]  = { 0x68, 0x01, 0x10, 0x87 };
-uint8_t CMD_SETCOEF[5]   = { 0x68, 0x02, 0x08, 0x64, 0x2A }; // default coef is 0x64
+/* Command Table, generated from HONEY_CMD_LIST and kept in flash */
+typedef struct {
+    uint8_t frame[HONEY_TX_FRAME_SIZE];
+    uint8_t len;
+} honey_frame_t;
+
+#define HONEY_CMD_FRAME(name, len, cmd, data)                       \
+    [HONEY_CMD_##name] = { { HONEY_HEAD, (len), (cmd),              \
+        ((len) > 1) ? (data) : HONEY_CS(len, cmd, data),            \
+        ((len) > 1) ? HONEY_CS(len, cmd, data) : 0x00 }, (len) + 3 },
+
+static const honey_frame_t honey_cmd_frames[HONEY_CMD_COUNT] = {
+    HONEY_CMD_LIST(HONEY_CMD_FRAME)
+};
+
+#undef HONEY_CMD_FRAME
+
+/* Startup Routine, run by honey_init() and after each power-up */
+static const honey_cmd_t honey_setup_cmds[] = {
+    HONEY_CMD_STOP, HONEY_CMD_AUTOSTOP, HONEY_CMD_READCOEF
+};
+
+#define HONEY_SETUP_STEPS   (sizeof(honey_setup_cmds) / sizeof(honey_setup_cmds[0]))
+
+/* Instance Table, used to route UART callbacks to the sensor on that port */
+static honey_t* honey_instances[HONEY_MAX_INSTANCES];
+
+
+/* Private Prototypes --------------------------------------------------------*/
+static honey_cmd_resp_t honey_cmd(honey_t *honey, honey_cmd_t cmd, uint8_t arg);
+static honey_cmd_resp_t honey_wait(honey_t *honey);
+static honey_cmd_resp_t honey_parse(honey_t *honey);
+static HAL_StatusTypeDef honey_issue(honey_t *honey);
+static void honey_finish(honey_t *honey, honey_cmd_resp_t resp);
+static void honey_complete(honey_t *honey);
+static void honey_count_error(honey_t *honey, honey_cmd_resp_t resp);
+static void honey_stream_notify(honey_t *honey);
+static void honey_on_timeout(void *context);
+static void honey_wake_arm(honey_t *honey);
+static void honey_wake_disarm(honey_t *honey);
+static void honey_setup_next(honey_t *honey, honey_cmd_resp_t resp);
+static void honey_fan_set(honey_t *honey, uint8_t on);
 
 
 /* APIs ----------------------------------------------------------------------*/
-honey_cmd_resp_t honey_init(UART_HandleTypeDef huart, honey_t* honey) {
+honey_cmd_resp_t honey_init(UART_HandleTypeDef* huart, honey_t* honey) {
     /* 
-        Init Honeywell Module
+        Init Honeywell Module, one honey_t per sensor and UART
         params
-            huart: UART port to use
+            huart: UART port to use, the handle must outlive honey
             honey: honey_t structure (must be declared in main.c)
 
         How to init:
         > honey_t honey;
-        > honey_init(huart1, &honey);
+        > honey_init(&huart1, &honey);
+
+        A gated sensor is powered up first, see honey_set_power()
     */
+    uint8_t i = 0;
+
     honey->huart  = huart;
     honey->pm2_5  = 0;
     honey->pm10_0 = 0;
     honey->customer_coef = 100; // default is 100
 
+    honey->state  = HONEY_STATE_IDLE;
+    honey->resp   = CMD_RESP_IDLE;
+    honey->cb     = NULL;
+    honey->notify = NULL;
+    honey->stream_buff = NULL;
+    honey->frame_cb = NULL;
+    honey->stop_wake = 0;
+    honey->fan    = 0;
+    honey->retry_max    = HONEY_RETRY_MAX;
+    honey->retry_budget = HONEY_RETRY_BUDGET;
+    memset(&honey->errors, 0x00, sizeof(honey_errors_t));
+    TimerInit(&honey->timeout_timer, honey_on_timeout);
+    TimerSetContext(&honey->timeout_timer, honey);
+
+    // register, a UART carries at most one sensor
+    for (i = 0; i < HONEY_MAX_INSTANCES; ++i) {
+        if (honey_instances[i] == honey || honey_instances[i] == NULL ||
+            honey_instances[i]->huart == huart) {
+            honey_instances[i] = honey;
+            break;
+        }
+    }
+    if (i == HONEY_MAX_INSTANCES) return CMD_RESP_BAD;
+
+    // sleep through the boot of a gated sensor
+    if (honey->pwr_port != NULL) {
+        if (honey_power_on(honey, NULL) != CMD_RESP_SUCCESS) return CMD_RESP_ERR;
+        honey_wait(honey);
+    }
+
     //startup routine
-    if (honey_stop(honey) != CMD_RESP_SUCCESS) return CMD_RESP_ERR;
-    if (honey_autosend(honey, 0) != CMD_RESP_SUCCESS) return CMD_RESP_ERR;
-    if (honey_read_coef(honey) != CMD_RESP_SUCCESS) return CMD_RESP_ERR;
+    for (i = 0; i < HONEY_SETUP_STEPS; ++i) {
+        if (honey_cmd(honey, honey_setup_cmds[i], 0) != CMD_RESP_SUCCESS) return CMD_RESP_ERR;
+    }
 
     return CMD_RESP_SUCCESS;
 }
@@ -44,54 +114,21 @@ honey_cmd_resp_t honey_start(honey_t* honey) {
         return
             command response
     */
-    uint8_t resp[2] = {0};
-
-	HAL_UART_Transmit(&honey->huart, (uint8_t*) CMD_STARTMEAS, 4, 100);
-    HAL_UART_Receive(&honey->huart, (uint8_t*) resp, 2, 100);
-
-    if (resp[0] == 0xA5 && resp[1] == 0xA5) { // success is 0xA5A5
-        return CMD_RESP_SUCCESS;
-    }
-    
-    return CMD_RESP_ERR;
+    return honey_cmd(honey, HONEY_CMD_START, 0);
 }
 
 honey_cmd_resp_t honey_stop(honey_t* honey) {
     /* 
         Stop the fan for stopping measuring
     */
-    uint8_t resp[2] = {0};
-
-    HAL_UART_Transmit(&honey->huart, (uint8_t*) CMD_STOPMEAS, 4, 100);
-    HAL_UART_Receive(&honey->huart, (uint8_t*) resp, 2, 100);
-
-    if (resp[0] == 0xA5 && resp[1] == 0xA5) {
-        return CMD_RESP_SUCCESS;
-    }
-    
-//    // stop interrupts
-//    HAL_UART_Abort(&honey->huart);
-
-    return CMD_RESP_ERR;
+    return honey_cmd(honey, HONEY_CMD_STOP, 0);
 }
 
 honey_cmd_resp_t honey_read(honey_t *honey) {
     /*
         Read measurement. Values are stored in the honey_t structure
     */
-    uint8_t resp[8] = {0};
-
-    HAL_UART_Transmit(&honey->huart, (uint8_t*) CMD_READMEAS, 4, 100);
-    HAL_UART_Receive(&honey->huart, (uint8_t*) resp, 8, 100);
-
-    if (resp[0] == 0x40 && resp[1] == 0x05 && resp[2] == 0x04) {
-        honey->pm2_5 = resp[3] * 256 + resp[4];
-        honey->pm10_0 = resp[5] * 256 + resp[6];
-
-        return CMD_RESP_SUCCESS;
-    }
-
-    return CMD_RESP_ERR;
+    return honey_cmd(honey, HONEY_CMD_READ, 0);
 }
 
 honey_cmd_resp_t honey_autosend(honey_t *honey, uint8_t mode) {
@@ -103,25 +140,13 @@ honey_cmd_resp_t honey_autosend(honey_t *honey, uint8_t mode) {
         return
             command response
     */
-    
-    uint8_t resp[2] = {0};
-
     if (mode == 0) { // stop autosend
-        HAL_UART_Transmit(&honey->huart, (uint8_t*) CMD_AUTOSTOP, 4, 100);
+        return honey_cmd(honey, HONEY_CMD_AUTOSTOP, 0);
     } else if (mode == 1) { // enable autosend
-        HAL_UART_Transmit(&honey->huart, (uint8_t*) CMD_AUTOEN, 4, 100);
-    } else {
-        return CMD_RESP_BAD;
+        return honey_cmd(honey, HONEY_CMD_AUTOEN, 0);
     }
-    
-    // receiving response
-    HAL_UART_Receive(&honey->huart, (uint8_t*) resp, 2, 100);
 
-    if (resp[0] == 0xA5 && resp[1] == 0xA5) {
-        return CMD_RESP_SUCCESS;
-    }
-    
-    return CMD_RESP_ERR;
+    return CMD_RESP_BAD;
 }
 
 honey_cmd_resp_t honey_set_coef(honey_t *honey, uint8_t coef) {
@@ -131,31 +156,9 @@ honey_cmd_resp_t honey_set_coef(honey_t *honey, uint8_t coef) {
             *honey: pointer type of honey_t variable
             coef: integer ranging from 30 to 200
         return
-            command response
+            command response, CMD_RESP_BAD if coef is out of range
     */
-    uint8_t resp[2] = {0};
-    uint8_t cs      = 0;
-
-    // if coef is out of range
-    if (coef < 30 || coef > 200) {
-        honey->customer_coef = 100;
-    }
-    
-    // set coef command
-    CMD_SETCOEF[3] = honey->customer_coef = coef;
-
-    // calculate and set Check Sum Byte
-    cs = calc_cs(CMD_SETCOEF, 5);
-    CMD_SETCOEF[4] = cs;
-
-    HAL_UART_Transmit(&honey->huart, (uint8_t*) CMD_SETCOEF, 5, 100);
-    HAL_UART_Receive(&honey->huart, (uint8_t*) resp, 2, 100);
-
-    if (resp[0] == 0xA5 && resp[1] == 0xA5) {
-        return CMD_RESP_SUCCESS;
-    }
-
-    return CMD_RESP_ERR;
+    return honey_cmd(honey, HONEY_CMD_SETCOEF, coef);
 }
 
 honey_cmd_resp_t honey_read_coef(honey_t* honey) {
@@ -163,22 +166,10 @@ honey_cmd_resp_t honey_read_coef(honey_t* honey) {
         Read customer coefficient from the sensor and automatically set
         customer coefficient constructor to the value that's been read
     */
-    uint8_t resp[5] = {0};
-
-    HAL_UART_Transmit(&honey->huart, (uint8_t*) CMD_READCOEF, 4, 100);
-    HAL_UART_Receive(&honey->huart, (uint8_t*) resp, 5, 100);
-
-    if (resp[0] == 0x40 && resp[1] == 0x02 && resp[2] == 0x10) {
-        // this function automatically set the honey.customer_coef to what it reads
-        honey->customer_coef = resp[3];
-
-        return CMD_RESP_SUCCESS;
-    }
-
-    return CMD_RESP_ERR;
+    return honey_cmd(honey, HONEY_CMD_READCOEF, 0);
 }
 
-uint8_t calc_cs(uint8_t* CMD, uint8_t cmd_len) {
+uint8_t calc_cs(const uint8_t* CMD, uint8_t cmd_len) {
     /*
         Calculate Check Sum of a command using the following formula
         cs = MOD((65536-(HEAD+LEN+CMD+DATA)), 256)
@@ -202,3 +193,830 @@ uint8_t calc_cs(uint8_t* CMD, uint8_t cmd_len) {
     cs = (65536 - temp) % 256;
     return cs;
 }
+
+uint8_t honey_build_frame(honey_cmd_t cmd, uint8_t arg, uint8_t* frame) {
+    /*
+        Build a parameterised command frame into a caller-owned buffer,
+        the table frame is copied and its DATA byte and Check Sum replaced
+        params
+            cmd: command, its LEN must be 2
+            arg: DATA byte
+            frame: buffer of at least HONEY_TX_FRAME_SIZE bytes
+        return
+            frame length, 0 if cmd takes no argument
+    */
+    const honey_frame_t* entry = NULL;
+
+    if (cmd >= HONEY_CMD_COUNT) return 0;
+
+    entry = &honey_cmd_frames[cmd];
+    if (entry->len != HONEY_TX_FRAME_SIZE) return 0;
+
+    memcpy(frame, entry->frame, entry->len);
+    frame[3] = arg;
+    frame[4] = calc_cs(frame, entry->len);
+
+    return entry->len;
+}
+
+
+/* Non-blocking APIs ---------------------------------------------------------*/
+void honey_set_notify(honey_t *honey, void (*notify)(void)) {
+    /*
+        Register a function called from interrupt context whenever a command
+        result is pending. It should only raise a flag so that the main loop
+        calls honey_process(), the same way LoraMacProcessNotify works.
+    */
+    honey->notify = notify;
+}
+
+void honey_set_retry(honey_t *honey, uint8_t max_attempts, uint16_t budget_ms) {
+    /*
+        Set the retry policy, a failed attempt is repeated while attempts
+        are left and the next one can still complete within budget_ms of
+        the first. max_attempts of 1 disables retries.
+    */
+    honey->retry_max    = (max_attempts > 0) ? max_attempts : 1;
+    honey->retry_budget = budget_ms;
+}
+
+honey_cmd_resp_t honey_set_stop_wake(honey_t *honey, uint8_t enable) {
+    /*
+        Let the core sit in STOP from the end of a command to the first
+        response byte. The UART must keep running in STOP, i.e. LPUART1
+        clocked from LSE, its start bit detection then wakes the core.
+        params
+            *honey: pointer type of honey_t variable
+            enable: 1 to allow STOP while waiting, 0 for sleep mode only
+        return
+            CMD_RESP_SUCCESS on success
+            CMD_RESP_BAD if a command is in flight
+            CMD_RESP_ERR if the UART refused the wake-up configuration
+    */
+    UART_WakeUpTypeDef wakeup = {0};
+
+    if (honey->state != HONEY_STATE_IDLE) return CMD_RESP_BAD;
+
+    if (enable) {
+        wakeup.WakeUpEvent = UART_WAKEUP_ON_STARTBIT;
+        if (HAL_UARTEx_StopModeWakeUpSourceConfig(honey->huart, wakeup) != HAL_OK) {
+            return CMD_RESP_ERR;
+        }
+    }
+
+    honey->stop_wake = (enable != 0);
+
+    return CMD_RESP_SUCCESS;
+}
+
+honey_cmd_resp_t honey_cmd_async(honey_t *honey, honey_cmd_t cmd, uint8_t arg, honey_cb_t cb) {
+    /*
+        Issue a command and return without waiting for the response.
+        The response is received by interrupt, then cb is called from
+        honey_process(), so the core can go to low power in between.
+        params
+            *honey: pointer type of honey_t variable
+            cmd: command to issue
+            arg: command argument, only used by HONEY_CMD_SETCOEF
+            cb: completion callback, can be NULL
+        return
+            CMD_RESP_SUCCESS if the command has been issued
+            CMD_RESP_BAD if another command is in flight or arg is invalid
+    */
+    const uint8_t* tx  = NULL;
+    uint8_t        len = 0;
+
+    // only one command can be in flight
+    if (honey->state != HONEY_STATE_IDLE) return CMD_RESP_BAD;
+    if (cmd >= HONEY_CMD_COUNT) return CMD_RESP_BAD;
+
+    if (cmd == HONEY_CMD_SETCOEF) {
+        // if coef is out of range
+        if (arg < 30 || arg > 200) return CMD_RESP_BAD;
+
+        // IT transmit reads the frame after return, so it lives in the instance
+        len = honey_build_frame(cmd, arg, honey->tx_buff);
+        tx  = honey->tx_buff;
+        // customer_coef keeps what the sensor has until the command is acked
+        honey->coef_staged = arg;
+    } else {
+        // fixed frames go out straight from flash
+        len = honey_cmd_frames[cmd].len;
+        tx  = honey_cmd_frames[cmd].frame;
+    }
+
+    honey->cmd      = cmd;
+    honey->cb       = cb;
+    honey->resp     = CMD_RESP_IDLE;
+    honey->tx       = tx;
+    honey->tx_len   = len;
+    honey->attempts = 0;
+    honey->first_attempt = TimerGetCurrentTime();
+
+    // sleep mode while the frame goes out, see honey_tx_cplt_callback()
+    LPM_SetStopMode(LPM_HONEY_Id, LPM_Disable);
+
+    if (honey_issue(honey) != HAL_OK) {
+        honey->state = HONEY_STATE_IDLE;
+        LPM_SetStopMode(LPM_HONEY_Id, LPM_Enable);
+        return CMD_RESP_ERR;
+    }
+
+    return CMD_RESP_SUCCESS;
+}
+
+honey_cmd_resp_t honey_start_async(honey_t *honey, honey_cb_t cb) {
+    return honey_cmd_async(honey, HONEY_CMD_START, 0, cb);
+}
+
+honey_cmd_resp_t honey_stop_async(honey_t *honey, honey_cb_t cb) {
+    return honey_cmd_async(honey, HONEY_CMD_STOP, 0, cb);
+}
+
+honey_cmd_resp_t honey_read_async(honey_t *honey, honey_cb_t cb) {
+    return honey_cmd_async(honey, HONEY_CMD_READ, 0, cb);
+}
+
+honey_t* honey_from_uart(UART_HandleTypeDef *huart) {
+    /*
+        Find the sensor with a transfer in flight on huart
+        return
+            the sensor, NULL if huart is idle as far as the driver knows,
+            so the port can be shared with other users in between
+    */
+    uint8_t i = 0;
+
+    for (i = 0; i < HONEY_MAX_INSTANCES; ++i) {
+        if (honey_instances[i] != NULL && honey_instances[i]->huart == huart &&
+            (honey_instances[i]->state == HONEY_STATE_TX ||
+             honey_instances[i]->state == HONEY_STATE_RX_DATA ||
+             honey_instances[i]->state == HONEY_STATE_STREAM)) {
+            return honey_instances[i];
+        }
+    }
+
+    return NULL;
+}
+
+void honey_abort(honey_t *honey) {
+    /*
+        Release the UART, e.g. before handing a shared port to another user.
+        A command in flight completes with CMD_RESP_ERR, a stream is dropped.
+    */
+    if (honey->state == HONEY_STATE_STREAM) {
+        __HAL_UART_DISABLE_IT(honey->huart, UART_IT_IDLE);
+        HAL_UART_Abort(honey->huart);
+
+        honey->state = HONEY_STATE_IDLE;
+        LPM_SetStopMode(LPM_HONEY_Id, LPM_Enable);
+        return;
+    }
+
+    if (honey->state == HONEY_STATE_BOOT) {
+        TimerStop(&honey->timeout_timer);
+
+        honey->resp = CMD_RESP_ERR;
+        honey_complete(honey);
+        return;
+    }
+
+    // complete at once, no retry
+    if (honey->state == HONEY_STATE_TX || honey->state == HONEY_STATE_RX_DATA ||
+        honey->state == HONEY_STATE_RETRY) {
+        TimerStop(&honey->timeout_timer);
+        HAL_UART_Abort(honey->huart);
+
+        honey->resp = CMD_RESP_ERR;
+        honey->errors.failed++;
+        honey_complete(honey);
+    }
+}
+
+uint8_t honey_busy(honey_t *honey) {
+    /*
+        return 1 while a command is in flight or its result is not handled yet
+    */
+    return honey->state != HONEY_STATE_IDLE;
+}
+
+void honey_process(honey_t *honey) {
+    /*
+        Handle a pending command result in thread context. Call it from the
+        main loop after notify() has fired. The callback may issue the next
+        command straight away.
+    */
+    honey_cb_t cb;
+
+    if (honey->state == HONEY_STATE_STREAM) {
+        honey_stream_parse(honey);
+        return;
+    }
+
+    if (honey->state != HONEY_STATE_DONE) return;
+
+    cb = honey->cb;
+    honey->cb    = NULL;
+    honey->state = HONEY_STATE_IDLE;
+
+    if (cb != NULL) {
+        cb(honey, honey->resp);
+    }
+}
+
+
+/* Power Gating APIs --------------------------------------------------------*/
+void honey_set_power(honey_t *honey, GPIO_TypeDef *port, uint16_t pin) {
+    /*
+        Register the load switch on the sensor supply, on when pin is high.
+        The switch is turned off here, call it before honey_init() which
+        then powers the sensor up.
+        params
+            *honey: pointer type of honey_t variable
+            port, pin: switch enable, port NULL for an always powered sensor
+    */
+    GPIO_InitTypeDef init = {0};
+
+    honey->pwr_port = port;
+    honey->pwr_pin  = pin;
+    honey->powered  = (port == NULL);
+    honey->boot_ms  = 0;
+
+    if (port == NULL) return;
+
+    init.Mode  = GPIO_MODE_OUTPUT_PP;
+    init.Pull  = GPIO_NOPULL;
+    init.Speed = GPIO_SPEED_FREQ_LOW;
+    HW_GPIO_Init(port, pin, &init);
+    HW_GPIO_Write(port, pin, 0);
+}
+
+honey_cmd_resp_t honey_power_on(honey_t *honey, honey_cb_t cb) {
+    /*
+        Switch the supply on, wait HONEY_BOOT_TIME, then run the startup
+        routine of honey_init() again since the sensor forgot its settings.
+        The core can sleep in STOP all along.
+        params
+            *honey: pointer type of honey_t variable
+            cb: called with the startup routine result, can be NULL
+        return
+            CMD_RESP_SUCCESS if power-up has begun or the sensor is already
+            powered, cb is called in both cases
+            CMD_RESP_BAD if there is no switch or a command is in flight
+    */
+    if (honey->pwr_port == NULL) return CMD_RESP_BAD;
+    if (honey->state != HONEY_STATE_IDLE) return CMD_RESP_BAD;
+
+    honey->cb       = honey_setup_next;
+    honey->setup_cb = cb;
+
+    if (honey->powered) {
+        // nothing to set up, report at once
+        honey->setup_step = HONEY_SETUP_STEPS;
+        honey->resp = CMD_RESP_SUCCESS;
+        honey_complete(honey);
+        return CMD_RESP_SUCCESS;
+    }
+
+    HW_GPIO_Write(honey->pwr_port, honey->pwr_pin, 1);
+    honey->powered    = 1;
+    honey_fan_set(honey, 1);    // the sensor measures from boot until the setup STOP
+    honey->power_on   = TimerGetCurrentTime();
+    honey->boot_ms    = 0;
+    honey->attempts   = 0;
+    honey->setup_step = 0;
+    honey->resp       = CMD_RESP_IDLE;
+    honey->state      = HONEY_STATE_BOOT;
+
+    TimerSetValue(&honey->timeout_timer, HONEY_BOOT_TIME);
+    TimerStart(&honey->timeout_timer);
+
+    return CMD_RESP_SUCCESS;
+}
+
+honey_cmd_resp_t honey_power_off(honey_t *honey) {
+    /*
+        Switch the supply off, the fan and the electronics stop drawing
+        current. honey_power_on() brings the sensor back.
+        return
+            CMD_RESP_SUCCESS on success
+            CMD_RESP_BAD if there is no switch or a command is in flight
+    */
+    if (honey->pwr_port == NULL) return CMD_RESP_BAD;
+    if (honey->state != HONEY_STATE_IDLE) return CMD_RESP_BAD;
+
+    HW_GPIO_Write(honey->pwr_port, honey->pwr_pin, 0);
+    honey->powered = 0;
+    honey_fan_set(honey, 0);
+
+    return CMD_RESP_SUCCESS;
+}
+
+
+/* Autosend Stream APIs ------------------------------------------------------*/
+honey_cmd_resp_t honey_stream_start(honey_t *honey, uint8_t *buff, uint16_t size) {
+    /*
+        Enable autosend and receive the frames into buff by circular DMA.
+        Frames are parsed in place by honey_stream_parse(), which runs from
+        honey_process() on DMA half/full and UART idle-line events, and
+        each valid frame updates pm2_5 and pm10_0.
+        params
+            *honey: pointer type of honey_t variable
+            buff: circular buffer, must stay valid until honey_stream_stop()
+            size: buff size, at least 2 frames is recommended
+        return
+            CMD_RESP_SUCCESS if streaming has started
+    */
+    if (honey->state != HONEY_STATE_IDLE) return CMD_RESP_BAD;
+    if (honey->huart->hdmarx == NULL || size < HONEY_AUTOSEND_FRAME_SIZE) return CMD_RESP_BAD;
+
+    honey->stream_buff   = buff;
+    honey->stream_size   = size;
+    honey->stream_rd     = 0;
+    honey->stream_frames = 0;
+    honey->stream_errors = 0;
+    honey->state         = HONEY_STATE_STREAM;
+
+    // DMA does not run in STOP mode
+    LPM_SetStopMode(LPM_HONEY_Id, LPM_Disable);
+
+    if (HAL_UART_Receive_DMA(honey->huart, buff, size) != HAL_OK) {
+        honey->state = HONEY_STATE_IDLE;
+        LPM_SetStopMode(LPM_HONEY_Id, LPM_Enable);
+        return CMD_RESP_ERR;
+    }
+    __HAL_UART_ENABLE_IT(honey->huart, UART_IT_IDLE);
+
+    // the ack of this command lands in the stream and is skipped by the parser
+    if (HAL_UART_Transmit_IT(honey->huart, (uint8_t*) honey_cmd_frames[HONEY_CMD_AUTOEN].frame,
+                             honey_cmd_frames[HONEY_CMD_AUTOEN].len) != HAL_OK) {
+        __HAL_UART_DISABLE_IT(honey->huart, UART_IT_IDLE);
+        HAL_UART_AbortReceive(honey->huart);
+
+        honey->state = HONEY_STATE_IDLE;
+        LPM_SetStopMode(LPM_HONEY_Id, LPM_Enable);
+        return CMD_RESP_ERR;
+    }
+
+    return CMD_RESP_SUCCESS;
+}
+
+honey_cmd_resp_t honey_stream_stop(honey_t *honey, honey_cb_t cb) {
+    /*
+        Parse what is left in the buffer, stop the DMA and disable autosend.
+        cb is called with the response of the autosend stop command.
+    */
+    if (honey->state != HONEY_STATE_STREAM) return CMD_RESP_BAD;
+
+    honey_stream_parse(honey);
+
+    __HAL_UART_DISABLE_IT(honey->huart, UART_IT_IDLE);
+    HAL_UART_AbortReceive(honey->huart);
+
+    honey->state = HONEY_STATE_IDLE;
+    LPM_SetStopMode(LPM_HONEY_Id, LPM_Enable);
+
+    return honey_cmd_async(honey, HONEY_CMD_AUTOSTOP, 0, cb);
+}
+
+uint16_t honey_stream_parse(honey_t *honey) {
+    /*
+        Consume the bytes the DMA has written since the last call.
+        The parser resynchronises on the 0x42 0x4D header, checks the
+        length and the 16 bit sum, then reads PM2.5 (DATA3,4) and
+        PM10 (DATA5,6) straight out of the ring, no frame copy is made.
+        return
+            number of valid frames published
+    */
+    uint8_t*  ring  = honey->stream_buff;
+    uint16_t  size  = honey->stream_size;
+    uint16_t  rd    = honey->stream_rd;
+    uint16_t  wr    = 0;
+    uint16_t  avail = 0;
+    uint16_t  sum   = 0;
+    uint16_t  count = 0;
+    uint8_t   i     = 0;
+
+    if (honey->state != HONEY_STATE_STREAM) return 0;
+
+    // DMA write index, CNDTR counts down and reloads in circular mode
+    wr = size - __HAL_DMA_GET_COUNTER(honey->huart->hdmarx);
+    if (wr >= size) wr = 0;
+    avail = (wr + size - rd) % size;
+
+#define RING(n) (ring[(rd + (n)) % size])
+
+    while (avail >= 2) {
+        // resync, drop bytes until a header is found
+        if (RING(0) != 0x42 || RING(1) != 0x4D) {
+            rd = (rd + 1) % size;
+            avail--;
+            continue;
+        }
+
+        // wait for the rest of the frame
+        if (avail < HONEY_AUTOSEND_FRAME_SIZE) break;
+
+        sum = 0;
+        for (i = 0; i < HONEY_AUTOSEND_FRAME_SIZE - 2; ++i) {
+            sum += RING(i);
+        }
+
+        if (RING(2) != 0x00 || RING(3) != HONEY_AUTOSEND_FRAME_SIZE - 4 ||
+            sum != (uint16_t) (RING(30) * 256 + RING(31))) {
+            // not a frame, skip the header and resync
+            honey->stream_errors++;
+            rd = (rd + 1) % size;
+            avail--;
+            continue;
+        }
+
+        honey->pm2_5  = RING(6) * 256 + RING(7);
+        honey->pm10_0 = RING(8) * 256 + RING(9);
+        honey->stream_frames++;
+        count++;
+
+        rd = (rd + HONEY_AUTOSEND_FRAME_SIZE) % size;
+        avail -= HONEY_AUTOSEND_FRAME_SIZE;
+
+        if (honey->frame_cb != NULL) {
+            honey->frame_cb(honey);
+        }
+    }
+
+#undef RING
+
+    honey->stream_rd = rd;
+    return count;
+}
+
+void honey_set_frame_cb(honey_t *honey, void (*frame_cb)(honey_t *honey)) {
+    /*
+        Register a function called from honey_process() for each valid frame
+    */
+    honey->frame_cb = frame_cb;
+}
+
+
+/* Application Hooks ---------------------------------------------------------*/
+__weak void honey_fan_callback(honey_t *honey, uint8_t on) {
+    /*
+        Called when the fan goes on or off, from interrupt context. Override
+        it to account for the fan current.
+    */
+    (void) honey;
+    (void) on;
+}
+
+
+/* Interrupt Hooks -----------------------------------------------------------*/
+void honey_irq_handler(honey_t *honey) {
+    /*
+        Call from the IRQ handler of the UART the sensor is connected to
+    */
+    // start bit of the response woke the core, handled here as older HAL
+    // versions reset RxState on WUF and would drop the reception
+    if (__HAL_UART_GET_IT_SOURCE(honey->huart, UART_IT_WUF) &&
+        __HAL_UART_GET_FLAG(honey->huart, UART_FLAG_WUF)) {
+        __HAL_UART_CLEAR_FLAG(honey->huart, UART_CLEAR_WUF);
+        honey_wake_disarm(honey);
+    }
+
+    // idle line after a burst of autosend bytes, parse it without waiting for DMA HT/TC
+    if (honey->state == HONEY_STATE_STREAM && __HAL_UART_GET_FLAG(honey->huart, UART_FLAG_IDLE)) {
+        __HAL_UART_CLEAR_IDLEFLAG(honey->huart);
+        honey_stream_notify(honey);
+    }
+
+    HAL_UART_IRQHandler(honey->huart);
+}
+
+void honey_dma_irq_handler(honey_t *honey) {
+    /*
+        Call from the IRQ handler of the sensor UART RX DMA channel
+    */
+    HAL_DMA_IRQHandler(honey->huart->hdmarx);
+}
+
+void honey_rx_half_cplt_callback(honey_t *honey) {
+    /*
+        Call from HAL_UART_RxHalfCpltCallback() for the sensor UART
+    */
+    honey_stream_notify(honey);
+}
+
+void honey_rx_cplt_callback(honey_t *honey) {
+    /*
+        Call from HAL_UART_RxCpltCallback() for the sensor UART
+    */
+    uint8_t remain = 0;
+
+    if (honey->state == HONEY_STATE_STREAM) {
+        honey_stream_notify(honey);
+        return;
+    }
+
+    if (honey->state == HONEY_STATE_TX && honey->rx_buff[0] == 0x40) {
+        // data frame is HEAD LEN CMD DATA.. CS, LEN counts CMD and DATA
+        remain = honey->rx_buff[1] + 1;
+
+        if (remain > HONEY_RX_BUFF_SIZE - 2) {
+            honey_finish(honey, CMD_RESP_HEADER);
+            return;
+        }
+
+        if (HAL_UART_Receive_IT(honey->huart, &honey->rx_buff[2], remain) == HAL_OK) {
+            honey->state = HONEY_STATE_RX_DATA;
+            return;
+        }
+
+        honey_finish(honey, CMD_RESP_ERR);
+        return;
+    }
+
+    honey_finish(honey, honey_parse(honey));
+}
+
+void honey_tx_cplt_callback(honey_t *honey) {
+    /*
+        Call from HAL_UART_TxCpltCallback() for the sensor UART
+    */
+    // the command is out, nothing happens until the sensor answers
+    if (honey->stop_wake && honey->state == HONEY_STATE_TX) {
+        honey_wake_arm(honey);
+    }
+}
+
+void honey_error_callback(honey_t *honey) {
+    /*
+        Call from HAL_UART_ErrorCallback() for the sensor UART
+    */
+    if (honey->state == HONEY_STATE_STREAM) {
+        // HAL stops the DMA on overrun, restart the ring and resync
+        HAL_UART_AbortReceive(honey->huart);
+        honey->stream_rd = 0;
+        HAL_UART_Receive_DMA(honey->huart, honey->stream_buff, honey->stream_size);
+        return;
+    }
+
+    HAL_UART_AbortReceive(honey->huart);
+    honey_finish(honey, CMD_RESP_ERR);
+}
+
+
+/* Private Functions ---------------------------------------------------------*/
+static honey_cmd_resp_t honey_cmd(honey_t *honey, honey_cmd_t cmd, uint8_t arg) {
+    /*
+        Blocking command, issues cmd and sleeps until it completes
+    */
+    honey_cmd_resp_t resp = honey_cmd_async(honey, cmd, arg, NULL);
+
+    if (resp != CMD_RESP_SUCCESS) return resp;
+
+    return honey_wait(honey);
+}
+
+static honey_cmd_resp_t honey_wait(honey_t *honey) {
+    /*
+        Sleep until the command in flight completes and consume its result
+    */
+    while (honey->state == HONEY_STATE_TX || honey->state == HONEY_STATE_RX_DATA ||
+           honey->state == HONEY_STATE_RETRY || honey->state == HONEY_STATE_BOOT) {
+        DISABLE_IRQ();
+
+        // the response may have come in after the check above
+        if (honey->state == HONEY_STATE_TX || honey->state == HONEY_STATE_RX_DATA ||
+            honey->state == HONEY_STATE_RETRY || honey->state == HONEY_STATE_BOOT) {
+            LPM_EnterLowPower();
+        }
+
+        ENABLE_IRQ();
+    }
+
+    honey->cb    = NULL;
+    honey->state = HONEY_STATE_IDLE;
+
+    return honey->resp;
+}
+
+static honey_cmd_resp_t honey_parse(honey_t *honey) {
+    /*
+        Check the response against the command in flight
+    */
+    uint8_t* resp = honey->rx_buff;
+
+    // any command can be refused
+    if (resp[0] == 0x96 && resp[1] == 0x96) return CMD_RESP_NACK;
+
+    switch (honey->cmd) {
+        case HONEY_CMD_READ:
+            if (resp[0] == 0x40 && resp[1] == 0x05 && resp[2] == 0x04) {
+                if (calc_cs(resp, 8) != resp[7]) return CMD_RESP_CHECKSUM;
+
+                honey->pm2_5 = resp[3] * 256 + resp[4];
+                honey->pm10_0 = resp[5] * 256 + resp[6];
+
+                return CMD_RESP_SUCCESS;
+            }
+            break;
+
+        case HONEY_CMD_READCOEF:
+            if (resp[0] == 0x40 && resp[1] == 0x02 && resp[2] == 0x10) {
+                if (calc_cs(resp, 5) != resp[4]) return CMD_RESP_CHECKSUM;
+
+                // this function automatically set the honey.customer_coef to what it reads
+                honey->customer_coef = resp[3];
+
+                return CMD_RESP_SUCCESS;
+            }
+            break;
+
+        default:
+            if (resp[0] == 0xA5 && resp[1] == 0xA5) { // success is 0xA5A5
+                return CMD_RESP_SUCCESS;
+            }
+            break;
+    }
+
+    return CMD_RESP_HEADER;
+}
+
+static HAL_StatusTypeDef honey_issue(honey_t *honey) {
+    /*
+        Send the frame in flight and arm reception for its response
+    */
+    honey->attempts++;
+    honey->state = HONEY_STATE_TX;
+    honey_wake_disarm(honey);
+    memset(honey->rx_buff, 0x00, sizeof(honey->rx_buff));
+
+    // drop what is left of an earlier reply, it would shift this one
+    __HAL_UART_SEND_REQ(honey->huart, UART_RXDATA_FLUSH_REQUEST);
+    __HAL_UART_CLEAR_FLAG(honey->huart, UART_CLEAR_OREF);
+
+    TimerSetValue(&honey->timeout_timer, HONEY_CMD_TIMEOUT);
+    TimerStart(&honey->timeout_timer);
+
+    // arm reception first so the start of the response can't be missed,
+    // every response begins with 2 bytes: A5 A5 / 96 96 or 40 LEN
+    if (HAL_UART_Receive_IT(honey->huart, honey->rx_buff, 2) != HAL_OK ||
+        HAL_UART_Transmit_IT(honey->huart, (uint8_t*) honey->tx, honey->tx_len) != HAL_OK) {
+        TimerStop(&honey->timeout_timer);
+        HAL_UART_Abort(honey->huart);
+        return HAL_ERROR;
+    }
+
+    return HAL_OK;
+}
+
+static void honey_finish(honey_t *honey, honey_cmd_resp_t resp) {
+    /*
+        End the attempt in flight, runs in interrupt context
+    */
+    if (honey->state != HONEY_STATE_TX && honey->state != HONEY_STATE_RX_DATA) return;
+
+    TimerStop(&honey->timeout_timer);
+
+    honey->resp = resp;
+    honey_count_error(honey, resp);
+
+    if (resp != CMD_RESP_SUCCESS) {
+        // let the rest of a garbled reply go by before the line is used again,
+        // honey_on_timeout() then retries or completes
+        honey->state = HONEY_STATE_RETRY;
+        TimerSetValue(&honey->timeout_timer, HONEY_RETRY_GAP);
+        TimerStart(&honey->timeout_timer);
+        return;
+    }
+
+    if (honey->cmd == HONEY_CMD_START) {
+        honey_fan_set(honey, 1);
+    } else if (honey->cmd == HONEY_CMD_STOP) {
+        honey_fan_set(honey, 0);
+    } else if (honey->cmd == HONEY_CMD_SETCOEF) {
+        honey->customer_coef = honey->coef_staged;
+    }
+
+    honey_complete(honey);
+}
+
+static void honey_complete(honey_t *honey) {
+    /*
+        Hand the result over to honey_process()
+    */
+    honey->state = HONEY_STATE_DONE;
+
+    // first reply since the supply came on
+    if (honey->resp == CMD_RESP_SUCCESS && honey->pwr_port != NULL && honey->boot_ms == 0 &&
+        honey->attempts > 0) {
+        honey->boot_ms = TimerGetElapsedTime(honey->power_on);
+    }
+
+    honey_wake_disarm(honey);
+    LPM_SetStopMode(LPM_HONEY_Id, LPM_Enable);
+
+    if (honey->notify != NULL) {
+        honey->notify();
+    }
+}
+
+static void honey_count_error(honey_t *honey, honey_cmd_resp_t resp) {
+    switch (resp) {
+        case CMD_RESP_SUCCESS:                              break;
+        case CMD_RESP_TIMEOUT:  honey->errors.timeout++;    break;
+        case CMD_RESP_NACK:     honey->errors.nack++;       break;
+        case CMD_RESP_HEADER:   honey->errors.header++;     break;
+        case CMD_RESP_CHECKSUM: honey->errors.checksum++;   break;
+        default:                honey->errors.uart++;       break;
+    }
+}
+
+static void honey_stream_notify(honey_t *honey) {
+    /*
+        New stream bytes, let the main loop parse them
+    */
+    if (honey->notify != NULL) {
+        honey->notify();
+    }
+}
+
+static void honey_on_timeout(void *context) {
+    /*
+        No complete response within HONEY_CMD_TIMEOUT, or the quiet gap
+        after a failed attempt is over
+    */
+    honey_t* honey = (honey_t*) context;
+
+    // booted, honey_process() runs the startup routine
+    if (honey->state == HONEY_STATE_BOOT) {
+        honey->resp = CMD_RESP_SUCCESS;
+        honey_complete(honey);
+        return;
+    }
+
+    if (honey->state == HONEY_STATE_RETRY) {
+        if (honey->attempts < honey->retry_max &&
+            TimerGetElapsedTime(honey->first_attempt) + HONEY_CMD_TIMEOUT <= honey->retry_budget) {
+            honey->errors.retries++;
+            if (honey_issue(honey) == HAL_OK) return;
+            honey->resp = CMD_RESP_ERR;
+        }
+
+        honey->errors.failed++;
+        honey_complete(honey);
+        return;
+    }
+
+    HAL_UART_AbortReceive(honey->huart);
+    honey_finish(honey, CMD_RESP_TIMEOUT);
+}
+
+static void honey_wake_arm(honey_t *honey) {
+    /*
+        Allow STOP until the response starts, its start bit wakes the core
+    */
+    __HAL_UART_CLEAR_FLAG(honey->huart, UART_CLEAR_WUF);
+    __HAL_UART_ENABLE_IT(honey->huart, UART_IT_WUF);
+    HW_SetStopWakeUart(honey->huart);
+
+    LPM_SetStopMode(LPM_HONEY_Id, LPM_Enable);
+}
+
+static void honey_wake_disarm(honey_t *honey) {
+    /*
+        Back to sleep mode only, the rest of the response is read by RXNE
+        which can't wake the core from STOP on its own
+    */
+    if (!honey->stop_wake) return;
+
+    LPM_SetStopMode(LPM_HONEY_Id, LPM_Disable);
+
+    __HAL_UART_DISABLE_IT(honey->huart, UART_IT_WUF);
+    HW_SetStopWakeUart(NULL);
+}
+
+static void honey_setup_next(honey_t *honey, honey_cmd_resp_t resp) {
+    /*
+        Startup routine after a power-up, one command per call
+    */
+    honey_cb_t cb = honey->setup_cb;
+
+    if (resp == CMD_RESP_SUCCESS && honey->setup_step < HONEY_SETUP_STEPS) {
+        resp = honey_cmd_async(honey, honey_setup_cmds[honey->setup_step++], 0, honey_setup_next);
+        if (resp == CMD_RESP_SUCCESS) return;
+    }
+
+    honey->setup_cb = NULL;
+    if (cb != NULL) {
+        cb(honey, resp);
+    }
+}
+
+static void honey_fan_set(honey_t *honey, uint8_t on) {
+    /*
+        Track the fan and tell the application when it changes
+    */
+    if (honey->fan == on) return;
+
+    honey->fan = on;
+    honey_fan_callback(honey, on);
+}
@@ -0,0 +1,187 @@
+#include "hw.h"
+#include "ct_log.h"
+
+#define LOG_SLOTS       ((LOG_EEPROM_END - LOG_EEPROM_START) / 4 - 1) // the first word counts laps
+#define LOG_WEAR_ADDR   LOG_EEPROM_START
+#define LOG_SLOT_ADDR(i) (LOG_EEPROM_START + 4 + 4 * (uint32_t) (i))
+#define LOG_TIME_MASK   ((1UL << LOG_TIME_BITS) - 1)
+#define LOG_PM_MAX      ((1UL << LOG_PM_BITS) - 1)
+#define LOG_SENT        (1UL << 29)
+#define LOG_LAP(w)      ((w) >> 30)
+#define LOG_TIME(w)     (((w) >> LOG_PM_BITS) & LOG_TIME_MASK)
+#define LOG_PM(w)       ((w) & LOG_PM_MAX)
+
+static uint16_t log_wr;       // next slot to write
+static uint8_t  log_lap;      // lap marker of the slot at log_wr, 1 to 3
+static uint16_t log_unsent;   // records not yet sent
+static uint32_t log_epoch;    // added to RTC time so it carries on over a reset
+static uint32_t log_laps;     // laps completed, kept in the first word
+
+static uint32_t log_get(uint16_t slot)
+{
+  return *(volatile const uint32_t *) LOG_SLOT_ADDR(slot);
+}
+
+static void log_put(uint32_t addr, uint32_t data)
+{
+  HAL_FLASHEx_DATAEEPROM_Unlock();
+  HAL_FLASHEx_DATAEEPROM_Program(FLASH_TYPEPROGRAMDATA_WORD, addr, data);
+  HAL_FLASHEx_DATAEEPROM_Lock();
+}
+
+static uint32_t log_now(void)
+{
+  uint16_t subs = 0;
+
+  return (log_epoch + HW_RTC_GetCalendarTime(&subs) / LOG_TIME_UNIT) & LOG_TIME_MASK;
+}
+
+static uint16_t log_oldest(void)
+{
+  // once the ring has wrapped the oldest record is the next one overwritten
+  return LOG_LAP(log_get(log_wr)) ? log_wr : 0;
+}
+
+void log_init(void)
+{
+  /*
+      Find the write position from the lap markers: every slot before it
+      carries the lap of slot 0, the slot at it carries the previous lap or
+      none. Call it once the RTC runs.
+  */
+  uint32_t first = log_get(0);
+  uint32_t newest = 0;
+  uint16_t i = 0;
+
+  log_laps   = *(volatile const uint32_t *) LOG_WEAR_ADDR;
+  log_unsent = 0;
+  log_epoch  = 0;
+
+  if (LOG_LAP(first) == 0) {
+    log_wr  = 0;
+    log_lap = 1;
+    return;
+  }
+
+  for (i = 1; i < LOG_SLOTS && LOG_LAP(log_get(i)) == LOG_LAP(first); ++i);
+
+  if (i == LOG_SLOTS) {
+    log_wr  = 0;
+    log_lap = LOG_LAP(first) % 3 + 1;
+  } else {
+    log_wr  = i;
+    log_lap = LOG_LAP(first);
+  }
+
+  for (i = 0; i < LOG_SLOTS; ++i) {
+    if (LOG_LAP(log_get(i)) && !(log_get(i) & LOG_SENT)) {
+      log_unsent++;
+    }
+  }
+
+  // the RTC restarts from 0, new records follow the newest one instead,
+  // the time the node was off is lost
+  newest = log_get((log_wr == 0) ? LOG_SLOTS - 1 : log_wr - 1);
+  log_epoch = (LOG_TIME(newest) + 1 - log_now()) & LOG_TIME_MASK;
+}
+
+void log_push(uint16_t pm2_5, log_record_t *rec)
+{
+  /*
+      Append an unsent reading, overwriting the oldest one when the ring is
+      full. It is backfilled unless log_mark_sent() is called with rec once
+      a frame carrying it has been accepted.
+      params
+          rec: set to the record, its word is 0 if it was not logged
+  */
+  uint32_t old = log_get(log_wr);
+  uint32_t word = 0;
+
+  rec->slot  = log_wr;
+  rec->word  = 0;
+  rec->pm2_5 = pm2_5;
+  rec->age   = 0;
+
+  if (log_wear() >= LOG_WEAR_LIMIT) return;
+
+  if (LOG_LAP(old) && !(old & LOG_SENT)) {
+    log_unsent--;
+  }
+
+  word = ((uint32_t) log_lap << 30) | (log_now() << LOG_PM_BITS) |
+         ((pm2_5 > LOG_PM_MAX) ? LOG_PM_MAX : pm2_5);
+  log_put(LOG_SLOT_ADDR(log_wr), word);
+  rec->word = word;
+  log_unsent++;
+
+  if (++log_wr == LOG_SLOTS) {
+    log_wr  = 0;
+    log_lap = log_lap % 3 + 1;
+    log_put(LOG_WEAR_ADDR, ++log_laps);
+  }
+}
+
+uint8_t log_read(log_record_t *recs, uint8_t max)
+{
+  /*
+      Collect the oldest unsent records, oldest first
+      params
+          recs: filled with up to max records
+      return
+          number of records collected
+  */
+  uint32_t now = log_now();
+  uint32_t word = 0;
+  uint16_t slot = log_oldest();
+  uint16_t i = 0;
+  uint8_t  n = 0;
+
+  for (i = 0; i < LOG_SLOTS && n < max && log_unsent > 0; ++i) {
+    word = log_get(slot);
+    if (LOG_LAP(word) && !(word & LOG_SENT)) {
+      recs[n].slot  = slot;
+      recs[n].word  = word;
+      recs[n].pm2_5 = LOG_PM(word);
+      recs[n].age   = ((now - LOG_TIME(word)) & LOG_TIME_MASK) * LOG_TIME_UNIT;
+      n++;
+    }
+    slot = (slot + 1) % LOG_SLOTS;
+  }
+
+  return n;
+}
+
+void log_mark_sent(const log_record_t *recs, uint8_t count)
+{
+  /*
+      Flag records from log_read() or log_push() as sent, the second and
+      last write a slot gets in its lap
+  */
+  uint8_t i = 0;
+
+  for (i = 0; i < count; ++i) {
+    if (LOG_LAP(recs[i].word) && log_get(recs[i].slot) == recs[i].word) {
+      log_put(LOG_SLOT_ADDR(recs[i].slot), recs[i].word | LOG_SENT);
+      log_unsent--;
+    }
+  }
+}
+
+uint16_t log_backlog(void)
+{
+  return log_unsent;
+}
+
+uint16_t log_size(void)
+{
+  return LOG_SLOTS;
+}
+
+uint32_t log_wear(void)
+{
+  /*
+      return worst case writes per word so far, a slot is written once per
+      lap and once more if it is backfilled
+  */
+  return 2 * (log_laps + 1);
+}
@@ -0,0 +1,142 @@
+#include <string.h>
+#include "ct_lpp.h"
+
+typedef struct {
+  uint8_t type;
+  uint8_t values;     // values a channel of the type carries
+  uint8_t bytes;      // bytes a value
+  uint8_t sign;       // values are signed
+} lpp_type_t;
+
+static const lpp_type_t lpp_types[] = {
+  { LPP_DATATYPE_DIGITAL_INPUT,  1, 1, 0 },
+  { LPP_DATATYPE_DIGITAL_OUTPUT, 1, 1, 0 },
+  { LPP_DATATYPE_ANALOG_INPUT,   1, 2, 1 },
+  { LPP_DATATYPE_ANALOG_OUTPUT,  1, 2, 1 },
+  { LPP_DATATYPE_ILLUMINANCE,    1, 2, 0 },
+  { LPP_DATATYPE_PRESENCE,       1, 1, 0 },
+  { LPP_DATATYPE_TEMPERATURE,    1, 2, 1 },
+  { LPP_DATATYPE_HUMIDITY,       1, 1, 0 },
+  { LPP_DATATYPE_ACCELEROMETER,  3, 2, 1 },
+  { LPP_DATATYPE_BAROMETER,      1, 2, 0 },
+  { LPP_DATATYPE_CONCENTRATION,  1, 2, 0 },
+  { LPP_DATATYPE_GYROMETER,      3, 2, 1 },
+  { LPP_DATATYPE_GPS,            3, 3, 1 }
+};
+
+#define LPP_TYPE_COUNT  (sizeof(lpp_types) / sizeof(lpp_types[0]))
+
+static const lpp_type_t* lpp_type(uint8_t type)
+{
+  uint8_t i = 0;
+
+  for (i = 0; i < LPP_TYPE_COUNT; ++i) {
+    if (lpp_types[i].type == type) return &lpp_types[i];
+  }
+
+  return NULL;
+}
+
+static int32_t lpp_clamp(int32_t v, const lpp_type_t *t)
+{
+  // the range of the value bytes, signed or not
+  int32_t max = t->sign ? (1L << (8 * t->bytes - 1)) - 1 : (1L << (8 * t->bytes)) - 1;
+  int32_t min = t->sign ? -max - 1 : 0;
+
+  return (v > max) ? max : ((v < min) ? min : v);
+}
+
+void lpp_init(lpp_t *lpp, uint8_t *buff, uint8_t max)
+{
+  /*
+      Start an empty payload in buff, at most max bytes
+  */
+  lpp->buff = buff;
+  lpp->size = 0;
+  lpp->max  = max;
+}
+
+uint8_t lpp_size(uint8_t type)
+{
+  /*
+      return bytes of a channel of type, channel and type included, 0 if
+      the type is unknown
+  */
+  const lpp_type_t *t = lpp_type(type);
+
+  return (t != NULL) ? 2 + t->values * t->bytes : 0;
+}
+
+uint8_t lpp_values(uint8_t type)
+{
+  /*
+      return values a channel of type carries, 0 if the type is unknown
+  */
+  const lpp_type_t *t = lpp_type(type);
+
+  return (t != NULL) ? t->values : 0;
+}
+
+uint8_t lpp_add_values(lpp_t *lpp, uint8_t channel, uint8_t type, const int32_t *values)
+{
+  /*
+      Append a channel
+      params
+          values: lpp_values(type) of them, in the unit of the type
+      return
+          1 if added, 0 if the type is unknown or the channel does not fit
+  */
+  const lpp_type_t *t = lpp_type(type);
+  int32_t v = 0;
+  uint8_t k = 0;
+  uint8_t b = 0;
+
+  if (t == NULL || lpp->size + lpp_size(type) > lpp->max) return 0;
+
+  lpp->buff[lpp->size++] = channel;
+  lpp->buff[lpp->size++] = type;
+  for (k = 0; k < t->values; ++k) {
+    v = lpp_clamp(values[k], t);
+    for (b = t->bytes; b > 0; --b) {
+      lpp->buff[lpp->size++] = (v >> (8 * (b - 1))) & 0xFF;
+    }
+  }
+
+  return 1;
+}
+
+uint8_t lpp_add(lpp_t *lpp, uint8_t channel, uint8_t type, int32_t value)
+{
+  /*
+      Append a channel of a single-value type, see lpp_add_values()
+  */
+  if (lpp_values(type) != 1) return 0;
+
+  return lpp_add_values(lpp, channel, type, &value);
+}
+
+int32_t lpp_value(const uint8_t *data, uint8_t type, uint8_t k)
+{
+  /*
+      Read back value k of a channel, for the ingest side
+      params
+          data: the bytes after channel and type, lpp_size(type) - 2 of them
+      return
+          the value in the unit of the type, 0 for an unknown type
+  */
+  const lpp_type_t *t = lpp_type(type);
+  uint32_t v = 0;
+  uint8_t  b = 0;
+
+  if (t == NULL || k >= t->values) return 0;
+
+  data += k * t->bytes;
+  for (b = 0; b < t->bytes; ++b) {
+    v = (v << 8) | data[b];
+  }
+  if (t->sign && (v & (1UL << (8 * t->bytes - 1)))) {
+    v |= ~((1UL << (8 * t->bytes)) - 1);
+  }
+
+  return (int32_t) v;
+}
@@ -0,0 +1,244 @@
+#include <string.h>
+#include "ct_payload.h"
+
+#define PAYLOAD_HEAD_BITS   (8 + 4 + 6) // tag and version, fields mask, status
+#define PAYLOAD_V1_PM_BITS  10
+#define PAYLOAD_V1_PM_MAX   ((1U << PAYLOAD_V1_PM_BITS) - 1)
+#define PAYLOAD_LAT_BITS    25
+#define PAYLOAD_LON_BITS    26
+#define PAYLOAD_LAT_MAX     9000000L    // 90 degrees
+#define PAYLOAD_LON_MAX     18000000L   // 180 degrees
+
+typedef struct {
+  uint8_t *buff;
+  uint16_t bit;     // next bit, MSB of byte 0 first
+} payload_writer_t;
+
+typedef struct {
+  const uint8_t *buff;
+  uint16_t bit;
+  uint16_t bits;    // bits in the frame
+  uint8_t  over;    // a read went past the frame
+} payload_reader_t;
+
+/* v2 PM classes, the first that holds the value is used */
+typedef struct {
+  uint8_t  bits;
+  uint16_t base;
+} payload_pm_class_t;
+
+static const payload_pm_class_t payload_pm_classes[4] = {
+  {  6,   0 },    // 0 to 63, clean air
+  {  8,  64 },    // 64 to 319, haze
+  { 10, 320 },    // 320 to 1343, the HPM range ends at 1000
+  { 16,   0 }     // anything else
+};
+
+static void payload_put(payload_writer_t *w, uint32_t value, uint8_t bits)
+{
+  // a byte at a time, the buffer is cleared first so bits are OR-ed in
+  uint8_t room = 0;
+  uint8_t n = 0;
+
+  while (bits > 0) {
+    room = 8 - (w->bit & 7);
+    n    = (bits < room) ? bits : room;
+    bits -= n;
+    w->buff[w->bit >> 3] |= ((value >> bits) & ((1U << n) - 1)) << (room - n);
+    w->bit += n;
+  }
+}
+
+static uint32_t payload_get(payload_reader_t *r, uint8_t bits)
+{
+  uint32_t value = 0;
+  uint8_t  room = 0;
+  uint8_t  n = 0;
+
+  if (r->bit + bits > r->bits) {
+    r->over = 1;
+    return 0;
+  }
+
+  while (bits > 0) {
+    room = 8 - (r->bit & 7);
+    n    = (bits < room) ? bits : room;
+    bits -= n;
+    value = (value << n) | ((r->buff[r->bit >> 3] >> (room - n)) & ((1U << n) - 1));
+    r->bit += n;
+  }
+
+  return value;
+}
+
+static int32_t payload_get_signed(payload_reader_t *r, uint8_t bits)
+{
+  uint32_t value = payload_get(r, bits);
+
+  // sign extend
+  if (value & (1UL << (bits - 1))) {
+    value |= ~((1UL << bits) - 1);
+  }
+
+  return (int32_t) value;
+}
+
+static uint8_t payload_pm_class(uint16_t pm)
+{
+  uint8_t c = 0;
+
+  while (c < 3 && pm - payload_pm_classes[c].base >= (1U << payload_pm_classes[c].bits)) {
+    c++;
+  }
+
+  return c;
+}
+
+static void payload_put_pm(payload_writer_t *w, uint16_t pm)
+{
+  uint8_t c = payload_pm_class(pm);
+
+  payload_put(w, c, 2);
+  payload_put(w, pm - payload_pm_classes[c].base, payload_pm_classes[c].bits);
+}
+
+static uint16_t payload_get_pm(payload_reader_t *r, uint8_t version)
+{
+  uint8_t c = 0;
+
+  if (version == 1) {
+    return payload_get(r, PAYLOAD_V1_PM_BITS);
+  }
+
+  c = payload_get(r, 2);
+  return payload_pm_classes[c].base + payload_get(r, payload_pm_classes[c].bits);
+}
+
+static int32_t payload_clamp(int32_t v, int32_t max)
+{
+  return (v > max) ? max : ((v < -max) ? -max : v);
+}
+
+uint8_t payload_size(const payload_t *p)
+{
+  /*
+      return bytes payload_encode() writes for p
+  */
+  uint8_t bits = PAYLOAD_HEAD_BITS;
+
+  if (p->fields & PAYLOAD_F_PM2_5) {
+    bits += 2 + payload_pm_classes[payload_pm_class(p->pm2_5)].bits;
+  }
+  if (p->fields & PAYLOAD_F_PM10_0) {
+    bits += 2 + payload_pm_classes[payload_pm_class(p->pm10_0)].bits;
+  }
+  if (p->fields & PAYLOAD_F_BATTERY)  bits += 8;
+  if (p->fields & PAYLOAD_F_LOCATION) bits += PAYLOAD_LAT_BITS + PAYLOAD_LON_BITS;
+
+  return (bits + 7) / 8;
+}
+
+uint8_t payload_encode(const payload_t *p, uint8_t *buff, uint8_t max)
+{
+  /*
+      Encode a reading with the current schema
+      params
+          p: reading, only the fields in p->fields are written
+          buff: at least max bytes
+      return
+          bytes written, 0 if the frame does not fit max
+  */
+  payload_writer_t w;
+  uint8_t size = payload_size(p);
+
+  if (size > max) return 0;
+
+  memset(buff, 0x00, size);
+  w.buff = buff;
+  w.bit  = 0;
+
+  payload_put(&w, PAYLOAD_TAG | (PAYLOAD_VERSION << 5), 8);
+  payload_put(&w, p->fields, 4);
+  payload_put(&w, p->status, 6);
+
+  if (p->fields & PAYLOAD_F_PM2_5) {
+    payload_put_pm(&w, p->pm2_5);
+  }
+  if (p->fields & PAYLOAD_F_PM10_0) {
+    payload_put_pm(&w, p->pm10_0);
+  }
+  if (p->fields & PAYLOAD_F_BATTERY) {
+    payload_put(&w, p->battery, 8);
+  }
+  if (p->fields & PAYLOAD_F_LOCATION) {
+    payload_put(&w, (uint32_t) payload_clamp(p->latitude, PAYLOAD_LAT_MAX), PAYLOAD_LAT_BITS);
+    payload_put(&w, (uint32_t) payload_clamp(p->longitude, PAYLOAD_LON_MAX), PAYLOAD_LON_BITS);
+  }
+
+  return size;
+}
+
+payload_result_t payload_decode(const uint8_t *buff, uint8_t size, payload_t *p)
+{
+  /*
+      Decode a frame of any known schema version, bytes past the frame
+      are left to the caller
+      params
+          buff: frame as received, size bytes
+          p: result, fields not present are zero
+      return
+          PAYLOAD_OK, or why the frame was rejected
+  */
+  uint8_t used = 0;
+
+  return payload_decode_frame(buff, size, p, &used);
+}
+
+payload_result_t payload_decode_frame(const uint8_t *buff, uint8_t size, payload_t *p, uint8_t *used)
+{
+  /*
+      As payload_decode(), used is set to the bytes the frame takes so
+      whatever follows it in the uplink can be read
+  */
+  payload_reader_t r;
+  uint8_t version = 0;
+
+  memset(p, 0x00, sizeof(payload_t));
+  *used = 0;
+  if (size < 1) return PAYLOAD_ERR_SIZE;
+  if ((buff[0] & 0x1F) != PAYLOAD_TAG) return PAYLOAD_ERR_TAG;
+
+  version = buff[0] >> 5;
+  if (version < 1 || version > PAYLOAD_VERSION) return PAYLOAD_ERR_VERSION;
+
+  r.buff = buff;
+  r.bit  = 8;
+  r.bits = 8 * (uint16_t) size;
+  r.over = 0;
+
+  p->fields = payload_get(&r, 4);
+  p->status = payload_get(&r, 6);
+
+  if (p->fields & PAYLOAD_F_PM2_5) {
+    p->pm2_5 = payload_get_pm(&r, version);
+  }
+  if (p->fields & PAYLOAD_F_PM10_0) {
+    p->pm10_0 = payload_get_pm(&r, version);
+  }
+  if (p->fields & PAYLOAD_F_BATTERY) {
+    p->battery = payload_get(&r, 8);
+  }
+  if (p->fields & PAYLOAD_F_LOCATION) {
+    p->latitude  = payload_get_signed(&r, PAYLOAD_LAT_BITS);
+    p->longitude = payload_get_signed(&r, PAYLOAD_LON_BITS);
+  }
+
+  if (r.over) return PAYLOAD_ERR_SIZE;
+  *used = (r.bit + 7) / 8;
+  if (p->latitude < -PAYLOAD_LAT_MAX || p->latitude > PAYLOAD_LAT_MAX ||
+      p->longitude < -PAYLOAD_LON_MAX || p->longitude > PAYLOAD_LON_MAX) {
+    return PAYLOAD_ERR_RANGE;
+  }
+
+  return PAYLOAD_OK;
+}
@@ -0,0 +1,370 @@
+#include "hw.h"
+#include "timeServer.h"
+#include "ct_report.h"
+
+static uint32_t     report_period;          // ms between report timer events
+static uint8_t      report_valid;           // a report has gone out
+static uint8_t      report_err;             // the last report carried a sensor error
+static uint8_t      report_alarmed;         // PM2.5 is above REPORT_ALARM
+static uint8_t      report_forced;          // the alarm was crossed since the last report
+static uint16_t     report_pm2_5;           // PM2.5 of the last report
+static TimerTime_t  report_time;            // time of the last report
+static log_record_t report_logs[STATS_RING_SIZE]; // records of the readings since the last report
+static uint8_t      report_log_count;
+static uint16_t     batch_pm2_5[BATCH_MAX]; // buffered readings, the oldest at batch_head
+static TimerTime_t  batch_time[BATCH_MAX];  // time of each reading
+static log_record_t batch_log[BATCH_MAX];   // log record of each reading
+static uint8_t      batch_head;
+static uint8_t      batch_count;
+static uint8_t      batch_on;               // new readings go into the batch
+static uint8_t      fit_deferred;           // FIT_ parts the last reading frame had no room for
+
+/* the ct_payload field of each FIT_ bit, the stats are outside the frame*/
+static const uint8_t fit_codec_fields[FIT_COUNT] = {
+  PAYLOAD_F_PM2_5, PAYLOAD_F_PM10_0, PAYLOAD_F_BATTERY, 0
+};
+
+static uint8_t batch_entry(uint8_t first, uint8_t k, uint8_t *buff)
+{
+  /*
+      step from reading k-1 to reading k, times are rounded to
+      BATCH_STEP_UNIT from the reading first so the steps do not drift
+  */
+  uint32_t unit = 1000 * BATCH_STEP_UNIT;
+  uint8_t  b0   = (batch_head + first) % BATCH_MAX;
+  uint8_t  cur  = (batch_head + k) % BATCH_MAX;
+  uint8_t  prev = (batch_head + k - 1) % BATCH_MAX;
+  uint32_t dt   = (batch_time[cur] - batch_time[b0] + unit / 2) / unit -
+                  (batch_time[prev] - batch_time[b0] + unit / 2) / unit;
+
+  return report_step_encode(buff, dt, batch_pm2_5[cur], batch_pm2_5[prev]);
+}
+
+static uint8_t batch_size(uint8_t first)
+{
+  uint16_t size = BATCH_HEAD_SIZE;
+  uint8_t  k = 0;
+
+  for (k = first + 1; k < batch_count; ++k) {
+    size += batch_entry(first, k, NULL);
+  }
+
+  return (size > 0xFF) ? 0xFF : size;
+}
+
+static uint8_t fit_payload_fields(uint8_t fit)
+{
+  uint8_t fields = 0;
+  uint8_t k = 0;
+
+  for (k = 0; k < FIT_COUNT; ++k) {
+    if (fit & (1 << k)) {
+      fields |= fit_codec_fields[k];
+    }
+  }
+
+  return fields;
+}
+
+void report_init(uint32_t period)
+{
+  /*
+      Start with no report sent, so the first one is due
+  */
+  report_period    = period;
+  report_valid     = 0;
+  report_alarmed   = 0;
+  report_forced    = 0;
+  report_log_count = 0;
+  batch_head       = 0;
+  batch_count      = 0;
+  fit_deferred     = 0;
+}
+
+uint8_t report_alarm_check(uint16_t pm2_5)
+{
+  /*
+      return 1 if the reading crosses the alarm threshold, it is raised
+      at REPORT_ALARM and cleared REPORT_ALARM_HYST below
+  */
+  uint8_t alarm = report_alarmed;
+
+  if (pm2_5 >= REPORT_ALARM) {
+    alarm = 1;
+  } else if (pm2_5 + REPORT_ALARM_HYST < REPORT_ALARM) {
+    alarm = 0;
+  }
+  if (alarm == report_alarmed) return 0;
+
+  report_alarmed = alarm;
+  report_forced  = 1;
+  return 1;
+}
+
+uint8_t report_alarm(void)
+{
+  return report_alarmed;
+}
+
+uint8_t report_urgent(void)
+{
+  /*
+      return 1 while an alarm crossing waits to be reported, no other
+      frame should take its slot
+  */
+  return report_forced;
+}
+
+uint8_t report_due(uint8_t err, uint16_t pm2_5)
+{
+  /*
+      Report on an alarm crossing, a move past the delta, a change of
+      sensor health, or once the silence has lasted long enough. The
+      caller posts the report at once on a crossing, see
+      report_alarm_check()
+  */
+  uint16_t delta = 0;
+  uint16_t tol   = 0;
+
+  if (!report_valid || report_forced || err != report_err) return 1;
+
+  // half a period early, a report later would overshoot by a whole period
+  if (TimerGetElapsedTime(report_time) + report_period / 2 >= REPORT_MAX_SILENCE) return 1;
+
+  if (err) return 0;
+
+  // the batch carries every reading, a move alone does not hurry it
+  if (batch_on) return 0;
+
+  delta = (pm2_5 > report_pm2_5) ? (pm2_5 - report_pm2_5) : (report_pm2_5 - pm2_5);
+  tol   = report_pm2_5 * REPORT_DELTA_PCT / 100;
+  if (tol < REPORT_DELTA) tol = REPORT_DELTA;
+
+  return delta >= tol;
+}
+
+void report_sent(uint8_t err, uint16_t pm2_5)
+{
+  /*
+      The next readings are compared with this one
+  */
+  report_valid  = 1;
+  report_forced = 0;
+  report_err    = err;
+  report_pm2_5 = pm2_5;
+  report_time  = TimerGetCurrentTime();
+}
+
+void report_log_push(const log_record_t *rec)
+{
+  if (report_log_count < STATS_RING_SIZE) {
+    report_logs[report_log_count++] = *rec;
+  }
+}
+
+void report_log_reset(void)
+{
+  /*
+      The readings were left out of the report, they wait for backfill
+  */
+  report_log_count = 0;
+}
+
+void report_log_mark(void)
+{
+  /*
+      The report stands for its readings, they are not backfilled
+  */
+  log_mark_sent(report_logs, report_log_count);
+  report_log_count = 0;
+}
+
+void report_batch_enable(uint8_t on)
+{
+  /*
+      Buffer the next readings, those already buffered go out either way
+  */
+  batch_on = on;
+}
+
+uint8_t report_batch_on(void)
+{
+  return batch_on;
+}
+
+uint8_t report_batch_count(void)
+{
+  return batch_count;
+}
+
+void report_batch_push(uint16_t pm2_5, const log_record_t *rec)
+{
+  uint8_t k = 0;
+
+  // a batch that could not go out loses its oldest reading
+  if (batch_count == BATCH_MAX) {
+    batch_head = (batch_head + 1) % BATCH_MAX;
+    batch_count--;
+  }
+
+  k = (batch_head + batch_count) % BATCH_MAX;
+  batch_pm2_5[k] = pm2_5;
+  batch_time[k]  = TimerGetCurrentTime();
+  batch_log[k]   = *rec;
+  batch_count++;
+}
+
+uint8_t report_batch_due(uint8_t max)
+{
+  /*
+      Send once the next reading might not fit a frame of max bytes, the
+      data rate sets the frame size so ADR changes the batch length
+  */
+  if (batch_count == 0) return 0;
+  if (batch_count == BATCH_MAX) return 1;
+
+  return batch_size(0) + BATCH_ENTRY_MAX > max;
+}
+
+uint8_t report_batch_encode(uint8_t *buff, uint8_t max, uint8_t tag, uint8_t *dropped)
+{
+  /*
+      tag, count, age of the first reading in s and its PM2.5, then a
+      time and PM2.5 step per further reading, 2 bytes each unless escaped
+      params
+          dropped: set to the oldest readings given up to fit max
+      return
+          bytes written, 0 if max is short of BATCH_HEAD_SIZE and the batch
+          is kept
+  */
+  uint8_t  first = 0;
+  uint8_t  n = 0;
+  uint8_t  k = 0;
+  uint32_t age = 0;
+  uint16_t pm = 0;
+
+  *dropped = 0;
+  if (max < BATCH_HEAD_SIZE) return 0;
+
+  // the oldest readings give way when the data rate cannot carry them all
+  while (first + 1 < batch_count && batch_size(first) > max) {
+    first++;
+  }
+  batch_head = (batch_head + first) % BATCH_MAX;
+  batch_count -= first;
+  *dropped = first;
+
+  age = TimerGetElapsedTime(batch_time[batch_head]) / 1000;
+  pm  = batch_pm2_5[batch_head];
+
+  buff[n++] = tag;
+  buff[n++] = batch_count;
+  buff[n++] = (age > 0xFFFF) ? 0xFF : (age >> 8) & 0xFF;
+  buff[n++] = (age > 0xFFFF) ? 0xFF : age & 0xFF;
+  buff[n++] = (pm >> 8) & 0xFF;
+  buff[n++] = pm & 0xFF;
+
+  for (k = 1; k < batch_count; ++k) {
+    n += batch_entry(0, k, &buff[n]);
+  }
+
+  return n;
+}
+
+void report_batch_sent(uint8_t carried)
+{
+  /*
+      Empty the batch once its frame is accepted
+      params
+          carried: the frame held every reading, they are not backfilled
+  */
+  uint8_t k = 0;
+
+  if (carried) {
+    // the ring wraps, so one record at a time
+    for (k = 0; k < batch_count; ++k) {
+      log_mark_sent(&batch_log[(batch_head + k) % BATCH_MAX], 1);
+    }
+  }
+  batch_count = 0;
+}
+
+uint8_t report_fit(payload_t *reading, uint8_t offer, uint8_t max, uint8_t stats_size)
+{
+  /*
+      Choose the optional fields of a reading frame by priority, the order
+      of the FIT_ bits, with those that missed the last frame first. The
+      header and status always go.
+      params
+          stats_size: bytes FIT_STATS adds after the frame
+      return
+          FIT_ bits chosen and set in reading->fields, the rest of offer
+          is deferred to the next frame
+  */
+  uint8_t fit = 0;
+  uint8_t size = 0;
+  uint8_t pass = 0;
+  uint8_t k = 0;
+
+  for (pass = 0; pass < 2; ++pass) {
+    for (k = 0; k < FIT_COUNT; ++k) {
+      uint8_t f = 1 << k;
+
+      if (!(offer & f) || (fit & f)) continue;
+      if (pass == 0 && !(fit_deferred & f)) continue;
+
+      reading->fields = fit_payload_fields(fit | f);
+      size = payload_size(reading) + (((fit | f) & FIT_STATS) ? stats_size : 0);
+      if (size <= max) {
+        fit |= f;
+      }
+    }
+  }
+
+  reading->fields = fit_payload_fields(fit);
+  fit_deferred = offer & ~fit;
+
+  return fit;
+}
+
+uint8_t report_step_encode(uint8_t *buff, uint32_t dt, uint16_t pm2_5, uint16_t prev)
+{
+  /*
+      A reading after the previous one, as a time step and a signed PM2.5
+      step, either one escaped when it does not fit a byte. A sample
+      period of up to an hour takes one byte.
+      params
+          buff: can be NULL to get the size only
+          dt: time step in BATCH_STEP_UNIT
+      return
+          bytes of the step, at most BATCH_ENTRY_MAX
+  */
+  int32_t dv = (int32_t) pm2_5 - prev;
+  uint8_t tmp[BATCH_ENTRY_MAX];
+  uint8_t n = 0;
+
+  if (dt < BATCH_ESC_DT) {
+    tmp[n++] = dt;
+  } else {
+    // 8 years, longer than a log timestamp lasts
+    if (dt > 0xFFFFFF) dt = 0xFFFFFF;
+    tmp[n++] = BATCH_ESC_DT;
+    tmp[n++] = (dt >> 16) & 0xFF;
+    tmp[n++] = (dt >> 8) & 0xFF;
+    tmp[n++] = dt & 0xFF;
+  }
+
+  if (dv > -128 && dv < 128) {
+    tmp[n++] = (uint8_t) dv;
+  } else {
+    tmp[n++] = BATCH_ESC_DV;
+    tmp[n++] = (pm2_5 >> 8) & 0xFF;
+    tmp[n++] = pm2_5 & 0xFF;
+  }
+
+  if (buff != NULL) {
+    memcpy(buff, tmp, n);
+  }
+
+  return n;
+}
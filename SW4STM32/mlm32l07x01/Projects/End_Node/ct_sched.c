@@ -0,0 +1,82 @@
+#include "hw.h"
+#include "low_power_manager.h"
+#include "ct_sched.h"
+
+/* one byte per event, a byte store is atomic so ISRs post without locking */
+static volatile uint8_t sched_flags[SCHED_EV_COUNT];
+static sched_handler_t  sched_handlers[SCHED_EV_COUNT];
+
+void sched_init(void)
+{
+  uint8_t i = 0;
+
+  for (i = 0; i < SCHED_EV_COUNT; ++i) {
+    sched_flags[i]    = 0;
+    sched_handlers[i] = NULL;
+  }
+}
+
+void sched_register(sched_event_t ev, sched_handler_t handler)
+{
+  if (ev < SCHED_EV_COUNT) {
+    sched_handlers[ev] = handler;
+  }
+}
+
+void sched_post(sched_event_t ev)
+{
+  /*
+      Mark ev pending, safe from any interrupt. Posting an event that is
+      already pending runs its handler once.
+  */
+  if (ev < SCHED_EV_COUNT) {
+    sched_flags[ev] = 1;
+  }
+}
+
+uint8_t sched_pending(void)
+{
+  /*
+      return 1 if any event is waiting for its handler
+  */
+  uint8_t i = 0;
+
+  for (i = 0; i < SCHED_EV_COUNT; ++i) {
+    if (sched_flags[i]) return 1;
+  }
+
+  return 0;
+}
+
+void sched_run(void)
+{
+  /*
+      Serve pending events, then sleep. Call it from the main loop forever.
+      The scan restarts from the top after each handler, so an event posted
+      meanwhile is served before any lower priority one already waiting.
+  */
+  uint8_t i = 0;
+
+  while (i < SCHED_EV_COUNT) {
+    if (!sched_flags[i]) {
+      i++;
+      continue;
+    }
+
+    // clear first, a post from inside the handler runs it again
+    sched_flags[i] = 0;
+    if (sched_handlers[i] != NULL) {
+      sched_handlers[i]();
+    }
+    i = 0;
+  }
+
+  // an interrupt after DISABLE_IRQ() stays pending and wakes the core at once
+  DISABLE_IRQ();
+
+  if (!sched_pending()) {
+    LPM_EnterLowPower();
+  }
+
+  ENABLE_IRQ();
+}
@@ -0,0 +1,80 @@
+#include <string.h>
+#include "ct_stats.h"
+
+void stats_reset(stats_ring_t *ring)
+{
+  ring->head  = 0;
+  ring->count = 0;
+}
+
+void stats_push(stats_ring_t *ring, uint16_t value)
+{
+  /*
+      Add a sample, the oldest one is overwritten when the ring is full
+  */
+  ring->buff[ring->head] = value;
+  ring->head = (ring->head + 1) % STATS_RING_SIZE;
+
+  if (ring->count < STATS_RING_SIZE) {
+    ring->count++;
+  }
+}
+
+void stats_merge(stats_ring_t *dst, const stats_ring_t *src)
+{
+  /*
+      Push every sample of src into dst, order is not kept
+  */
+  uint8_t i = 0;
+
+  for (i = 0; i < src->count; ++i) {
+    stats_push(dst, src->buff[i]);
+  }
+}
+
+uint8_t stats_summarise(const stats_ring_t *ring, stats_summary_t *summary)
+{
+  /*
+      Compute median, mean, min and max of the samples in the ring
+      params
+          ring: samples
+          summary: result, all zero if the ring is empty
+      return
+          number of samples summarised
+  */
+  uint16_t sorted[STATS_RING_SIZE];
+  uint32_t sum = 0;
+  uint32_t avg = 0;
+  uint16_t v   = 0;
+  uint8_t  n   = ring->count;
+  uint8_t  i   = 0;
+  uint8_t  j   = 0;
+
+  memset(summary, 0x00, sizeof(stats_summary_t));
+  if (n == 0) return 0;
+
+  // insertion sort on a stack copy, n is small
+  for (i = 0; i < n; ++i) {
+    v = ring->buff[i];
+    sum += v;
+
+    for (j = i; j > 0 && sorted[j - 1] > v; --j) {
+      sorted[j] = sorted[j - 1];
+    }
+    sorted[j] = v;
+  }
+
+  summary->count    = n;
+  summary->min      = sorted[0];
+  summary->max      = sorted[n - 1];
+  avg = (sum * 10 + n / 2) / n;
+  summary->mean_x10 = (avg > 0xFFFF) ? 0xFFFF : (uint16_t) avg;
+
+  if (n & 1) {
+    summary->median = sorted[n / 2];
+  } else {
+    summary->median = (uint16_t) (((uint32_t) sorted[n / 2 - 1] + sorted[n / 2]) / 2);
+  }
+
+  return n;
+}
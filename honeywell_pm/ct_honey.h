@@ -1,4 +1,32 @@
 #include "hw_conf.h"
+#include "timeServer.h"
+
+/* Honey Defines */
+#define HONEY_CMD_TIMEOUT   100     // ms, time allowed for a command response
+#define HONEY_RETRY_MAX     3       // attempts per command, the first one included
+#define HONEY_RETRY_BUDGET  350     // ms, no attempt starts later than this after the first
+#define HONEY_RETRY_GAP     20      // ms of quiet line after a failed attempt, 8 bytes take 8.3 ms at 9600
+#define HONEY_BOOT_TIME     1000    // ms from supply on to the first command, retries cover a slow boot
+#define HONEY_RX_BUFF_SIZE  8       // longest response is the measurement frame
+#define HONEY_AUTOSEND_FRAME_SIZE 32 // 0x42 0x4D LEN(2) DATA(26) CS(2)
+#define HONEY_TX_FRAME_SIZE 5       // longest command is HEAD LEN CMD DATA CS
+#define HONEY_HEAD          0x68
+#define HONEY_MAX_INSTANCES 2       // sensors the driver can route UART callbacks to
+
+/* Command Checksum, MOD((65536-(HEAD+LEN+CMD+DATA)), 256), DATA only counts when LEN is 2 */
+#define HONEY_CS(len, cmd, data) \
+    ((uint8_t) (0x10000 - (HONEY_HEAD + (len) + (cmd) + (((len) > 1) ? (data) : 0))))
+
+/* Command List, X(name, LEN, CMD, default DATA) */
+#define HONEY_CMD_LIST(X) \
+    X(START,    0x01, 0x01, 0x00) \
+    X(STOP,     0x01, 0x02, 0x00) \
+    X(READ,     0x01, 0x04, 0x00) \
+    X(AUTOEN,   0x01, 0x40, 0x00) \
+    X(AUTOSTOP, 0x01, 0x20, 0x00) \
+    X(READCOEF, 0x01, 0x10, 0x00) \
+    X(SETCOEF,  0x02, 0x08, 0x64) /* default coef is 0x64 */
+
 
 /* Honey Command Response Enumerations */
 typedef enum {
@@ -6,26 +34,137 @@ typedef enum {
     CMD_RESP_SUCCESS,
     CMD_RESP_TIMEOUT,
     CMD_RESP_BAD,           // invalid parameters
+    CMD_RESP_NACK,          // sensor answered 0x96 0x96
+    CMD_RESP_HEADER,        // reply is not the ACK or data frame expected
+    CMD_RESP_CHECKSUM,      // data frame checksum mismatch
     CMD_RESP_ERR = 0xFF
 } honey_cmd_resp_t;
 
+/* Honey Command Enumerations, HONEY_CMD_START is 0x00 */
+#define HONEY_CMD_ENUM(name, len, cmd, data) HONEY_CMD_##name,
+typedef enum {
+    HONEY_CMD_LIST(HONEY_CMD_ENUM)
+    HONEY_CMD_COUNT
+} honey_cmd_t;
+#undef HONEY_CMD_ENUM
+
+/* Honey Transfer State Enumerations */
+typedef enum {
+    HONEY_STATE_IDLE = 0x00,
+    HONEY_STATE_TX,         // command sent, waiting for the first 2 response bytes
+    HONEY_STATE_RX_DATA,    // 0x40 header received, waiting for the rest of the frame
+    HONEY_STATE_RETRY,      // attempt failed, waiting HONEY_RETRY_GAP before the next
+    HONEY_STATE_DONE,       // response complete or timed out, result not yet handled
+    HONEY_STATE_STREAM,     // autosend frames are received by circular DMA
+    HONEY_STATE_BOOT        // supply just switched on, waiting HONEY_BOOT_TIME
+} honey_state_t;
+
+
+/* Honey Error Counters, since honey_init() */
+typedef struct {
+    uint16_t timeout;
+    uint16_t header;
+    uint16_t checksum;
+    uint16_t nack;
+    uint16_t uart;          // framing, noise or overrun errors
+    uint16_t retries;       // attempts after the first one
+    uint16_t failed;        // commands that failed on every attempt
+} honey_errors_t;
+
 
 /* Honey Structure */
+struct __honey_t;
+typedef void (*honey_cb_t)(struct __honey_t *honey, honey_cmd_resp_t resp);
+
 typedef struct __honey_t {
-	UART_HandleTypeDef  huart;
+    UART_HandleTypeDef* huart;
     uint16_t            pm2_5;
     uint16_t            pm10_0;
     uint8_t             customer_coef;
+    uint8_t             coef_staged;    // SETCOEF argument in flight, customer_coef once acked
+
+    // non-blocking transfer
+    volatile honey_state_t state;
+    honey_cmd_t         cmd;
+    honey_cmd_resp_t    resp;
+    honey_cb_t          cb;         // completion callback, called from honey_process()
+    void                (*notify)(void); // called from ISR when a result is pending
+    TimerEvent_t        timeout_timer;
+    uint8_t             tx_buff[HONEY_TX_FRAME_SIZE]; // parameterised frame in flight
+    const uint8_t*      tx;         // frame in flight, kept for retries
+    uint8_t             tx_len;
+    uint8_t             rx_buff[HONEY_RX_BUFF_SIZE];
+    uint8_t             stop_wake;  // UART wakes the core from STOP, see honey_set_stop_wake()
+
+    // retry policy
+    uint8_t             attempts;       // attempts made for the command in flight
+    uint8_t             retry_max;
+    uint16_t            retry_budget;   // ms
+    TimerTime_t         first_attempt;
+    honey_errors_t      errors;
+
+    // autosend stream
+    uint8_t*            stream_buff;    // circular DMA buffer, owned by the caller
+    uint16_t            stream_size;
+    uint16_t            stream_rd;      // parser read index in stream_buff
+    uint16_t            stream_frames;  // valid frames since honey_stream_start()
+    uint16_t            stream_errors;  // frames dropped on bad length or checksum
+    void                (*frame_cb)(struct __honey_t *honey); // called per valid frame
+
+    // supply load switch, kept by honey_init()
+    GPIO_TypeDef*       pwr_port;       // NULL if the sensor is always powered
+    uint16_t            pwr_pin;
+    uint8_t             powered;
+    uint8_t             setup_step;     // startup routine command in flight
+    honey_cb_t          setup_cb;       // called when the startup routine is over
+    TimerTime_t         power_on;       // supply switched on
+    uint16_t            boot_ms;        // supply on to first reply, 0 until it came
+    uint8_t             fan;            // fan running, see honey_fan_callback()
 } honey_t;
 
 
 /* Prototypes */
-honey_cmd_resp_t honey_init(UART_HandleTypeDef huart, honey_t* honey);
+honey_cmd_resp_t honey_init(UART_HandleTypeDef* huart, honey_t* honey);
 honey_cmd_resp_t honey_start(honey_t* honey);
 honey_cmd_resp_t honey_stop(honey_t* honey);
 honey_cmd_resp_t honey_read(honey_t *honey);
 honey_cmd_resp_t honey_autosend(honey_t *honey, uint8_t mode);
 honey_cmd_resp_t honey_set_coef(honey_t *honey, uint8_t coef);
 honey_cmd_resp_t honey_read_coef(honey_t* honey);
-uint8_t calc_cs(uint8_t* CMD, uint8_t cmd_len);
+uint8_t calc_cs(const uint8_t* CMD, uint8_t cmd_len);
+uint8_t honey_build_frame(honey_cmd_t cmd, uint8_t arg, uint8_t* frame);
+
+/* Non-blocking Prototypes */
+void             honey_set_notify(honey_t *honey, void (*notify)(void));
+void             honey_set_retry(honey_t *honey, uint8_t max_attempts, uint16_t budget_ms);
+honey_cmd_resp_t honey_set_stop_wake(honey_t *honey, uint8_t enable);
+honey_cmd_resp_t honey_cmd_async(honey_t *honey, honey_cmd_t cmd, uint8_t arg, honey_cb_t cb);
+honey_cmd_resp_t honey_start_async(honey_t *honey, honey_cb_t cb);
+honey_cmd_resp_t honey_stop_async(honey_t *honey, honey_cb_t cb);
+honey_cmd_resp_t honey_read_async(honey_t *honey, honey_cb_t cb);
+uint8_t          honey_busy(honey_t *honey);
+honey_t*         honey_from_uart(UART_HandleTypeDef *huart);
+void             honey_abort(honey_t *honey);
+void             honey_process(honey_t *honey);
+
+/* Power Gating Prototypes */
+void             honey_set_power(honey_t *honey, GPIO_TypeDef *port, uint16_t pin);
+honey_cmd_resp_t honey_power_on(honey_t *honey, honey_cb_t cb);
+honey_cmd_resp_t honey_power_off(honey_t *honey);
+
+/* Autosend Stream Prototypes */
+honey_cmd_resp_t honey_stream_start(honey_t *honey, uint8_t *buff, uint16_t size);
+honey_cmd_resp_t honey_stream_stop(honey_t *honey, honey_cb_t cb);
+uint16_t         honey_stream_parse(honey_t *honey);
+void             honey_set_frame_cb(honey_t *honey, void (*frame_cb)(honey_t *honey));
+
+/* Application Hooks */
+void honey_fan_callback(honey_t *honey, uint8_t on);
 
+/* Interrupt Hooks */
+void honey_irq_handler(honey_t *honey);
+void honey_dma_irq_handler(honey_t *honey);
+void honey_rx_cplt_callback(honey_t *honey);
+void honey_tx_cplt_callback(honey_t *honey);
+void honey_rx_half_cplt_callback(honey_t *honey);
+void honey_error_callback(honey_t *honey);
@@ -0,0 +1,199 @@
+/*
+ * cmd_fuzz.c
+ *
+ *  Checks of the ct_cmd.c setting mode parser, the same source the node
+ *  runs. Known lines, over-long tokens and arguments that are not numbers
+ *  first, then random lines into buffers of exactly the sizes given, so a
+ *  write past them stops the run (build with ASan, see the Makefile).
+ *
+ *  Usage:
+ *  > ./cmd_fuzz -n 1000000 -s 1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ct_cmd.h"
+
+#define LINE_MAX_LEN    80      // CLI_LINE_SIZE, NUL included
+
+typedef struct {
+    const char *line;
+    uint8_t     ok;         // cmd_extract() result
+    const char *type;
+    const char *arg;
+} extract_case_t;
+
+typedef struct {
+    const char *src;
+    uint8_t     ok;         // cmd_number() result
+    int32_t     value;
+} number_case_t;
+
+static uint32_t rng_state = 1;
+
+
+/* Private Prototypes --------------------------------------------------------*/
+static uint32_t rng(void);
+static uint32_t check_extract(void);
+static uint32_t check_number(void);
+static uint32_t fuzz_lines(uint32_t n);
+
+
+int main(int argc, char *argv[]) {
+    uint32_t n = 100000;
+    uint32_t failed = 0;
+    int      opt = 0;
+
+    while ((opt = getopt(argc, argv, "n:s:h")) != -1) {
+        switch (opt) {
+            case 'n': n = atoi(optarg); break;
+            case 's': rng_state = atoi(optarg) | 1; break;
+            default:
+                printf("usage: %s [-n iterations] [-s seed]\n", argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    failed += check_extract();
+    failed += check_number();
+    failed += fuzz_lines(n);
+
+    return failed ? 1 : 0;
+}
+
+
+/* Private Functions ---------------------------------------------------------*/
+static uint32_t rng(void) {
+    // xorshift32, reproducible from the seed
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static uint32_t check_extract(void) {
+    static const extract_case_t cases[] = {
+        { "readcoef",                   1, "readcoef",  ""            },
+        { "setcoef 100",                1, "setcoef",   "100"         },
+        { "setlon -18000000",           1, "setlon",    "-18000000"   },
+        { "setlon -180000000",          1, "setlon",    "-180000000"  },
+        { "setlon 12345678901",         1, "setlon",    "12345678901" },  // CMD_ARG_SIZE - 1 characters
+        { "setlon 123456789012",        0, NULL,        NULL          },
+        { "setlat 1 2 3",               1, "setlat",    "1"           },
+        { "setcoef ",                   1, "setcoef",   ""            },
+        { "setcoefxx",                  1, "setcoefxx", ""            },  // CMD_TYPE_SIZE - 1 characters
+        { "setcoefxxx 1",               0, NULL,        NULL          },
+        { "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 0, NULL, NULL },
+        { "setlat 9999999999999999999999999999999999999999999999999999999999999999999999", 0, NULL, NULL },
+    };
+    uint32_t failed = 0;
+    uint32_t k = 0;
+
+    for (k = 0; k < sizeof(cases) / sizeof(cases[0]); ++k) {
+        // heap buffers of the sizes passed, ASan sees one byte too many
+        uint8_t *type = malloc(CMD_TYPE_SIZE);
+        uint8_t *arg  = malloc(CMD_ARG_SIZE);
+        uint8_t  ok   = cmd_extract((const uint8_t*) cases[k].line, type, CMD_TYPE_SIZE, arg, CMD_ARG_SIZE);
+
+        if (ok != cases[k].ok ||
+            (ok && (strcmp((char*) type, cases[k].type) != 0 || strcmp((char*) arg, cases[k].arg) != 0))) {
+            printf("extract \"%s\": %u \"%s\" \"%s\", want %u \"%s\" \"%s\"\n", cases[k].line, ok,
+                   type, arg, cases[k].ok, cases[k].ok ? cases[k].type : "", cases[k].ok ? cases[k].arg : "");
+            failed++;
+        }
+        free(type);
+        free(arg);
+    }
+
+    printf("extract x%u: %u failed\n", k, failed);
+    return failed;
+}
+
+static uint32_t check_number(void) {
+    static const number_case_t cases[] = {
+        { "0",          1, 0          },
+        { "100",        1, 100        },
+        { "-9000000",   1, -9000000   },
+        { "999999999",  1, 999999999  },
+        { "-999999999", 1, -999999999 },
+        { "1000000000", 0, 0          },  // more than CMD_NUMBER_DIGITS
+        { "",           0, 0          },
+        { "-",          0, 0          },
+        { "+5",         0, 0          },
+        { "12a",        0, 0          },
+        { "1-2",        0, 0          },
+        { "--1",        0, 0          },
+        { "0x10",       0, 0          },
+        { " 1",         0, 0          },
+        { "1.5",        0, 0          },
+    };
+    uint32_t failed = 0;
+    uint32_t k = 0;
+
+    for (k = 0; k < sizeof(cases) / sizeof(cases[0]); ++k) {
+        int32_t value = 0x5A5A5A5A;
+        uint8_t ok = cmd_number((const uint8_t*) cases[k].src, &value);
+
+        // a refused number leaves value alone
+        if (ok != cases[k].ok || value != (ok ? cases[k].value : 0x5A5A5A5A)) {
+            printf("number \"%s\": %u %ld, want %u %ld\n", cases[k].src, ok, (long) value,
+                   cases[k].ok, (long) cases[k].value);
+            failed++;
+        }
+    }
+
+    printf("number x%u: %u failed\n", k, failed);
+    return failed;
+}
+
+static uint32_t fuzz_lines(uint32_t n) {
+    // spaces, digits and a sign are most of what goes wrong
+    static const char alphabet[] = "   --0123456789setcoflnamx.+\x7f\xff";
+    char     line[LINE_MAX_LEN];
+    uint32_t failed = 0;
+    uint32_t ok_count = 0;
+    uint32_t i = 0;
+
+    for (i = 0; i < n; ++i) {
+        uint8_t  type_size = 1 + rng() % 16;
+        uint8_t  arg_size  = 1 + rng() % 16;
+        uint8_t *type = malloc(type_size);
+        uint8_t *arg  = malloc(arg_size);
+        uint8_t  len  = rng() % LINE_MAX_LEN;
+        uint8_t  k    = 0;
+        uint8_t  ok   = 0;
+        int32_t  value = 0;
+
+        for (k = 0; k < len; ++k) {
+            line[k] = alphabet[rng() % (sizeof(alphabet) - 1)];
+        }
+        line[len] = '\0';
+
+        ok = cmd_extract((const uint8_t*) line, type, type_size, arg, arg_size);
+        if (ok) {
+            // the tokens are the line's up to the first and second space
+            const char *sp  = strchr(line, ' ');
+            size_t      tl  = sp ? (size_t) (sp - line) : strlen(line);
+            size_t      al  = sp ? strcspn(sp + 1, " ") : 0;
+
+            if (strlen((char*) type) != tl || memcmp(type, line, tl) != 0 ||
+                strlen((char*) arg) != al || (al && memcmp(arg, sp + 1, al) != 0)) {
+                printf("line %u \"%s\" sizes %u %u: \"%s\" \"%s\"\n", i, line, type_size, arg_size, type, arg);
+                failed++;
+            }
+            // and an argument that parses is a number in range
+            if (cmd_number(arg, &value) && (value > 999999999 || value < -999999999)) {
+                printf("line %u \"%s\": number %ld\n", i, line, (long) value);
+                failed++;
+            }
+            ok_count++;
+        }
+        free(type);
+        free(arg);
+    }
+
+    printf("random lines x%u: %u failed, ok %u\n", n, failed, ok_count);
+    return failed;
+}
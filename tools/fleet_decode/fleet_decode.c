@@ -0,0 +1,1484 @@
+/*
+ * fleet_decode.c
+ *
+ *  Fleet uplink ingest: decodes the node's uplinks from network server
+ *  NDJSON or raw hex lines, in parallel chunks across cores, to CSV or a
+ *  columnar binary, at the rate a fleet-wide reconnect delivers them. The
+ *  layouts are in uplink.h.
+ *
+ *  Input, an uplink a line, the two kinds may mix:
+ *    {"end_device_ids":{"dev_eui":..},"received_at":..,"uplink_message":{"f_port":2,"frm_payload":"<base64>",..}}
+ *        The Things Stack, ChirpStack ("devEui", "time", "fPort", "data")
+ *        reads too. Only those keys are looked at, in any order and depth.
+ *    [device] port hex
+ *  Lines without a port or a payload (joins, MAC-only uplinks, comments)
+ *  are skipped.
+ *
+ *  Output, -t readings: a row per reading, batches and backlogs expanded
+ *  with each reading's age at the uplink. -t frames: a row per uplink with
+ *  its result, error counters, burst stats, charge per energy phase and
+ *  LPP sensors. Either one as
+ *    -f csv  a header line, absent values empty
+ *    -f bin  "CTCB", u32 version, u32 columns, then per column a u8 type
+ *            (col_type_t) and a u8 name length and the name. Row groups
+ *            follow to the end of the file, one per input chunk: u32 rows,
+ *            then each column's values, little endian, strings as rows + 1
+ *            u32 offsets and then the bytes. Absent values keep the
+ *            uplink.h sentinels.
+ *
+ *  Usage:
+ *  > ./fleet_decode -j 8 uplinks.ndjson > readings.csv
+ *  > ./fleet_decode -g 100000 | ./fleet_decode -t frames -f bin -o frames.ctcb
+ *  > ./fleet_decode -B 1000000 -j 8
+ *  > ./fleet_decode -z 100000 -s 1
+ */
+
+#define _GNU_SOURCE             // memrchr
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ct_energy.h"
+#include "ct_lpp.h"
+#include "ct_payload.h"
+#include "uplink.h"
+
+#define WINDOW_SIZE     (64 << 20)  // input bytes read and decoded at once
+#define CHUNK_SIZE      (1 << 20)   // input bytes a thread takes at a time, a row group
+#define THREADS_MAX     64
+#define BASE64_MAX      ((UPLINK_SIZE_MAX + 2) / 3 * 4)
+#define ENERGY_NONE     0xFFFFFFFF  // phase not in the energy frame
+#define CTCB_VERSION    1
+
+/* Line results after the uplink_result_t ones */
+#define RESULT_INPUT    UPLINK_RESULT_COUNT         // not JSON or hex this tool reads
+#define RESULT_SKIPPED  (UPLINK_RESULT_COUNT + 1)   // no uplink on the line
+#define RESULT_COUNT    (UPLINK_RESULT_COUNT + 2)
+
+typedef enum {
+    COL_U8 = 1,
+    COL_U16,
+    COL_U32,
+    COL_U64,
+    COL_I16,
+    COL_I32,
+    COL_STR
+} col_type_t;
+
+typedef struct {
+    const char *p;
+    uint32_t    len;
+} span_t;
+
+typedef struct {
+    uint64_t      line;       // from 1, in the whole input
+    span_t        dev;
+    span_t        time;
+    uint8_t       port;
+    uint8_t       result;     // uplink_result_t or RESULT_INPUT
+    uint16_t      rows;
+    uplink_meta_t meta;
+    uint32_t      energy[ENERGY_PHASE_COUNT]; // meta.energy by phase, ENERGY_NONE if absent
+    uplink_row_t  row;
+} record_t;
+
+typedef struct {
+    const char  *name;
+    uint8_t      type;        // col_type_t
+    uint16_t     offset;      // in record_t
+    uint8_t      none;        // sentinel holds the absent value
+    int64_t      sentinel;
+    const char* (*label)(uint8_t value);  // CSV prints this for a COL_U8
+} column_t;
+
+typedef struct {
+    const char     *name;
+    const column_t *col;
+    uint8_t         count;
+} table_t;
+
+typedef struct {
+    char   *p;
+    size_t  len;
+    size_t  cap;
+} buf_t;
+
+typedef struct {
+    const char *p;            // lines, the last one may lack its newline
+    size_t      len;
+    uint64_t    first_line;
+    uint64_t    lines;
+    buf_t       out;          // CSV lines or a row group
+    uint64_t    counts[RESULT_COUNT];
+    uint64_t    rows;
+    uint64_t    unknown;      // frames with bytes left over
+} chunk_t;
+
+typedef struct {
+    chunk_t *chunk;
+    size_t   count;
+    size_t   next;            // next chunk to take, atomic
+    uint8_t  phase;           // 0 count lines, 1 decode
+} job_t;
+
+typedef struct {
+    span_t  dev;
+    span_t  time;
+    span_t  data;
+    int     port;
+    uint8_t base64;           // data is base64, else hex
+} line_t;
+
+typedef struct {
+    uint8_t        bin;
+    uint8_t        threads;
+    const table_t *table;
+} config_t;
+
+typedef struct {
+    uint64_t lines;
+    uint64_t counts[RESULT_COUNT];
+    uint64_t rows;
+    uint64_t unknown;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+} totals_t;
+
+
+/* Private Prototypes --------------------------------------------------------*/
+static const char* result_name(uint8_t res);
+static uint8_t     parse_line(const char *s, const char *e, line_t *l);
+static uint8_t     parse_json(const char *s, const char *e, line_t *l);
+static const char* json_string_end(const char *p, const char *e);
+static uint8_t     parse_raw(const char *s, const char *e, line_t *l);
+static void        base64_init(void);
+static int         base64_decode(span_t in, uint8_t *out, uint16_t max);
+static int         hex_decode(span_t in, uint8_t *out, uint16_t max);
+static void        buf_need(buf_t *b, size_t n);
+static int64_t     col_value(const column_t *c, const record_t *r);
+static uint8_t     col_width(uint8_t type);
+static void        csv_header(buf_t *b);
+static void        csv_records(buf_t *b, const record_t *rec, size_t n);
+static void        bin_header(buf_t *b);
+static void        bin_records(buf_t *b, const record_t *rec, size_t n);
+static void        count_lines(chunk_t *c);
+static void        decode_chunk(chunk_t *c, record_t **rec, size_t *cap, uplink_frame_t *f);
+static void*       worker(void *arg);
+static void        run_job(job_t *job);
+static void        process_window(const char *p, size_t len, FILE *out);
+static int         process_stream(FILE *in, FILE *out);
+static void        print_totals(FILE *to, double seconds);
+static uint32_t    rng(void);
+static void        gen_reset(uplink_frame_t *want, uint8_t port);
+static uplink_row_t* gen_row(uplink_frame_t *want, uint8_t kind, uint8_t tier);
+static uint16_t    gen_pm(void);
+static uint16_t    gen_batch(uint8_t *b, uint16_t room, uint8_t log, uint8_t tier, uplink_frame_t *want);
+static uint16_t    gen_reading(uint8_t *b, uint16_t room, uint8_t kind, uplink_frame_t *want);
+static uint16_t    gen_lpp(uint8_t *b, uint16_t room, uplink_frame_t *want);
+static uint16_t    gen_frame(uint8_t *port, uint8_t *buff, uplink_frame_t *want);
+static size_t      gen_line(char *dst, uint32_t i, uint8_t port, const uint8_t *buff, uint16_t size);
+static uint32_t    fuzz(uint32_t n);
+static void        bench(uint32_t n);
+static uint64_t    now_ns(void);
+
+
+/* Tables --------------------------------------------------------------------*/
+#define COL(n, t, f)            { n, t, offsetof(record_t, f), 0, 0, NULL }
+#define COL_NONE(n, t, f, s)    { n, t, offsetof(record_t, f), 1, s, NULL }
+#define COL_LABEL(n, f, l)      { n, COL_U8, offsetof(record_t, f), 0, 0, l }
+
+static const column_t reading_columns[] = {
+    COL("line", COL_U64, line),
+    COL("dev", COL_STR, dev),
+    COL("time", COL_STR, time),
+    COL("port", COL_U8, port),
+    COL_LABEL("kind", row.kind, uplink_kind_name),
+    COL("tier", COL_U8, row.tier),
+    COL("status", COL_U8, row.status),
+    COL("age_s", COL_U32, row.age_s),
+    COL_NONE("pm2_5", COL_U16, row.pm2_5, UPLINK_NO_PM),
+    COL_NONE("pm10_0", COL_U16, row.pm10_0, UPLINK_NO_PM),
+    COL("battery", COL_U8, row.battery),
+    COL_NONE("latitude", COL_I32, row.latitude, UPLINK_NO_LOC),
+    COL_NONE("longitude", COL_I32, row.longitude, UPLINK_NO_LOC)
+};
+
+// energy phases in ct_energy.h order
+_Static_assert(ENERGY_PHASE_COUNT == 7, "energy columns follow energy_phase_t");
+
+static const column_t frame_columns[] = {
+    COL("line", COL_U64, line),
+    COL("dev", COL_STR, dev),
+    COL("time", COL_STR, time),
+    COL("port", COL_U8, port),
+    COL_LABEL("result", result, result_name),
+    COL("tag", COL_U8, meta.tag),
+    COL("version", COL_U8, meta.version),
+    COL("tier", COL_U8, meta.tier),
+    COL("parts", COL_U8, meta.parts),
+    COL("rows", COL_U16, rows),
+    COL("diag_timeout", COL_U8, meta.diag[0]),
+    COL("diag_header", COL_U8, meta.diag[1]),
+    COL("diag_checksum", COL_U8, meta.diag[2]),
+    COL("diag_nack", COL_U8, meta.diag[3]),
+    COL("diag_failed", COL_U8, meta.diag[4]),
+    COL("stats_mean_x10", COL_U16, meta.stats_mean_x10),
+    COL("stats_min", COL_U16, meta.stats_min),
+    COL("stats_max", COL_U16, meta.stats_max),
+    COL("stats_count", COL_U8, meta.stats_count),
+    COL("warmup_ds", COL_U8, meta.warmup_ds),
+    COL("sensors_ok", COL_U8, meta.sensors_ok),
+    COL("disagree", COL_U8, meta.disagree),
+    COL_NONE("energy_run", COL_U32, energy[ENERGY_RUN], ENERGY_NONE),
+    COL_NONE("energy_sleep", COL_U32, energy[ENERGY_SLEEP], ENERGY_NONE),
+    COL_NONE("energy_stop", COL_U32, energy[ENERGY_STOP], ENERGY_NONE),
+    COL_NONE("energy_fan", COL_U32, energy[ENERGY_FAN], ENERGY_NONE),
+    COL_NONE("energy_tx", COL_U32, energy[ENERGY_TX], ENERGY_NONE),
+    COL_NONE("energy_rx", COL_U32, energy[ENERGY_RX], ENERGY_NONE),
+    COL_NONE("energy_cli", COL_U32, energy[ENERGY_CLI], ENERGY_NONE),
+    COL_NONE("temperature", COL_I16, meta.temperature, INT16_MIN),
+    COL_NONE("humidity", COL_U8, meta.humidity, 0xFF),
+    COL_NONE("pressure", COL_U16, meta.pressure, 0)
+};
+
+static const table_t tables[] = {
+    { "readings", reading_columns, sizeof(reading_columns) / sizeof(column_t) },
+    { "frames", frame_columns, sizeof(frame_columns) / sizeof(column_t) }
+};
+
+static config_t cfg = { 0, 1, &tables[0] };
+static totals_t totals;
+static int8_t   base64_table[256];
+static uint32_t rng_state = 1;
+
+
+int main(int argc, char *argv[]) {
+    const char *out_name = NULL;
+    uint32_t    gen = 0;
+    uint32_t    bench_n = 0;
+    uint32_t    fuzz_n = 0;
+    uint64_t    t0 = 0;
+    long        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    FILE       *in = stdin;
+    FILE       *out = stdout;
+    int         opt = 0;
+    int         res = 0;
+
+    cfg.threads = (cpus < 1) ? 1 : (cpus > THREADS_MAX) ? THREADS_MAX : cpus;
+    base64_init();
+
+    while ((opt = getopt(argc, argv, "f:t:j:o:g:B:z:s:h")) != -1) {
+        switch (opt) {
+            case 'f': cfg.bin = (strcmp(optarg, "bin") == 0); break;
+            case 't': cfg.table = &tables[strcmp(optarg, "frames") == 0]; break;
+            case 'j': cfg.threads = atoi(optarg); break;
+            case 'o': out_name = optarg; break;
+            case 'g': gen = atoi(optarg); break;
+            case 'B': bench_n = atoi(optarg); break;
+            case 'z': fuzz_n = atoi(optarg); break;
+            case 's': rng_state = atoi(optarg) | 1; break;
+            default:
+                printf("usage: %s [-f csv|bin] [-t readings|frames] [-j threads] [-o out] [input]\n"
+                       "       %s -g frames [-s seed]              synthetic uplinks as NDJSON\n"
+                       "       %s -B frames [-j threads]           decode benchmark\n"
+                       "       %s -z frames [-s seed]              round trip and random byte fuzzing\n",
+                       argv[0], argv[0], argv[0], argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+    if (cfg.threads < 1) cfg.threads = 1;
+    if (cfg.threads > THREADS_MAX) cfg.threads = THREADS_MAX;
+
+    if (fuzz_n > 0) {
+        return fuzz(fuzz_n) ? 1 : 0;
+    }
+    if (bench_n > 0) {
+        bench(bench_n);
+        return 0;
+    }
+    if (gen > 0) {
+        uint8_t        buff[UPLINK_SIZE_MAX];
+        uplink_frame_t want;
+        char           line[2048];
+        uint8_t        port = 0;
+        uint16_t       size = 0;
+        uint32_t       i = 0;
+
+        for (i = 0; i < gen; ++i) {
+            size = gen_frame(&port, buff, &want);
+            fwrite(line, 1, gen_line(line, i, port, buff, size), stdout);
+        }
+        return 0;
+    }
+
+    if (optind < argc && strcmp(argv[optind], "-") != 0) {
+        in = fopen(argv[optind], "rb");
+        if (in == NULL) {
+            perror(argv[optind]);
+            return 1;
+        }
+    }
+    if (out_name != NULL) {
+        out = fopen(out_name, "wb");
+        if (out == NULL) {
+            perror(out_name);
+            return 1;
+        }
+    }
+
+    t0  = now_ns();
+    res = process_stream(in, out);
+    print_totals(stderr, (now_ns() - t0) / 1e9);
+
+    if (in != stdin) fclose(in);
+    if (out != stdout) fclose(out);
+    return res;
+}
+
+
+/* Private Functions ---------------------------------------------------------*/
+static const char* result_name(uint8_t res) {
+    if (res == RESULT_INPUT) return "input";
+    if (res == RESULT_SKIPPED) return "skipped";
+    return uplink_result_name(res);
+}
+
+static uint8_t parse_line(const char *s, const char *e, line_t *l) {
+    // UPLINK_OK with the line's fields, or RESULT_SKIPPED or RESULT_INPUT
+    memset(l, 0x00, sizeof(line_t));
+    l->port = -1;
+
+    while (s < e && (*s == ' ' || *s == '\t')) s++;
+    if (s == e || *s == '#') return RESULT_SKIPPED;
+
+    return (*s == '{') ? parse_json(s, e, l) : parse_raw(s, e, l);
+}
+
+static uint8_t parse_json(const char *s, const char *e, line_t *l) {
+    // one pass over the strings of the line, a string followed by a colon
+    // is a key. The first of the best named keys wins until all four are
+    // found, values are left as they are, escapes included
+    static const struct {
+        const char *name;
+        uint8_t     len;
+        uint8_t     slot;     // 0 port, 1 payload, 2 device, 3 time
+        uint8_t     rank;     // lower wins
+    } keys[] = {
+        { "f_port", 6, 0, 0 }, { "fPort", 5, 0, 0 },
+        { "frm_payload", 11, 1, 0 }, { "data", 4, 1, 1 },
+        { "dev_eui", 7, 2, 0 }, { "devEUI", 6, 2, 0 }, { "devEui", 6, 2, 0 }, { "device_id", 9, 2, 1 },
+        { "received_at", 11, 3, 0 }, { "time", 4, 3, 1 }
+    };
+    uint8_t     rank[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+    uint8_t     found = 0;
+    const char *p = s;
+    const char *k = NULL;
+    const char *v = NULL;
+    uint32_t    len = 0;
+    uint8_t     i = 0;
+
+    while (found < 4 && (p = memchr(p, '"', e - p)) != NULL) {
+        k = ++p;
+        p = json_string_end(p, e);
+        if (p == NULL) return RESULT_INPUT;
+        len = p++ - k;
+
+        while (p < e && *p == ' ') p++;
+        if (p >= e || *p != ':' || len < 4 || len > 11) continue;
+        p++;
+        while (p < e && *p == ' ') p++;
+
+        for (i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i) {
+            if (keys[i].len == len && memcmp(keys[i].name, k, len) == 0) break;
+        }
+        if (i == sizeof(keys) / sizeof(keys[0]) || keys[i].rank >= rank[keys[i].slot]) continue;
+
+        if (keys[i].slot == 0) {
+            if (p >= e || *p < '0' || *p > '9') continue;
+            l->port = 0;
+            while (p < e && *p >= '0' && *p <= '9' && l->port < 1000) l->port = l->port * 10 + (*p++ - '0');
+            found  += (rank[0] == 0xFF);
+            rank[0] = keys[i].rank;
+            continue;
+        }
+
+        // other keys take a string, the loop goes into anything else
+        if (p >= e || *p != '"') continue;
+        v = ++p;
+        p = json_string_end(p, e);
+        if (p == NULL) return RESULT_INPUT;
+
+        switch (keys[i].slot) {
+            case 1: l->data = (span_t) { v, p - v }; break;
+            case 2: l->dev  = (span_t) { v, p - v }; break;
+            case 3: l->time = (span_t) { v, p - v }; break;
+        }
+        found += (rank[keys[i].slot] == 0xFF);
+        rank[keys[i].slot] = keys[i].rank;
+        p++;
+    }
+
+    if (l->port < 0 || l->data.p == NULL) return RESULT_SKIPPED;
+    if (l->port > 255) return RESULT_INPUT;
+    l->base64 = 1;
+    return UPLINK_OK;
+}
+
+static const char* json_string_end(const char *p, const char *e) {
+    // closing quote of the string that starts at p, NULL if the line ends
+    const char *q = p;
+    const char *b = NULL;
+
+    while ((q = memchr(q, '"', e - q)) != NULL) {
+        for (b = q; b > p && b[-1] == '\\'; --b);
+        if (((q - b) & 1) == 0) return q;
+        q++;
+    }
+
+    return NULL;
+}
+
+static uint8_t parse_raw(const char *s, const char *e, line_t *l) {
+    // [device] port hex, split on blanks or commas
+    span_t   tok[3];
+    uint8_t  n = 0;
+    uint32_t i = 0;
+
+    while (s < e) {
+        const char *t = s;
+
+        while (s < e && *s != ' ' && *s != '\t' && *s != ',') s++;
+        if (s > t) {
+            if (n == 3) return RESULT_INPUT;
+            tok[n++] = (span_t) { t, s - t };
+        }
+        while (s < e && (*s == ' ' || *s == '\t' || *s == ',')) s++;
+    }
+    if (n < 2) return RESULT_INPUT;
+    if (n == 3) l->dev = tok[0];
+
+    l->port = 0;
+    for (i = 0; i < tok[n - 2].len; ++i) {
+        char c = tok[n - 2].p[i];
+        if (c < '0' || c > '9' || l->port > 255) return RESULT_INPUT;
+        l->port = l->port * 10 + (c - '0');
+    }
+    if (l->port > 255) return RESULT_INPUT;
+
+    l->data = tok[n - 1];
+    return UPLINK_OK;
+}
+
+static void base64_init(void) {
+    // the URL-safe alphabet reads too
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint8_t i = 0;
+
+    memset(base64_table, -1, sizeof(base64_table));
+    for (i = 0; i < 64; ++i) base64_table[(uint8_t) alphabet[i]] = i;
+    base64_table[(uint8_t) '-'] = 62;
+    base64_table[(uint8_t) '_'] = 63;
+}
+
+static int base64_decode(span_t in, uint8_t *out, uint16_t max) {
+    // bytes written, -1 on a bad character or too many bytes
+    uint32_t acc = 0;
+    uint32_t i = 0;
+    uint8_t  bits = 0;
+    int      n = 0;
+
+    while (in.len > 0 && in.p[in.len - 1] == '=') in.len--;
+    for (i = 0; i < in.len; ++i) {
+        int8_t v = base64_table[(uint8_t) in.p[i]];
+        if (v < 0) return -1;
+        acc   = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n >= max) return -1;
+            out[n++] = acc >> bits;
+        }
+    }
+
+    return n;
+}
+
+static int hex_decode(span_t in, uint8_t *out, uint16_t max) {
+    uint32_t i = 0;
+    int      hi = 0;
+    int      lo = 0;
+
+    if (in.len & 1 || in.len / 2 > max) return -1;
+
+    for (i = 0; i < in.len; i += 2) {
+        hi = in.p[i];
+        lo = in.p[i + 1];
+        hi = (hi >= '0' && hi <= '9') ? hi - '0' : ((hi | 0x20) >= 'a' && (hi | 0x20) <= 'f') ? (hi | 0x20) - 'a' + 10 : -1;
+        lo = (lo >= '0' && lo <= '9') ? lo - '0' : ((lo | 0x20) >= 'a' && (lo | 0x20) <= 'f') ? (lo | 0x20) - 'a' + 10 : -1;
+        if (hi < 0 || lo < 0) return -1;
+        out[i / 2] = (hi << 4) | lo;
+    }
+
+    return in.len / 2;
+}
+
+static void buf_need(buf_t *b, size_t n) {
+    if (b->len + n <= b->cap) return;
+
+    b->cap = (b->cap * 2 > b->len + n) ? b->cap * 2 : b->len + n;
+    b->p   = realloc(b->p, b->cap);
+    if (b->p == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+}
+
+static int64_t col_value(const column_t *c, const record_t *r) {
+    const uint8_t *v = (const uint8_t *) r + c->offset;
+    uint16_t u16 = 0;
+    uint32_t u32 = 0;
+    uint64_t u64 = 0;
+    int16_t  i16 = 0;
+    int32_t  i32 = 0;
+
+    switch (c->type) {
+        case COL_U8:  return *v;
+        case COL_U16: memcpy(&u16, v, 2); return u16;
+        case COL_U32: memcpy(&u32, v, 4); return u32;
+        case COL_U64: memcpy(&u64, v, 8); return u64;
+        case COL_I16: memcpy(&i16, v, 2); return i16;
+        case COL_I32: memcpy(&i32, v, 4); return i32;
+        default:      return 0;
+    }
+}
+
+static void csv_header(buf_t *b) {
+    uint8_t k = 0;
+
+    for (k = 0; k < cfg.table->count; ++k) {
+        size_t len = strlen(cfg.table->col[k].name);
+
+        buf_need(b, len + 1);
+        memcpy(&b->p[b->len], cfg.table->col[k].name, len);
+        b->len += len;
+        b->p[b->len++] = (k + 1 < cfg.table->count) ? ',' : '\n';
+    }
+}
+
+static void csv_records(buf_t *b, const record_t *rec, size_t n) {
+    // numbers by hand, printf would be most of the run time
+    const column_t *col = cfg.table->col;
+    uint8_t  cols = cfg.table->count;
+    size_t   i = 0;
+    uint8_t  k = 0;
+    char     tmp[24];
+    char    *d = NULL;
+    int64_t  v = 0;
+    uint64_t u = 0;
+    int      t = 0;
+
+    for (i = 0; i < n; ++i) {
+        const record_t *r = &rec[i];
+
+        // a string may be quoted and have every quote doubled
+        buf_need(b, cols * 22 + 2 * (r->dev.len + r->time.len) + 4);
+        d = &b->p[b->len];
+
+        for (k = 0; k < cols; ++k) {
+            if (col[k].type == COL_STR) {
+                const span_t *s = (const span_t *) ((const uint8_t *) r + col[k].offset);
+
+                if (s->len > 0 && (memchr(s->p, ',', s->len) != NULL || memchr(s->p, '"', s->len) != NULL)) {
+                    uint32_t j = 0;
+
+                    *d++ = '"';
+                    for (j = 0; j < s->len; ++j) {
+                        if (s->p[j] == '"') *d++ = '"';
+                        *d++ = s->p[j];
+                    }
+                    *d++ = '"';
+                } else {
+                    if (s->len > 0) memcpy(d, s->p, s->len);
+                    d += s->len;
+                }
+            } else {
+                v = col_value(&col[k], r);
+                if (col[k].label != NULL) {
+                    const char *name = col[k].label(v);
+                    size_t      len = strlen(name);
+
+                    memcpy(d, name, len);
+                    d += len;
+                } else if (!col[k].none || v != col[k].sentinel) {
+                    if (v < 0) *d++ = '-';
+                    u = (v < 0) ? -(uint64_t) v : (uint64_t) v;
+                    t = 0;
+                    do {
+                        tmp[t++] = '0' + u % 10;
+                        u /= 10;
+                    } while (u > 0);
+                    while (t > 0) *d++ = tmp[--t];
+                }
+            }
+            *d++ = (k + 1 < cols) ? ',' : '\n';
+        }
+
+        b->len = d - b->p;
+    }
+}
+
+static uint8_t col_width(uint8_t type) {
+    static const uint8_t widths[] = { 0, 1, 2, 4, 8, 2, 4, 0 };
+
+    return widths[type];
+}
+
+static void bin_header(buf_t *b) {
+    uint32_t version = CTCB_VERSION;
+    uint32_t cols = cfg.table->count;
+    uint8_t  k = 0;
+
+    buf_need(b, 12);
+    memcpy(&b->p[b->len], "CTCB", 4);
+    memcpy(&b->p[b->len + 4], &version, 4);
+    memcpy(&b->p[b->len + 8], &cols, 4);
+    b->len += 12;
+
+    for (k = 0; k < cols; ++k) {
+        uint8_t len = strlen(cfg.table->col[k].name);
+
+        buf_need(b, 2 + len);
+        b->p[b->len++] = cfg.table->col[k].type;
+        b->p[b->len++] = len;
+        memcpy(&b->p[b->len], cfg.table->col[k].name, len);
+        b->len += len;
+    }
+}
+
+static void bin_records(buf_t *b, const record_t *rec, size_t n) {
+    // a row group, values column by column
+    uint32_t rows = n;
+    uint32_t off = 0;
+    size_t   i = 0;
+    uint8_t  k = 0;
+    uint8_t  w = 0;
+
+    if (n == 0) return;
+
+    buf_need(b, 4);
+    memcpy(&b->p[b->len], &rows, 4);
+    b->len += 4;
+
+    for (k = 0; k < cfg.table->count; ++k) {
+        const column_t *c = &cfg.table->col[k];
+
+        if (c->type == COL_STR) {
+            buf_need(b, 4 * (n + 1));
+            off = 0;
+            for (i = 0; i < n; ++i) {
+                memcpy(&b->p[b->len], &off, 4);
+                b->len += 4;
+                off += ((const span_t *) ((const uint8_t *) &rec[i] + c->offset))->len;
+            }
+            memcpy(&b->p[b->len], &off, 4);
+            b->len += 4;
+
+            buf_need(b, off);
+            for (i = 0; i < n; ++i) {
+                const span_t *s = (const span_t *) ((const uint8_t *) &rec[i] + c->offset);
+
+                if (s->len > 0) memcpy(&b->p[b->len], s->p, s->len);
+                b->len += s->len;
+            }
+        } else {
+            w = col_width(c->type);
+            buf_need(b, (size_t) w * n);
+            for (i = 0; i < n; ++i) {
+                memcpy(&b->p[b->len], (const uint8_t *) &rec[i] + c->offset, w);
+                b->len += w;
+            }
+        }
+    }
+}
+
+static void count_lines(chunk_t *c) {
+    const char *p = c->p;
+    const char *e = c->p + c->len;
+
+    c->lines = 0;
+    while ((p = memchr(p, '\n', e - p)) != NULL) {
+        c->lines++;
+        p++;
+    }
+    if (c->len > 0 && c->p[c->len - 1] != '\n') c->lines++;
+}
+
+static void decode_chunk(chunk_t *c, record_t **rec, size_t *cap, uplink_frame_t *f) {
+    const char *p = c->p;
+    const char *e = c->p + c->len;
+    const char *nl = NULL;
+    uint8_t     buff[UPLINK_SIZE_MAX + 4];
+    uint64_t    line = c->first_line;
+    uint8_t     frames = (cfg.table == &tables[1]);
+    uint8_t     res = 0;
+    size_t      n = 0;
+    line_t      l;
+    int         size = 0;
+    uint16_t    k = 0;
+
+    memset(c->counts, 0x00, sizeof(c->counts));
+    c->rows    = 0;
+    c->unknown = 0;
+    c->out.len = 0;
+
+    for (; p < e; p = nl + 1, line++) {
+        nl = memchr(p, '\n', e - p);
+        if (nl == NULL) nl = e;
+
+        res = parse_line(p, (nl > p && nl[-1] == '\r') ? nl - 1 : nl, &l);
+        if (res == UPLINK_OK) {
+            if (l.base64 && l.data.len > BASE64_MAX + 2) {
+                size = -1;
+            } else {
+                size = l.base64 ? base64_decode(l.data, buff, sizeof(buff)) : hex_decode(l.data, buff, sizeof(buff));
+            }
+            if (size < 0) {
+                res = RESULT_INPUT;
+            } else {
+                res = uplink_decode(l.port, buff, size, f);
+            }
+        }
+        c->counts[res]++;
+        if (res == RESULT_SKIPPED) continue;
+        if (res != UPLINK_OK) f->rows = 0;
+        if (res == UPLINK_OK && (f->meta.parts & UPLINK_P_UNKNOWN)) c->unknown++;
+        c->rows += f->rows;
+
+        if (!frames && res != UPLINK_OK) continue;
+        if (n + (frames ? 1 : f->rows) > *cap) {
+            *cap = 2 * (*cap + UPLINK_ROWS_MAX);
+            *rec = realloc(*rec, *cap * sizeof(record_t));
+            if (*rec == NULL) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+        }
+
+        if (frames) {
+            record_t *r = &(*rec)[n++];
+
+            r->line   = line;
+            r->dev    = l.dev;
+            r->time   = l.time;
+            r->port   = l.port;
+            r->result = res;
+            r->rows   = f->rows;
+            if (res == UPLINK_OK) {
+                r->meta = f->meta;
+            } else {
+                memset(&r->meta, 0x00, sizeof(uplink_meta_t));
+                r->meta.temperature = INT16_MIN;
+                r->meta.humidity    = 0xFF;
+            }
+            for (k = 0; k < ENERGY_PHASE_COUNT; ++k) r->energy[k] = ENERGY_NONE;
+            for (k = 0; k < r->meta.energy_count; ++k) {
+                if (r->meta.energy_first + k < ENERGY_PHASE_COUNT) {
+                    r->energy[r->meta.energy_first + k] = r->meta.energy[k];
+                }
+            }
+        } else {
+            for (k = 0; k < f->rows; ++k) {
+                record_t *r = &(*rec)[n++];
+
+                r->line = line;
+                r->dev  = l.dev;
+                r->time = l.time;
+                r->port = l.port;
+                r->row  = f->row[k];
+            }
+        }
+    }
+
+    if (cfg.bin) {
+        bin_records(&c->out, *rec, n);
+    } else {
+        csv_records(&c->out, *rec, n);
+    }
+}
+
+static void* worker(void *arg) {
+    job_t          *job = arg;
+    uplink_frame_t *f = malloc(sizeof(uplink_frame_t));
+    record_t       *rec = NULL;
+    size_t          cap = 0;
+    size_t          i = 0;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+        if (job->phase == 0) {
+            count_lines(&job->chunk[i]);
+        } else {
+            decode_chunk(&job->chunk[i], &rec, &cap, f);
+        }
+    }
+
+    free(rec);
+    free(f);
+    return NULL;
+}
+
+static void run_job(job_t *job) {
+    // the calling thread is one of the workers
+    pthread_t thread[THREADS_MAX];
+    uint8_t   n = (job->count < cfg.threads) ? job->count : cfg.threads;
+    uint8_t   i = 0;
+
+    job->next = 0;
+    for (i = 1; i < n; ++i) {
+        pthread_create(&thread[i], NULL, worker, job);
+    }
+    worker(job);
+    for (i = 1; i < n; ++i) {
+        pthread_join(thread[i], NULL);
+    }
+}
+
+static void process_window(const char *p, size_t len, FILE *out) {
+    // whole lines, out NULL to discard what they decode to
+    static chunk_t *chunk = NULL;
+    static size_t   chunk_cap = 0;
+    job_t           job;
+    size_t          start = 0;
+    size_t          end = 0;
+    size_t          n = 0;
+    size_t          i = 0;
+    uint8_t         k = 0;
+    const char     *nl = NULL;
+
+    for (start = 0; start < len; start = end) {
+        end = (len - start > CHUNK_SIZE) ? start + CHUNK_SIZE : len;
+        if (end < len) {
+            nl  = memchr(&p[end - 1], '\n', len - end + 1);
+            end = (nl != NULL) ? (size_t) (nl - p) + 1 : len;
+        }
+
+        if (n == chunk_cap) {
+            chunk_cap = chunk_cap ? 2 * chunk_cap : 64;
+            chunk     = realloc(chunk, chunk_cap * sizeof(chunk_t));
+            memset(&chunk[n], 0x00, (chunk_cap - n) * sizeof(chunk_t));
+        }
+        chunk[n].p   = &p[start];
+        chunk[n].len = end - start;
+        n++;
+    }
+
+    job.chunk = chunk;
+    job.count = n;
+    job.phase = 0;
+    run_job(&job);
+
+    for (i = 0; i < n; ++i) {
+        chunk[i].first_line = totals.lines + 1;
+        totals.lines += chunk[i].lines;
+    }
+
+    job.phase = 1;
+    run_job(&job);
+
+    for (i = 0; i < n; ++i) {
+        if (out != NULL) fwrite(chunk[i].out.p, 1, chunk[i].out.len, out);
+        for (k = 0; k < RESULT_COUNT; ++k) totals.counts[k] += chunk[i].counts[k];
+        totals.rows      += chunk[i].rows;
+        totals.unknown   += chunk[i].unknown;
+        totals.bytes_out += chunk[i].out.len;
+    }
+    totals.bytes_in += len;
+}
+
+static int process_stream(FILE *in, FILE *out) {
+    // a window at a time, the partial line at its end starts the next
+    char  *buf = malloc(WINDOW_SIZE);
+    buf_t  head = { NULL, 0, 0 };
+    size_t keep = 0;
+    size_t got = 0;
+    size_t cut = 0;
+    char  *nl = NULL;
+
+    if (cfg.bin) {
+        bin_header(&head);
+    } else {
+        csv_header(&head);
+    }
+    fwrite(head.p, 1, head.len, out);
+    free(head.p);
+
+    do {
+        got = fread(&buf[keep], 1, WINDOW_SIZE - keep, in);
+        cut = keep + got;
+        if (keep + got == WINDOW_SIZE) {
+            // a line longer than the window is taken whole and rejected
+            nl  = memrchr(buf, '\n', cut);
+            cut = (nl != NULL) ? (size_t) (nl - buf) + 1 : cut;
+        }
+
+        process_window(buf, cut, out);
+        keep = keep + got - cut;
+        memmove(buf, &buf[cut], keep);
+    } while (got > 0);
+
+    free(buf);
+    return ferror(in) ? 1 : 0;
+}
+
+static void print_totals(FILE *to, double seconds) {
+    uint64_t frames = totals.lines - totals.counts[RESULT_SKIPPED];
+    uint8_t  k = 0;
+
+    fprintf(to, "%llu lines, %llu frames, %llu rows in %.3f s: %.2f M frames/s, %.0f MB/s in, %.0f MB/s out\n",
+            (unsigned long long) totals.lines, (unsigned long long) frames, (unsigned long long) totals.rows,
+            seconds, seconds > 0 ? frames / seconds / 1e6 : 0.0,
+            seconds > 0 ? totals.bytes_in / seconds / 1e6 : 0.0, seconds > 0 ? totals.bytes_out / seconds / 1e6 : 0.0);
+    fprintf(to, " ");
+    for (k = 0; k < RESULT_COUNT; ++k) {
+        fprintf(to, " %s %llu", result_name(k), (unsigned long long) totals.counts[k]);
+    }
+    fprintf(to, ", left over bytes %llu\n", (unsigned long long) totals.unknown);
+}
+
+
+/* Synthetic uplinks ---------------------------------------------------------*/
+static uint32_t rng(void) {
+    // xorshift32, reproducible from the seed
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static void gen_reset(uplink_frame_t *want, uint8_t port) {
+    memset(&want->meta, 0x00, sizeof(uplink_meta_t));
+    want->rows             = 0;
+    want->meta.port        = port;
+    want->meta.temperature = INT16_MIN;
+    want->meta.humidity    = 0xFF;
+}
+
+static uplink_row_t* gen_row(uplink_frame_t *want, uint8_t kind, uint8_t tier) {
+    uplink_row_t *r = &want->row[want->rows++];
+
+    r->age_s     = 0;
+    r->pm2_5     = UPLINK_NO_PM;
+    r->pm10_0    = UPLINK_NO_PM;
+    r->latitude  = UPLINK_NO_LOC;
+    r->longitude = UPLINK_NO_LOC;
+    r->kind      = kind;
+    r->tier      = tier;
+    r->status    = 0;
+    r->battery   = 0;
+    return r;
+}
+
+static uint16_t gen_pm(void) {
+    // mostly clean air and haze, sometimes anything
+    return (rng() % 16 == 0) ? rng() & 0xFFFF : rng() % 400;
+}
+
+static uint16_t gen_batch(uint8_t *b, uint16_t room, uint8_t log, uint8_t tier, uplink_frame_t *want) {
+    // main.c BatchEncode and LogEncode, readings oldest first, as many as fit
+    uint16_t head = log ? 7 : 6;
+    uint8_t  count = 1 + rng() % 24;
+    uint32_t dt[24];
+    uint16_t pm[24];
+    uint32_t age = 0;
+    uint16_t n = 0;
+    uint8_t  k = 0;
+    uint8_t  step[7];
+    uint8_t  s = 0;
+    int32_t  dv = 0;
+    uplink_row_t *r = NULL;
+
+    if (room < head) return 0;
+
+    pm[0] = gen_pm();
+    for (k = 1; k < count; ++k) {
+        // in 16 s steps, the sample periods of every tier take one byte, a
+        // gap up to what the log holds is escaped
+        dt[k] = (rng() % 8 == 0) ? 255 + rng() % 0x8000 : 1 + rng() % 254;
+        pm[k] = (rng() % 4 == 0) ? gen_pm() : (uint16_t) (pm[k - 1] + (int) (rng() % 41) - 20);
+        age  += dt[k] * 16;
+    }
+    age += rng() % 600;
+    if (!log && age > 0xFFFF) age = 0xFFFF;
+    if (log && age > 0xFFFFFF) age = 0xFFFFFF;
+
+    b[n++] = (log ? UPLINK_TAG_LOG : UPLINK_TAG_BATCH) | (tier << 5);
+    b[n++] = 0;
+    if (log) b[n++] = age >> 16;
+    b[n++] = age >> 8;
+    b[n++] = age;
+    b[n++] = pm[0] >> 8;
+    b[n++] = pm[0];
+
+    r = gen_row(want, log ? UPLINK_K_BACKLOG : UPLINK_K_BATCH, tier);
+    r->age_s = age;
+    r->pm2_5 = pm[0];
+
+    for (k = 1; k < count; ++k) {
+        s  = 0;
+        dv = (int32_t) pm[k] - pm[k - 1];
+        if (dt[k] < 0xFF) {
+            step[s++] = dt[k];
+        } else {
+            step[s++] = 0xFF;
+            step[s++] = dt[k] >> 16;
+            step[s++] = dt[k] >> 8;
+            step[s++] = dt[k];
+        }
+        if (dv > -128 && dv < 128) {
+            step[s++] = dv;
+        } else {
+            step[s++] = 0x80;
+            step[s++] = pm[k] >> 8;
+            step[s++] = pm[k];
+        }
+        if (n + s > room) break;
+        memcpy(&b[n], step, s);
+        n += s;
+
+        r = gen_row(want, r->kind, tier);
+        r->age_s = (r[-1].age_s > dt[k] * 16) ? r[-1].age_s - dt[k] * 16 : 0;
+        r->pm2_5 = pm[k];
+    }
+    b[1] = k;
+    if (log) want->meta.parts |= UPLINK_P_BACKLOG;
+
+    return n;
+}
+
+static uint16_t gen_reading(uint8_t *b, uint16_t room, uint8_t kind, uplink_frame_t *want) {
+    payload_t     p;
+    uplink_row_t *r = NULL;
+    uint16_t      n = 0;
+
+    memset(&p, 0x00, sizeof(payload_t));
+    p.status = rng() & 0x3F;
+    if (kind == UPLINK_K_INFO) {
+        p.fields    = PAYLOAD_F_LOCATION | PAYLOAD_F_BATTERY;
+        p.latitude  = (int32_t) (rng() % 18000001) - 9000000;
+        p.longitude = (int32_t) (rng() % 36000001) - 18000000;
+    } else {
+        p.fields = PAYLOAD_F_BATTERY | ((p.status & PAYLOAD_S_SENSOR_ERR) ? 0 : (rng() & 0x0C));
+    }
+    p.pm2_5   = gen_pm();
+    p.pm10_0  = p.pm2_5 + rng() % 50;
+    p.battery = rng();
+
+    // the fitter drops battery, then PM10, then PM2.5 at a slow data rate
+    n = payload_encode(&p, b, room);
+    if (n == 0) p.fields &= ~PAYLOAD_F_BATTERY;
+    if (n == 0) n = payload_encode(&p, b, room);
+    if (n == 0) p.fields &= ~PAYLOAD_F_PM10_0;
+    if (n == 0) n = payload_encode(&p, b, room);
+    if (n == 0) p.fields &= ~PAYLOAD_F_PM2_5;
+    if (n == 0) n = payload_encode(&p, b, room);
+
+    want->meta.version = PAYLOAD_VERSION;
+    want->meta.tier    = (p.status & PAYLOAD_S_TIER_MASK) >> PAYLOAD_S_TIER_SHIFT;
+    r = gen_row(want, kind, want->meta.tier);
+    r->status  = p.status & ~PAYLOAD_S_TIER_MASK;
+    r->battery = p.battery;
+    if (p.fields & PAYLOAD_F_PM2_5)  r->pm2_5  = p.pm2_5;
+    if (p.fields & PAYLOAD_F_PM10_0) r->pm10_0 = p.pm10_0;
+    if (p.fields & PAYLOAD_F_LOCATION) {
+        r->latitude  = p.latitude;
+        r->longitude = p.longitude;
+    }
+
+    return n;
+}
+
+static uint16_t gen_lpp(uint8_t *b, uint16_t room, uplink_frame_t *want) {
+    uplink_row_t *r = gen_row(want, UPLINK_K_LPP, 0);
+    uint8_t  pct = rng() % 101;
+    uint8_t  status = rng() & 0x3F;
+    uint16_t pm2_5 = gen_pm();
+    uint16_t pm10_0 = pm2_5 + rng() % 50;
+    lpp_t    lpp;
+
+    want->meta.parts = UPLINK_P_LPP;
+    if (rng() % 4 == 0) {
+        // older firmware: pressure, temperature and humidity, battery
+        // and LED where the data rate allows
+        want->meta.pressure    = 9000 + rng() % 2000;
+        want->meta.temperature = (int16_t) (rng() % 600) - 100;
+        want->meta.humidity    = rng() % 201;
+        b[0] = 0; b[1] = LPP_DATATYPE_BAROMETER;   b[2] = want->meta.pressure >> 8; b[3] = want->meta.pressure;
+        b[4] = 1; b[5] = LPP_DATATYPE_TEMPERATURE; b[6] = want->meta.temperature >> 8; b[7] = want->meta.temperature;
+        b[8] = 2; b[9] = LPP_DATATYPE_HUMIDITY;    b[10] = want->meta.humidity;
+        if (rng() & 1) {
+            b[11] = 3; b[12] = LPP_DATATYPE_DIGITAL_INPUT;  b[13] = pct;
+            b[14] = 4; b[15] = LPP_DATATYPE_DIGITAL_OUTPUT; b[16] = rng() & 1;
+            r->battery = pct * 254 / 100;
+            return 17;
+        }
+        return 11;
+    }
+
+    // main.c CAYENNE_LPP, each channel only if it fits the data rate
+    lpp_init(&lpp, b, room);
+    if (rng() & 1) {
+        // LPP_PM_CONCENTRATION
+        if (lpp_add(&lpp, LPP_CH_PM2_5, LPP_DATATYPE_CONCENTRATION, pm2_5)) r->pm2_5 = pm2_5;
+        if (lpp_add(&lpp, LPP_CH_PM10_0, LPP_DATATYPE_CONCENTRATION, pm10_0)) r->pm10_0 = pm10_0;
+    } else {
+        // analog input in 0.01 saturates at 327.67
+        if (lpp_add(&lpp, LPP_CH_PM2_5, LPP_DATATYPE_ANALOG_INPUT, 100L * pm2_5)) {
+            r->pm2_5 = (pm2_5 > 327) ? 327 : pm2_5;
+        }
+        if (lpp_add(&lpp, LPP_CH_PM10_0, LPP_DATATYPE_ANALOG_INPUT, 100L * pm10_0)) {
+            r->pm10_0 = (pm10_0 > 327) ? 327 : pm10_0;
+        }
+    }
+    if (lpp_add(&lpp, LPP_CH_BATTERY, LPP_DATATYPE_DIGITAL_INPUT, pct)) r->battery = pct * 254 / 100;
+    if (lpp_add(&lpp, LPP_CH_STATUS, LPP_DATATYPE_DIGITAL_INPUT, status)) {
+        r->status = status & ~PAYLOAD_S_TIER_MASK;
+        r->tier   = (status & PAYLOAD_S_TIER_MASK) >> PAYLOAD_S_TIER_SHIFT;
+        want->meta.tier = r->tier;
+    }
+    lpp_add(&lpp, LPP_CH_LED, LPP_DATATYPE_DIGITAL_OUTPUT, rng() & 1);
+
+    return lpp.size;
+}
+
+static uint16_t gen_frame(uint8_t *port, uint8_t *buff, uplink_frame_t *want) {
+    /*
+        An uplink the way main.c writes it for a node built with or without
+        SEND_BURST_STATS and HONEY_REDUNDANT, and what it must decode to
+    */
+    static const uint8_t rooms[] = { 11, 53, 125, 242 };  // AS923 dwell time to DR5
+    uint16_t room = rooms[rng() % 4];
+    uint16_t n = 0;
+    uint16_t k = 0;
+    uint8_t  tier = rng() & 0x03;
+    uint8_t  failed = 0;
+    uint8_t  r = rng() % 100;
+    uint8_t  stats = rng() & 1;     // SEND_BURST_STATS
+    uint8_t  redundant = rng() & 1; // HONEY_REDUNDANT
+    uint8_t  head = 0;              // parts section header, 0 if none
+
+    *port = (r < 55 || (r >= 65 && r < 75)) ? UPLINK_PORT_APP : (r < 65) ? UPLINK_PORT_DIAG :
+            (r < 82) ? UPLINK_PORT_BACKFILL : (r < 86) ? UPLINK_PORT_ENERGY :
+            (r < 90) ? UPLINK_PORT_DEVINFO : UPLINK_PORT_LPP;
+    gen_reset(want, *port);
+
+    if (*port == UPLINK_PORT_BACKFILL) {
+        want->meta.tag  = UPLINK_TAG_LOG;
+        want->meta.tier = tier;
+        return gen_batch(buff, room, 1, tier, want);
+    }
+
+    if (*port == UPLINK_PORT_ENERGY) {
+        want->meta.tag          = UPLINK_TAG_ENERGY;
+        want->meta.tier         = tier;
+        want->meta.parts        = UPLINK_P_ENERGY;
+        want->meta.energy_first = rng() % ENERGY_PHASE_COUNT;
+        want->meta.energy_count = rng() % (ENERGY_PHASE_COUNT - want->meta.energy_first + 1);
+        buff[n++] = UPLINK_TAG_ENERGY | (tier << 5);
+        buff[n++] = want->meta.energy_first;
+        for (k = 0; k < want->meta.energy_count; ++k) {
+            want->meta.energy[k] = rng();
+            buff[n++] = want->meta.energy[k] >> 8;
+            buff[n++] = want->meta.energy[k];
+        }
+        return n;
+    }
+
+    if (*port == UPLINK_PORT_DEVINFO) {
+        want->meta.tag = PAYLOAD_TAG;
+        return gen_reading(buff, UPLINK_SIZE_MAX, UPLINK_K_INFO, want);
+    }
+
+    if (*port == UPLINK_PORT_LPP) return gen_lpp(buff, room, want);
+
+    // port 2 or 4: reading or batch, then what the build appends. The
+    // parts header and the sensors byte are kept room for
+    if (*port == UPLINK_PORT_DIAG) room = UPLINK_SIZE_MAX - UPLINK_DIAG_SIZE;
+    if (redundant) room -= 2;
+
+    r = rng() % 10;
+    if (r < 2) {
+        want->meta.tag  = UPLINK_TAG_BATCH;
+        want->meta.tier = tier;
+        n = gen_batch(buff, room, 0, tier, want);
+    } else if (r < 4) {
+        uplink_row_t *row = NULL;
+
+        want->meta.tag  = UPLINK_TAG_LEGACY;
+        want->meta.tier = tier;
+        buff[n++] = UPLINK_TAG_LEGACY | (tier << 5);
+        row = gen_row(want, UPLINK_K_LIVE, tier);
+        if (!stats && !redundant && *port == UPLINK_PORT_APP && r == 3) {
+            // DATA_TOGGLING location
+            row->latitude  = (int32_t) (rng() % 0x1000000) - 0x800000;
+            row->longitude = rng() % 0x1000000;
+            buff[n++] = row->latitude >> 16;  buff[n++] = row->latitude >> 8;  buff[n++] = row->latitude;
+            buff[n++] = row->longitude >> 16; buff[n++] = row->longitude >> 8; buff[n++] = row->longitude;
+            return n;
+        }
+        buff[n++] = rng();
+        if (buff[1] == UPLINK_LEGACY_ERR) {
+            row->status = UPLINK_S_SENTINEL;
+            failed = 1;
+        } else {
+            row->pm2_5 = buff[1];
+        }
+    } else {
+        want->meta.tag = PAYLOAD_TAG;
+        n = gen_reading(buff, room, UPLINK_K_LIVE, want);
+        failed = (want->row[0].status & PAYLOAD_S_SENSOR_ERR) != 0;
+    }
+
+    if (redundant) {
+        head = UPLINK_TAG_PARTS | UPLINK_PARTS_SENSORS;
+    }
+    if (stats && want->meta.tag != UPLINK_TAG_BATCH && !failed &&
+        n + UPLINK_STATS_SIZE + (head ? 0 : 1) <= room) {
+        head |= UPLINK_TAG_PARTS | UPLINK_PARTS_STATS;
+    }
+    if (head) {
+        buff[n++] = head;
+    }
+
+    if (head & UPLINK_PARTS_STATS) {
+        want->meta.stats_mean_x10 = rng();
+        want->meta.stats_min      = rng();
+        want->meta.stats_max      = rng();
+        want->meta.stats_count    = rng();
+        want->meta.warmup_ds      = rng();
+        want->meta.parts         |= UPLINK_P_STATS;
+        buff[n++] = want->meta.stats_mean_x10 >> 8; buff[n++] = want->meta.stats_mean_x10;
+        buff[n++] = want->meta.stats_min >> 8;      buff[n++] = want->meta.stats_min;
+        buff[n++] = want->meta.stats_max >> 8;      buff[n++] = want->meta.stats_max;
+        buff[n++] = want->meta.stats_count;
+        buff[n++] = want->meta.warmup_ds;
+    }
+
+    if (head & UPLINK_PARTS_SENSORS) {
+        want->meta.sensors_ok = rng() & 0x03;
+        want->meta.disagree   = rng() & 0x01;
+        want->meta.parts     |= UPLINK_P_SENSORS;
+        buff[n++] = (want->meta.sensors_ok << 1) | want->meta.disagree;
+    }
+    if (redundant) room += 2;
+
+    if (*port == UPLINK_PORT_DIAG) {
+        for (k = 0; k < UPLINK_DIAG_SIZE; ++k) {
+            want->meta.diag[k] = rng() % 4;
+            buff[n++] = want->meta.diag[k];
+        }
+        want->meta.parts |= UPLINK_P_DIAG;
+    } else if (want->meta.tag != UPLINK_TAG_BATCH && (rng() & 1)) {
+        n += gen_batch(&buff[n], room - n, 1, tier, want);
+    }
+
+    return n;
+}
+
+static size_t gen_line(char *dst, uint32_t i, uint8_t port, const uint8_t *buff, uint16_t size) {
+    // The Things Stack or ChirpStack JSON, or a raw hex line
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char     data[BASE64_MAX + 1];
+    char     stamp[40];
+    uint32_t acc = 0;
+    uint16_t k = 0;
+    size_t   n = 0;
+    uint32_t dev = rng() % 20000;
+    uint32_t s = i / 50;
+
+    snprintf(stamp, sizeof(stamp), "2026-10-17T%02u:%02u:%02u.%06uZ", (s / 3600) % 24, (s / 60) % 60, s % 60, rng() % 1000000);
+
+    if (i % 10 == 9) {
+        n = sprintf(dst, "70B3D57ED0%06X %u ", dev, port);
+        for (k = 0; k < size; ++k) n += sprintf(&dst[n], "%02X", buff[k]);
+        dst[n++] = '\n';
+        return n;
+    }
+
+    for (k = 0; k < size; k += 3) {
+        acc = (uint32_t) buff[k] << 16 | (k + 1 < size ? buff[k + 1] << 8 : 0) | (k + 2 < size ? buff[k + 2] : 0);
+        data[n++] = alphabet[(acc >> 18) & 0x3F];
+        data[n++] = alphabet[(acc >> 12) & 0x3F];
+        data[n++] = (k + 1 < size) ? alphabet[(acc >> 6) & 0x3F] : '=';
+        data[n++] = (k + 2 < size) ? alphabet[acc & 0x3F] : '=';
+    }
+    data[n] = '\0';
+
+    if (i % 10 < 6) {
+        return sprintf(dst,
+            "{\"end_device_ids\":{\"device_id\":\"ct-%05u\",\"application_ids\":{\"application_id\":\"ct-pm25\"},"
+            "\"dev_eui\":\"70B3D57ED0%06X\"},\"received_at\":\"%s\",\"uplink_message\":{\"f_port\":%u,"
+            "\"f_cnt\":%u,\"frm_payload\":\"%s\",\"rx_metadata\":[{\"gateway_ids\":{\"gateway_id\":\"gw-%02u\"},"
+            "\"time\":\"%s\",\"rssi\":-%u,\"snr\":%u.%u}],\"settings\":{\"data_rate\":{\"lora\":"
+            "{\"bandwidth\":125000,\"spreading_factor\":%u}}}}}\n",
+            dev, dev, stamp, port, i, data, rng() % 40, stamp, 60 + rng() % 60, rng() % 12, rng() % 10, 7 + rng() % 6);
+    }
+
+    return sprintf(dst,
+        "{\"deduplicationId\":\"%08x-0000-4000-8000-%012x\",\"time\":\"%s\",\"deviceInfo\":{\"deviceName\":\"ct-%05u\","
+        "\"devEui\":\"70b3d57ed0%06x\"},\"fCnt\":%u,\"fPort\":%u,\"data\":\"%s\",\"rxInfo\":[{\"gatewayId\":\"%016x\","
+        "\"rssi\":-%u,\"snr\":%u.%u}]}\n",
+        rng(), i, stamp, dev, dev, i, port, data, rng(), 60 + rng() % 60, rng() % 12, rng() % 10);
+}
+
+static uint32_t fuzz(uint32_t n) {
+    /*
+        Every fleet build: synthetic uplinks must decode to what went in,
+        through the line parser as well. Random bytes on any port must
+        decode or be rejected without reading past the frame (build with
+        ASan, see the Makefile)
+    */
+    static const uint8_t ports[] = { 2, 4, 5, 6, 7, 99, 2, 4, 0, 1, 3, 8, 200 };
+    uplink_frame_t *want = malloc(sizeof(uplink_frame_t));
+    uplink_frame_t *got = malloc(sizeof(uplink_frame_t));
+    uint32_t counts[UPLINK_RESULT_COUNT] = { 0 };
+    uint8_t  buff[UPLINK_SIZE_MAX];
+    uint8_t  back[UPLINK_SIZE_MAX + 4];
+    char     text[2048];
+    uint32_t failed = 0;
+    uint32_t i = 0;
+    uint16_t size = 0;
+    uint8_t  port = 0;
+    uint8_t  res = 0;
+    line_t   l;
+    int      k = 0;
+
+    for (i = 0; i < n; ++i) {
+        size = gen_frame(&port, buff, want);
+
+        // the line goes through the parser first
+        k = gen_line(text, i, port, buff, size);
+        res = parse_line(text, &text[k - 1], &l);
+        k = (res != UPLINK_OK) ? -1 :
+            l.base64 ? base64_decode(l.data, back, sizeof(back)) : hex_decode(l.data, back, sizeof(back));
+        if (k != size || l.port != port || memcmp(back, buff, size) != 0) {
+            if (failed++ < 5) printf("frame %u: line does not parse back: %.*s", i, (int) strlen(text), text);
+            continue;
+        }
+
+        res = uplink_decode(port, back, k, got);
+        if (res != UPLINK_OK || got->rows != want->rows ||
+            memcmp(&got->meta, &want->meta, sizeof(uplink_meta_t)) != 0 ||
+            memcmp(got->row, want->row, want->rows * sizeof(uplink_row_t)) != 0) {
+            if (failed++ < 5) {
+                printf("frame %u, port %u, %u bytes: %s, rows %u want %u, parts %02x want %02x\n ",
+                       i, port, size, uplink_result_name(res), got->rows, want->rows,
+                       got->meta.parts, want->meta.parts);
+                for (k = 0; k < size; ++k) printf(" %02x", buff[k]);
+                printf("\n");
+            }
+        }
+    }
+    printf("round trip x%u: %u failed\n", n, failed);
+
+    for (i = 0; i < n; ++i) {
+        // exactly size bytes on the heap so ASan sees any read past it
+        uint8_t *frame = NULL;
+
+        size  = rng() % (UPLINK_SIZE_MAX + 3);
+        frame = malloc(size ? size : 1);
+        for (k = 0; k < size; ++k) frame[k] = rng();
+        port = ports[rng() % sizeof(ports)];
+        if (size > 0 && port != UPLINK_PORT_LPP && (rng() & 1)) {
+            // most random tags are rejected at once, steer half of them in
+            frame[0] = (frame[0] & 0xE0) | (17 + rng() % 5);
+        }
+        if (size > 2 && port == UPLINK_PORT_APP && (rng() & 1)) {
+            // and a parts section after a legacy reading
+            frame[0] = (frame[0] & 0xE0) | UPLINK_TAG_LEGACY;
+            frame[2] = (frame[2] & 0xE0) | UPLINK_TAG_PARTS;
+        }
+
+        res = uplink_decode(port, frame, size, got);
+        counts[res]++;
+        if (got->rows > UPLINK_ROWS_MAX || (res == UPLINK_OK && port == UPLINK_PORT_ENERGY && got->meta.energy_count > UPLINK_ENERGY_MAX)) {
+            if (failed++ < 5) printf("random frame %u overran the frame\n", i);
+        }
+        free(frame);
+    }
+    printf("random bytes x%u: %u failed,", n, failed);
+    for (k = 0; k < UPLINK_RESULT_COUNT; ++k) printf(" %s %u", uplink_result_name(k), counts[k]);
+    printf("\n");
+
+    free(want);
+    free(got);
+    return failed;
+}
+
+static void bench(uint32_t n) {
+    // synthetic NDJSON in memory, decoded to CSV with one thread and then
+    // with all of them, the output is dropped
+    uplink_frame_t *want = malloc(sizeof(uplink_frame_t));
+    uint8_t  threads = cfg.threads;
+    uint8_t  buff[UPLINK_SIZE_MAX];
+    uint8_t  port = 0;
+    uint16_t size = 0;
+    size_t   cap = (size_t) n * 600 + 4096;
+    size_t   len = 0;
+    char    *text = malloc(cap);
+    uint64_t t0 = 0;
+    uint32_t i = 0;
+    uint8_t  pass = 0;
+
+    if (text == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < n; ++i) {
+        if (len + 2048 > cap) {
+            cap *= 2;
+            text = realloc(text, cap);
+            if (text == NULL) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+        }
+        size = gen_frame(&port, buff, want);
+        len += gen_line(&text[len], i, port, buff, size);
+    }
+    printf("%u synthetic uplinks, %.1f MB, %s output, %s table\n", n, len / 1e6,
+           cfg.bin ? "bin" : "csv", cfg.table->name);
+
+    for (pass = 0; pass < 2; ++pass) {
+        size_t off = 0;
+
+        cfg.threads = pass ? threads : 1;
+        if (pass && threads == 1) break;
+        memset(&totals, 0x00, sizeof(totals));
+
+        t0 = now_ns();
+        while (off < len) {
+            size_t end = (len - off > WINDOW_SIZE) ? off + WINDOW_SIZE : len;
+            char  *nl = memrchr(&text[off], '\n', end - off);
+
+            end = (nl != NULL && end < len) ? (size_t) (nl - text) + 1 : end;
+            process_window(&text[off], end - off, NULL);
+            off = end;
+        }
+        printf("%2u thread%s: ", cfg.threads, cfg.threads > 1 ? "s" : " ");
+        fflush(stdout);
+        print_totals(stdout, (now_ns() - t0) / 1e9);
+    }
+
+    cfg.threads = threads;
+    free(text);
+    free(want);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
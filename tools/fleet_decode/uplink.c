@@ -0,0 +1,396 @@
+/*
+ * uplink.c
+ *
+ *  Decoder for every uplink layout the node sends, see uplink.h. The
+ *  layouts are the ones main.c writes, ct_payload.h frames go through
+ *  the node's own codec.
+ */
+
+#include <string.h>
+#include "ct_lpp.h"
+#include "ct_payload.h"
+#include "uplink.h"
+
+#define BATCH_HEAD_SIZE     6       // tag, count, age (16 bits), PM2.5
+#define LOG_HEAD_SIZE       7       // tag, count, age (24 bits), PM2.5
+#define STEP_UNIT           16      // s per time step
+#define STEP_ESC_DT         0xFF    // time step escape, the step follows in 24 bits
+#define STEP_ESC_DV         0x80    // PM2.5 step escape, the value follows in 16 bits
+#define LEGACY_LOC_SIZE     7       // tag, latitude and longitude in 24 bits each
+#define TIER(b)             (((b) >> 5) & 0x03)
+
+static const char* const uplink_result_names[UPLINK_RESULT_COUNT] = {
+    "ok", "size", "tag", "port", "payload", "lpp"
+};
+
+static const char* const uplink_kind_names[UPLINK_KIND_COUNT] = {
+    "live", "batch", "backlog", "info", "lpp"
+};
+
+
+/* Private Prototypes --------------------------------------------------------*/
+static uplink_row_t*   row_add(uplink_frame_t *f, uint8_t kind, uint8_t tier);
+static uplink_result_t steps(const uint8_t *b, uint16_t size, uint16_t *n, uint8_t count,
+                             uint8_t kind, uplink_frame_t *f);
+static uplink_result_t batch(const uint8_t *b, uint16_t size, uint16_t *n, uint8_t log, uplink_frame_t *f);
+static uplink_result_t reading(const uint8_t *b, uint16_t size, uint16_t *n, uint8_t kind, uplink_frame_t *f);
+static uplink_result_t legacy(const uint8_t *b, uint16_t size, uint16_t *n, uplink_frame_t *f);
+static uplink_result_t parts(const uint8_t *b, uint16_t end, uint16_t *n, uplink_frame_t *f);
+static uplink_result_t app(const uint8_t *b, uint16_t size, uplink_frame_t *f);
+static uplink_result_t energy(const uint8_t *b, uint16_t size, uplink_frame_t *f);
+static uplink_result_t lpp(const uint8_t *b, uint16_t size, uplink_frame_t *f);
+static uint16_t        be16(const uint8_t *b);
+static int32_t         be24s(const uint8_t *b);
+
+
+uplink_result_t uplink_decode(uint8_t port, const uint8_t *buff, uint16_t size, uplink_frame_t *f) {
+    // rows are written as they are found
+    memset(&f->meta, 0x00, sizeof(uplink_meta_t));
+    f->rows = 0;
+    f->meta.port        = port;
+    f->meta.temperature = INT16_MIN;
+    f->meta.humidity    = 0xFF;
+
+    if (size > UPLINK_SIZE_MAX) return UPLINK_ERR_SIZE;
+    if (port == UPLINK_PORT_LPP) return lpp(buff, size, f);
+    if (size < 1) return UPLINK_ERR_SIZE;
+
+    f->meta.tag = buff[0] & 0x1F;
+    if (f->meta.tag != PAYLOAD_TAG) {
+        f->meta.tier = TIER(buff[0]);
+    }
+
+    switch (port) {
+        case UPLINK_PORT_APP:
+        case UPLINK_PORT_DIAG:
+            return app(buff, size, f);
+
+        case UPLINK_PORT_BACKFILL: {
+            uint16_t n = 0;
+            uplink_result_t res = UPLINK_OK;
+
+            if (f->meta.tag != UPLINK_TAG_LOG) return UPLINK_ERR_TAG;
+            res = batch(buff, size, &n, 1, f);
+            if (res == UPLINK_OK && n < size) f->meta.parts |= UPLINK_P_UNKNOWN;
+            return res;
+        }
+
+        case UPLINK_PORT_ENERGY:
+            if (f->meta.tag != UPLINK_TAG_ENERGY) return UPLINK_ERR_TAG;
+            return energy(buff, size, f);
+
+        case UPLINK_PORT_DEVINFO: {
+            uint16_t n = 0;
+
+            if (f->meta.tag != PAYLOAD_TAG) return UPLINK_ERR_TAG;
+            return reading(buff, size, &n, UPLINK_K_INFO, f);
+        }
+
+        default:
+            return UPLINK_ERR_PORT;
+    }
+}
+
+const char* uplink_result_name(uplink_result_t res) {
+    return (res < UPLINK_RESULT_COUNT) ? uplink_result_names[res] : "?";
+}
+
+const char* uplink_kind_name(uint8_t kind) {
+    return (kind < UPLINK_KIND_COUNT) ? uplink_kind_names[kind] : "?";
+}
+
+
+/* Private Functions ---------------------------------------------------------*/
+static uplink_row_t* row_add(uplink_frame_t *f, uint8_t kind, uint8_t tier) {
+    uplink_row_t *r = NULL;
+
+    if (f->rows >= UPLINK_ROWS_MAX) return NULL;
+
+    r = &f->row[f->rows++];
+    r->age_s     = 0;
+    r->pm2_5     = UPLINK_NO_PM;
+    r->pm10_0    = UPLINK_NO_PM;
+    r->latitude  = UPLINK_NO_LOC;
+    r->longitude = UPLINK_NO_LOC;
+    r->kind      = kind;
+    r->tier      = tier;
+    r->status    = 0;
+    r->battery   = 0;
+    return r;
+}
+
+static uplink_result_t steps(const uint8_t *b, uint16_t size, uint16_t *n, uint8_t count,
+                             uint8_t kind, uplink_frame_t *f) {
+    // count - 1 readings after the one already in the last row, each a
+    // time step and a PM2.5 step, ages count down from the first
+    uplink_row_t *prev = &f->row[f->rows - 1];
+    uplink_row_t *r = NULL;
+    uint16_t i = *n;
+    uint32_t dt = 0;
+    uint8_t  k = 0;
+
+    for (k = 1; k < count; ++k) {
+        if (i >= size) return UPLINK_ERR_SIZE;
+        dt = b[i++];
+        if (dt == STEP_ESC_DT) {
+            if (i + 3 > size) return UPLINK_ERR_SIZE;
+            dt = ((uint32_t) b[i] << 16) | be16(&b[i + 1]);
+            i += 3;
+        }
+        dt *= STEP_UNIT;
+
+        if (i >= size) return UPLINK_ERR_SIZE;
+        r = row_add(f, kind, prev->tier);
+        if (r == NULL) return UPLINK_ERR_SIZE;
+        if (b[i] == STEP_ESC_DV) {
+            if (i + 3 > size) return UPLINK_ERR_SIZE;
+            r->pm2_5 = be16(&b[i + 1]);
+            i += 3;
+        } else {
+            r->pm2_5 = (uint16_t) (prev->pm2_5 + (int8_t) b[i]);
+            i += 1;
+        }
+        r->age_s = (prev->age_s > dt) ? prev->age_s - dt : 0;
+        prev = r;
+    }
+
+    *n = i;
+    return UPLINK_OK;
+}
+
+static uplink_result_t batch(const uint8_t *b, uint16_t size, uint16_t *n, uint8_t log, uplink_frame_t *f) {
+    // a batch (tag 18) or a backlog section (tag 19) at b[*n]
+    uint16_t      i = *n;
+    uint16_t      head = log ? LOG_HEAD_SIZE : BATCH_HEAD_SIZE;
+    uint8_t       count = 0;
+    uplink_row_t *r = NULL;
+
+    if (i + head > size) return UPLINK_ERR_SIZE;
+
+    count = b[i + 1];
+    if (count == 0) {
+        *n = i + head;
+        return UPLINK_OK;
+    }
+
+    r = row_add(f, log ? UPLINK_K_BACKLOG : UPLINK_K_BATCH, TIER(b[i]));
+    if (r == NULL) return UPLINK_ERR_SIZE;
+    if (log) {
+        r->age_s = ((uint32_t) b[i + 2] << 16) | be16(&b[i + 3]);
+        r->pm2_5 = be16(&b[i + 5]);
+    } else {
+        r->age_s = be16(&b[i + 2]);
+        r->pm2_5 = be16(&b[i + 4]);
+    }
+    if (log) f->meta.parts |= UPLINK_P_BACKLOG;
+
+    *n = i + head;
+    return steps(b, size, n, count, r->kind, f);
+}
+
+static uplink_result_t reading(const uint8_t *b, uint16_t size, uint16_t *n, uint8_t kind, uplink_frame_t *f) {
+    // a ct_payload.h frame at b[*n]
+    payload_t        p;
+    payload_result_t res = PAYLOAD_OK;
+    uplink_row_t    *r = NULL;
+    uint8_t          used = 0;
+
+    res = payload_decode_frame(&b[*n], size - *n, &p, &used);
+    if (res != PAYLOAD_OK) return (res == PAYLOAD_ERR_SIZE) ? UPLINK_ERR_SIZE : UPLINK_ERR_PAYLOAD;
+
+    f->meta.version = b[*n] >> 5;
+    f->meta.tier    = (p.status & PAYLOAD_S_TIER_MASK) >> PAYLOAD_S_TIER_SHIFT;
+
+    r = row_add(f, kind, f->meta.tier);
+    r->status  = p.status & ~PAYLOAD_S_TIER_MASK;
+    r->battery = p.battery;
+    if (p.fields & PAYLOAD_F_PM2_5)  r->pm2_5  = p.pm2_5;
+    if (p.fields & PAYLOAD_F_PM10_0) r->pm10_0 = p.pm10_0;
+    if (p.fields & PAYLOAD_F_LOCATION) {
+        r->latitude  = p.latitude;
+        r->longitude = p.longitude;
+    }
+
+    *n += used;
+    return UPLINK_OK;
+}
+
+static uplink_result_t legacy(const uint8_t *b, uint16_t size, uint16_t *n, uplink_frame_t *f) {
+    // tag 17: a PM2.5 byte, or the location when it toggled with it. No
+    // reading with sections after it is 7 bytes long
+    uplink_row_t *r = NULL;
+
+    if (size < 2) return UPLINK_ERR_SIZE;
+
+    r = row_add(f, UPLINK_K_LIVE, f->meta.tier);
+    if (f->meta.port == UPLINK_PORT_APP && size == LEGACY_LOC_SIZE) {
+        r->latitude  = be24s(&b[1]);
+        r->longitude = ((uint32_t) b[4] << 16) | be16(&b[5]);
+        *n = LEGACY_LOC_SIZE;
+        return UPLINK_OK;
+    }
+
+    if (b[1] == UPLINK_LEGACY_ERR) {
+        r->status = UPLINK_S_SENTINEL;
+    } else {
+        r->pm2_5 = b[1];
+    }
+    *n = 2;
+    return UPLINK_OK;
+}
+
+static uplink_result_t parts(const uint8_t *b, uint16_t end, uint16_t *n, uplink_frame_t *f) {
+    // tag 22 at b[*n], its bits 5..7 list the sections after it in order
+    uint16_t i = *n;
+    uint8_t  head = b[i++];
+
+    // a section this decoder does not know has no known size
+    if (head & ~(0x1F | UPLINK_PARTS_STATS | UPLINK_PARTS_SENSORS)) {
+        f->meta.parts |= UPLINK_P_UNKNOWN;
+        *n = end;
+        return UPLINK_OK;
+    }
+
+    if (head & UPLINK_PARTS_STATS) {
+        if (i + UPLINK_STATS_SIZE > end) return UPLINK_ERR_SIZE;
+        f->meta.stats_mean_x10 = be16(&b[i]);
+        f->meta.stats_min      = be16(&b[i + 2]);
+        f->meta.stats_max      = be16(&b[i + 4]);
+        f->meta.stats_count    = b[i + 6];
+        f->meta.warmup_ds      = b[i + 7];
+        f->meta.parts         |= UPLINK_P_STATS;
+        i += UPLINK_STATS_SIZE;
+    }
+
+    if (head & UPLINK_PARTS_SENSORS) {
+        if (i >= end) return UPLINK_ERR_SIZE;
+        f->meta.sensors_ok = b[i] >> 1;
+        f->meta.disagree   = b[i] & 0x01;
+        f->meta.parts     |= UPLINK_P_SENSORS;
+        i++;
+    }
+
+    *n = i;
+    return UPLINK_OK;
+}
+
+static uplink_result_t app(const uint8_t *b, uint16_t size, uplink_frame_t *f) {
+    // the reading or the batch, then the sections the frame lists
+    uplink_result_t res = UPLINK_OK;
+    uint16_t n = 0;
+    uint16_t end = size;
+
+    switch (f->meta.tag) {
+        case UPLINK_TAG_LEGACY: res = legacy(b, size, &n, f); break;
+        case UPLINK_TAG_BATCH:  res = batch(b, size, &n, 0, f); break;
+        case PAYLOAD_TAG:       res = reading(b, size, &n, UPLINK_K_LIVE, f); break;
+        default:                return UPLINK_ERR_TAG;
+    }
+    if (res != UPLINK_OK) return res;
+
+    // error counters always go last
+    if (f->meta.port == UPLINK_PORT_DIAG) {
+        if (n + UPLINK_DIAG_SIZE > size) return UPLINK_ERR_SIZE;
+        end -= UPLINK_DIAG_SIZE;
+        memcpy(f->meta.diag, &b[end], UPLINK_DIAG_SIZE);
+        f->meta.parts |= UPLINK_P_DIAG;
+    }
+
+    if (n < end && (b[n] & 0x1F) == UPLINK_TAG_PARTS) {
+        res = parts(b, end, &n, f);
+        if (res != UPLINK_OK) return res;
+    }
+
+    if (f->meta.port == UPLINK_PORT_APP && n + LOG_HEAD_SIZE <= end && (b[n] & 0x1F) == UPLINK_TAG_LOG) {
+        res = batch(b, end, &n, 1, f);
+        if (res != UPLINK_OK) return res;
+    }
+
+    if (n < end) f->meta.parts |= UPLINK_P_UNKNOWN;
+    return UPLINK_OK;
+}
+
+static uplink_result_t energy(const uint8_t *b, uint16_t size, uplink_frame_t *f) {
+    // tag, first phase, then 16 bits a phase
+    uint8_t k = 0;
+
+    if (size < 2 || (size & 1)) return UPLINK_ERR_SIZE;
+
+    f->meta.energy_first = b[1];
+    f->meta.energy_count = (size - 2) / 2;
+    if (f->meta.energy_count > UPLINK_ENERGY_MAX) {
+        f->meta.energy_count = UPLINK_ENERGY_MAX;
+        f->meta.parts |= UPLINK_P_UNKNOWN;
+    }
+    for (k = 0; k < f->meta.energy_count; ++k) {
+        f->meta.energy[k] = be16(&b[2 + 2 * k]);
+    }
+    f->meta.parts |= UPLINK_P_ENERGY;
+
+    return UPLINK_OK;
+}
+
+static uplink_result_t lpp(const uint8_t *b, uint16_t size, uplink_frame_t *f) {
+    // channel, type and the values of the type, sizes from ct_lpp.c.
+    // Frames of older firmware start with a barometer on channel 0 and
+    // send the battery on channel 3, where the node now sends its status
+    uplink_row_t *r = row_add(f, UPLINK_K_LPP, 0);
+    uint8_t  old = (size >= 2 && b[1] == LPP_DATATYPE_BAROMETER);
+    uint16_t i = 0;
+    uint8_t  len = 0;
+    uint8_t  ch = 0;
+    int32_t  v = 0;
+
+    while (i < size) {
+        if (i + 2 > size) return UPLINK_ERR_SIZE;
+        len = lpp_size(b[i + 1]);
+        if (len == 0) return UPLINK_ERR_LPP;
+        if (i + len > size) return UPLINK_ERR_SIZE;
+
+        ch = b[i];
+        v = lpp_value(&b[i + 2], b[i + 1], 0);
+        switch (b[i + 1]) {
+            case LPP_DATATYPE_ANALOG_INPUT:
+                v = (v < 0) ? 0 : v / 100;
+                // fall through, analog input is the concentration in 0.01
+            case LPP_DATATYPE_CONCENTRATION:
+                if (old) break;
+                if (ch == LPP_CH_PM2_5)  r->pm2_5 = v;
+                if (ch == LPP_CH_PM10_0) r->pm10_0 = v;
+                break;
+            case LPP_DATATYPE_DIGITAL_INPUT:
+                if (ch == LPP_CH_BATTERY || (old && ch == LPP_CH_STATUS)) {
+                    r->battery = (v > 100) ? 254 : v * 254 / 100;
+                } else if (ch == LPP_CH_STATUS) {
+                    r->status = v & ~PAYLOAD_S_TIER_MASK;
+                    r->tier   = (v & PAYLOAD_S_TIER_MASK) >> PAYLOAD_S_TIER_SHIFT;
+                    f->meta.tier = r->tier;
+                }
+                break;
+            case LPP_DATATYPE_TEMPERATURE: f->meta.temperature = v; break;
+            case LPP_DATATYPE_HUMIDITY:    f->meta.humidity = v; break;
+            case LPP_DATATYPE_BAROMETER:   f->meta.pressure = v; break;
+            case LPP_DATATYPE_GPS:
+                // 1e-4 degree
+                r->latitude  = v * 10;
+                r->longitude = lpp_value(&b[i + 2], b[i + 1], 1) * 10;
+                break;
+            default:
+                break;
+        }
+        i += len;
+    }
+    f->meta.parts |= UPLINK_P_LPP;
+
+    return UPLINK_OK;
+}
+
+static uint16_t be16(const uint8_t *b) {
+    return ((uint16_t) b[0] << 8) | b[1];
+}
+
+static int32_t be24s(const uint8_t *b) {
+    uint32_t v = ((uint32_t) b[0] << 16) | ((uint32_t) b[1] << 8) | b[2];
+
+    return (v & 0x800000) ? (int32_t) (v | 0xFF000000) : (int32_t) v;
+}
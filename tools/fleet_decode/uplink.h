@@ -0,0 +1,154 @@
+/*
+ * uplink.h
+ *
+ *  Decoder for every uplink layout the node sends, for the ingest side.
+ *  Readings come out as rows with their age at the uplink, the rest of a
+ *  frame (error counters, burst stats, energy totals, LPP sensors) in its
+ *  meta. No allocation and no state, safe from any thread.
+ *
+ *  The low 5 bits of byte 0 tag the layout, bits 5..6 carry the battery
+ *  tier, except in a ct_payload.h frame where they are the version.
+ *
+ *  Port 2, LORAWAN_APP_PORT, one of
+ *    17  legacy reading, PM2.5 in one byte, 191 when the sensor failed or
+ *        the battery was low. 7 bytes in a build without options is the
+ *        DATA_TOGGLING location, 24 bits of latitude then longitude
+ *    18  batch: count, age of the first reading (16 bits, s), its PM2.5
+ *        (16 bits), then a time step and a PM2.5 step per further reading.
+ *        Time steps are in 16 s, one byte or 0xFF and 24 bits, PM2.5
+ *        steps a signed byte or 0x80 and the value in 16 bits
+ *    21  ct_payload.h reading
+ *  then, each optional: a parts section, tag 22 with bits 5..7 listing what
+ *  follows in this order, burst stats (8 bytes, SEND_BURST_STATS builds,
+ *  not after a failed reading or a batch) and the sensors byte
+ *  (HONEY_REDUNDANT builds), then a backlog section, tag 19.
+ *  Port 4, HONEY_DIAG_PORT, as port 2 with 5 error counters last in place
+ *  of the backlog.
+ *  Port 5, tag 19 backfill: the batch layout with a 24-bit age.
+ *  Port 6, tag 20 energy totals: first phase, then 16 bits a phase.
+ *  Port 7, device info: a ct_payload.h frame, location and battery.
+ *  Port 99, Cayenne LPP, ct_lpp.h: PM2.5 and PM10 on channels 0 and 1 as
+ *  analog inputs in 0.01 or concentrations, battery in percent and the
+ *  status byte as digital inputs on 2 and 3. Older firmware sent the
+ *  pressure, temperature and humidity, then the battery on channel 3.
+ */
+
+#ifndef UPLINK_H_
+#define UPLINK_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Ports */
+#define UPLINK_PORT_APP       2
+#define UPLINK_PORT_DIAG      4
+#define UPLINK_PORT_BACKFILL  5
+#define UPLINK_PORT_ENERGY    6
+#define UPLINK_PORT_DEVINFO   7
+#define UPLINK_PORT_LPP       99
+
+/* Tags, low 5 bits of byte 0 */
+#define UPLINK_TAG_LEGACY     17
+#define UPLINK_TAG_BATCH      18
+#define UPLINK_TAG_LOG        19
+#define UPLINK_TAG_ENERGY     20
+#define UPLINK_TAG_PARTS      22
+
+/* Parts section, bits 5..7 of its first byte */
+#define UPLINK_PARTS_STATS    0x20  // burst stats follow
+#define UPLINK_PARTS_SENSORS  0x40  // the sensors byte follows
+
+#define UPLINK_SIZE_MAX       242   // largest LoRaWAN application payload
+#define UPLINK_ROWS_MAX       128   // readings a frame can carry, steps take 2 bytes at least
+#define UPLINK_DIAG_SIZE      5     // error counters: timeout, header, checksum, nack, failed
+#define UPLINK_STATS_SIZE     8     // burst stats: mean x10, min, max, count, warm-up in 0.1 s
+#define UPLINK_ENERGY_MAX     16    // phases an energy frame is read for
+#define UPLINK_LEGACY_ERR     191   // legacy PM2.5 byte of a failed reading or a low battery
+
+/* Absent values */
+#define UPLINK_NO_PM          0xFFFF
+#define UPLINK_NO_LOC         INT32_MIN
+
+/* Row status, the PAYLOAD_S_* flags and */
+#define UPLINK_S_SENTINEL     0x40  // legacy 191: sensor error or low battery, the frame does not tell
+
+/* Parts found in a frame besides the readings */
+#define UPLINK_P_STATS        0x01
+#define UPLINK_P_SENSORS      0x02
+#define UPLINK_P_DIAG         0x04
+#define UPLINK_P_BACKLOG      0x08
+#define UPLINK_P_ENERGY       0x10
+#define UPLINK_P_LPP          0x20
+#define UPLINK_P_UNKNOWN      0x80  // bytes left over that match no part
+
+typedef enum {
+    UPLINK_K_LIVE = 0,    // the reading of the uplink period
+    UPLINK_K_BATCH,       // buffered readings, tag 18
+    UPLINK_K_BACKLOG,     // logged readings sent late, tag 19
+    UPLINK_K_INFO,        // device info, no reading
+    UPLINK_K_LPP,         // Cayenne LPP sensors
+    UPLINK_KIND_COUNT
+} uplink_kind_t;
+
+typedef struct {
+    uint32_t age_s;       // s before the uplink the reading was taken
+    uint16_t pm2_5;       // ug/m3, UPLINK_NO_PM if absent
+    uint16_t pm10_0;      // ug/m3, UPLINK_NO_PM if absent
+    int32_t  latitude;    // 1e-5 degree, UPLINK_NO_LOC if absent
+    int32_t  longitude;   // 1e-5 degree, UPLINK_NO_LOC if absent
+    uint8_t  kind;        // uplink_kind_t
+    uint8_t  tier;        // battery tier when sent
+    uint8_t  status;      // PAYLOAD_S_* flags without the tier, UPLINK_S_SENTINEL
+    uint8_t  battery;     // 1 (very low) to 254 (full), 0 unknown, 255 external supply
+} uplink_row_t;
+
+typedef struct {
+    uint8_t  port;
+    uint8_t  tag;         // low 5 bits of byte 0, 0 for LPP
+    uint8_t  version;     // ct_payload.h schema, 0 for other layouts
+    uint8_t  tier;
+    uint8_t  parts;       // UPLINK_P_*
+    uint8_t  diag[UPLINK_DIAG_SIZE];
+    uint16_t stats_mean_x10;
+    uint16_t stats_min;
+    uint16_t stats_max;
+    uint8_t  stats_count;
+    uint8_t  warmup_ds;   // warm-up, 0.1 s
+    uint8_t  sensors_ok;  // bit per sensor that answered
+    uint8_t  disagree;    // redundant sensors out of tolerance
+    uint8_t  energy_first;
+    uint8_t  energy_count;
+    uint16_t energy[UPLINK_ENERGY_MAX]; // charge per phase from energy_first, ENERGY_DIAG_UNIT, wraps
+    int16_t  temperature; // 0.1 C, INT16_MIN if absent
+    uint16_t pressure;    // 0.1 hPa, 0 if absent
+    uint8_t  humidity;    // 0.5 %, 0xFF if absent
+} uplink_meta_t;
+
+typedef struct {
+    uplink_meta_t meta;   // what the frame says besides its readings
+    uint16_t      rows;
+    uplink_row_t  row[UPLINK_ROWS_MAX];
+} uplink_frame_t;
+
+typedef enum {
+    UPLINK_OK = 0,
+    UPLINK_ERR_SIZE,      // frame shorter than its layout
+    UPLINK_ERR_TAG,       // unknown first byte for the port
+    UPLINK_ERR_PORT,      // not a port the node sends on
+    UPLINK_ERR_PAYLOAD,   // ct_payload.h rejected the frame
+    UPLINK_ERR_LPP,       // unknown LPP data type
+    UPLINK_RESULT_COUNT
+} uplink_result_t;
+
+uplink_result_t uplink_decode(uint8_t port, const uint8_t *buff, uint16_t size, uplink_frame_t *f);
+const char*     uplink_result_name(uplink_result_t res);
+const char*     uplink_kind_name(uint8_t kind);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* UPLINK_H_ */
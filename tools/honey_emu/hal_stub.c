@@ -0,0 +1,404 @@
+/*
+ * hal_stub.c
+ *
+ *  Host stand-in for the HAL calls of ct_honey.c, see hal_stub.h
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "hal_stub.h"
+
+#define HAL_STUB_MAX_UARTS  4
+
+static UART_HandleTypeDef* uarts[HAL_STUB_MAX_UARTS];
+static void               (*uart_irqs[HAL_STUB_MAX_UARTS])(void);
+static TimerEvent_t*      timers = NULL; // started timers, unsorted
+static uint64_t           epoch_us = 0;
+static uint32_t           stop_mask = 0;    // LPM ids that forbid STOP
+static uint64_t           stop_us = 0;      // time waited in LPM_EnterLowPower()
+static uint64_t           sleep_us = 0;
+
+
+/* Private Prototypes --------------------------------------------------------*/
+static void uart_rx(UART_HandleTypeDef *huart, void (*irq)(void));
+static void uart_wake(UART_HandleTypeDef *huart, void (*irq)(void));
+static void timers_fire(void);
+
+
+/* HAL -----------------------------------------------------------------------*/
+HAL_StatusTypeDef HAL_UART_Transmit_IT(UART_HandleTypeDef *huart, uint8_t *data, uint16_t size) {
+    /*
+        The pty takes the whole frame at once, completion is immediate
+        and reported before returning
+    */
+    ssize_t n = 0;
+
+    while (size > 0) {
+        n = write(huart->fd, data, size);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            return HAL_ERROR;
+        }
+        data += n;
+        size -= n;
+    }
+
+    HAL_UART_TxCpltCallback(huart);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_IT(UART_HandleTypeDef *huart, uint8_t *data, uint16_t size) {
+    if (huart->rx_ptr != NULL || huart->dma_buff != NULL) return HAL_BUSY;
+
+    huart->rx_ptr   = data;
+    huart->rx_size  = size;
+    huart->rx_count = 0;
+
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart, uint8_t *data, uint16_t size) {
+    if (huart->rx_ptr != NULL || huart->dma_buff != NULL) return HAL_BUSY;
+    if (huart->hdmarx == NULL) return HAL_ERROR;
+
+    huart->dma_buff = data;
+    huart->dma_size = size;
+    huart->dma_wr   = 0;
+    huart->hdmarx->counter = size;
+
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Abort(UART_HandleTypeDef *huart) {
+    return HAL_UART_AbortReceive(huart);
+}
+
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *huart) {
+    huart->rx_ptr    = NULL;
+    huart->dma_buff  = NULL;
+    huart->flags    &= ~UART_FLAG_IDLE;
+
+    return HAL_OK;
+}
+
+void HAL_UART_IRQHandler(UART_HandleTypeDef *huart) {
+    // events are delivered by hal_stub_poll()
+}
+
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef *hdma) {
+}
+
+HAL_StatusTypeDef HAL_UARTEx_StopModeWakeUpSourceConfig(UART_HandleTypeDef *huart, UART_WakeUpTypeDef wakeup) {
+    // the first byte of a burst raises WUF, see uart_wake()
+    return (wakeup.WakeUpEvent == UART_WAKEUP_ON_STARTBIT) ? HAL_OK : HAL_ERROR;
+}
+
+void HW_SetStopWakeUart(UART_HandleTypeDef *huart) {
+}
+
+void HW_GPIO_Init(GPIO_TypeDef *port, uint16_t pin, GPIO_InitTypeDef *init) {
+}
+
+void HW_GPIO_Write(GPIO_TypeDef *port, uint16_t pin, uint32_t value) {
+}
+
+
+/* timeServer ----------------------------------------------------------------*/
+void TimerInit(TimerEvent_t *obj, void (*callback)(void *context)) {
+    obj->Timestamp   = 0;
+    obj->ReloadValue = 0;
+    obj->IsStarted   = false;
+    obj->Callback    = callback;
+    obj->Context     = NULL;
+    obj->Next        = NULL;
+}
+
+void TimerSetContext(TimerEvent_t *obj, void *context) {
+    obj->Context = context;
+}
+
+void TimerSetValue(TimerEvent_t *obj, uint32_t value) {
+    TimerStop(obj);
+    obj->ReloadValue = value;
+}
+
+void TimerStart(TimerEvent_t *obj) {
+    TimerStop(obj);
+
+    obj->Timestamp = TimerGetCurrentTime() + obj->ReloadValue;
+    obj->IsStarted = true;
+    obj->Next      = timers;
+    timers         = obj;
+}
+
+void TimerStop(TimerEvent_t *obj) {
+    TimerEvent_t** link = &timers;
+
+    while (*link != NULL) {
+        if (*link == obj) {
+            *link = obj->Next;
+            break;
+        }
+        link = &(*link)->Next;
+    }
+
+    obj->IsStarted = false;
+    obj->Next      = NULL;
+}
+
+TimerTime_t TimerGetCurrentTime(void) {
+    return (TimerTime_t) (hal_stub_now_us() / 1000);
+}
+
+TimerTime_t TimerGetElapsedTime(TimerTime_t past) {
+    return TimerGetCurrentTime() - past;
+}
+
+
+/* Low Power Manager ---------------------------------------------------------*/
+void LPM_SetStopMode(LPM_Id_t id, LPM_SetMode_t mode) {
+    if (mode == LPM_Disable) {
+        stop_mask |= id;
+    } else {
+        stop_mask &= ~id;
+    }
+}
+
+void LPM_EnterLowPower(void) {
+    /*
+        Sleep until the next UART byte or timer, like WFI would, and book
+        the time to STOP or sleep mode as the firmware would pick
+    */
+    uint64_t t0   = hal_stub_now_us();
+    uint8_t  stop = (stop_mask == 0); // decided on entry, as the LPM does
+
+    hal_stub_poll(-1);
+
+    if (stop) {
+        stop_us += hal_stub_now_us() - t0;
+    } else {
+        sleep_us += hal_stub_now_us() - t0;
+    }
+}
+
+
+/* Stub Control --------------------------------------------------------------*/
+int hal_stub_open(UART_HandleTypeDef *huart, DMA_HandleTypeDef *hdmarx, const char *path) {
+    /*
+        Open a tty as a raw 8N1 UART
+        params
+            huart: handle to set up
+            hdmarx: RX DMA handle, NULL if the port has no DMA
+            path: tty, e.g. the pty printed by honey_emu
+        return
+            0 on success, -1 with errno set otherwise
+    */
+    struct termios tio;
+    uint8_t i = 0;
+
+    memset(huart, 0x00, sizeof(UART_HandleTypeDef));
+    huart->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (huart->fd < 0) return -1;
+
+    if (tcgetattr(huart->fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetspeed(&tio, B9600);
+        tcsetattr(huart->fd, TCSANOW, &tio);
+    }
+
+    if (hdmarx != NULL) {
+        memset(hdmarx, 0x00, sizeof(DMA_HandleTypeDef));
+        hdmarx->Parent = huart;
+        huart->hdmarx  = hdmarx;
+    }
+
+    for (i = 0; i < HAL_STUB_MAX_UARTS; ++i) {
+        if (uarts[i] == NULL) {
+            uarts[i]     = huart;
+            uart_irqs[i] = NULL;
+            return 0;
+        }
+    }
+
+    close(huart->fd);
+    errno = EMFILE;
+    return -1;
+}
+
+void hal_stub_close(UART_HandleTypeDef *huart) {
+    uint8_t i = 0;
+
+    for (i = 0; i < HAL_STUB_MAX_UARTS; ++i) {
+        if (uarts[i] == huart) uarts[i] = NULL;
+    }
+
+    close(huart->fd);
+    huart->fd = -1;
+}
+
+void hal_stub_set_irq(UART_HandleTypeDef *huart, void (*irq)(void)) {
+    /*
+        Register the UART IRQ vector, called after each burst of received
+        bytes with the IDLE flag set, like USARTx_IRQHandler in main.c
+    */
+    uint8_t i = 0;
+
+    for (i = 0; i < HAL_STUB_MAX_UARTS; ++i) {
+        if (uarts[i] == huart) uart_irqs[i] = irq;
+    }
+}
+
+void hal_stub_poll(int timeout_ms) {
+    /*
+        Wait up to timeout_ms (-1 for the next timer) for UART bytes,
+        deliver them to the armed receptions, then fire due timers
+    */
+    struct pollfd fds[HAL_STUB_MAX_UARTS];
+    TimerEvent_t* t    = NULL;
+    TimerTime_t   now  = TimerGetCurrentTime();
+    int           wait = (timeout_ms < 0) ? 1000 : timeout_ms;
+    int           nfds = 0;
+    uint8_t       i    = 0;
+
+    for (t = timers; t != NULL; t = t->Next) {
+        int due = (int32_t) (t->Timestamp - now);
+        if (due < 0) due = 0;
+        if (due < wait) wait = due;
+    }
+
+    for (i = 0; i < HAL_STUB_MAX_UARTS; ++i) {
+        if (uarts[i] == NULL) continue;
+        fds[nfds].fd      = uarts[i]->fd;
+        fds[nfds].events  = POLLIN;
+        fds[nfds].revents = 0;
+        nfds++;
+    }
+
+    if (poll(fds, nfds, wait) > 0) {
+        for (i = 0; i < HAL_STUB_MAX_UARTS; ++i) {
+            if (uarts[i] != NULL) uart_rx(uarts[i], uart_irqs[i]);
+        }
+    }
+
+    timers_fire();
+}
+
+void hal_stub_flush(UART_HandleTypeDef *huart) {
+    /*
+        RX data flush request, drop whatever has been received
+    */
+    uint8_t buff[32];
+
+    while (read(huart->fd, buff, sizeof(buff)) > 0) {
+    }
+}
+
+void hal_stub_lpm_time(uint64_t *stop_time, uint64_t *sleep_time) {
+    /*
+        Time spent in LPM_EnterLowPower() with STOP allowed and not
+    */
+    *stop_time  = stop_us;
+    *sleep_time = sleep_us;
+}
+
+uint64_t hal_stub_now_us(void) {
+    struct timespec ts;
+    uint64_t now = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+    // start near zero so TimerTime_t does not wrap during a run
+    if (epoch_us == 0) epoch_us = now;
+    return now - epoch_us;
+}
+
+
+/* Private Functions ---------------------------------------------------------*/
+static void uart_rx(UART_HandleTypeDef *huart, void (*irq)(void)) {
+    /*
+        Move what the pty holds into the armed reception. Bytes with nothing
+        armed are dropped, as a real UART would overrun.
+    */
+    uint8_t  byte  = 0;
+    uint16_t half  = 0;
+    uint8_t  burst = 0;
+
+    for (;;) {
+        if (huart->rx_ptr != NULL) {
+            if (read(huart->fd, &huart->rx_ptr[huart->rx_count], 1) != 1) break;
+            uart_wake(huart, irq);
+            burst = 1;
+
+            if (++huart->rx_count == huart->rx_size) {
+                // the callback may arm the next reception
+                huart->rx_ptr = NULL;
+                HAL_UART_RxCpltCallback(huart);
+            }
+        } else if (huart->dma_buff != NULL) {
+            if (read(huart->fd, &huart->dma_buff[huart->dma_wr], 1) != 1) break;
+            uart_wake(huart, irq);
+            burst = 1;
+
+            half = huart->dma_size / 2;
+            huart->dma_wr++;
+            huart->hdmarx->counter = huart->dma_size - huart->dma_wr;
+
+            if (huart->dma_wr == half) {
+                HAL_UART_RxHalfCpltCallback(huart);
+            } else if (huart->dma_wr == huart->dma_size) {
+                huart->dma_wr = 0;
+                huart->hdmarx->counter = huart->dma_size;
+                HAL_UART_RxCpltCallback(huart);
+            }
+        } else {
+            if (read(huart->fd, &byte, 1) != 1) break;
+        }
+    }
+
+    if (burst && (huart->it_en & UART_IT_IDLE) && irq != NULL) {
+        huart->flags |= UART_FLAG_IDLE;
+        irq();
+    }
+}
+
+static void uart_wake(UART_HandleTypeDef *huart, void (*irq)(void)) {
+    /*
+        A byte arrived with the wake-up interrupt armed, its start bit
+        would have woken the core from STOP
+    */
+    if ((huart->it_en & UART_IT_WUF) && irq != NULL) {
+        huart->flags |= UART_FLAG_WUF;
+        irq();
+    }
+}
+
+static void timers_fire(void) {
+    /*
+        Run the callbacks of expired timers, one at a time since a callback
+        may start or stop any timer
+    */
+    TimerEvent_t* t     = NULL;
+    TimerTime_t   now   = 0;
+    uint8_t       fired = 0;
+
+    do {
+        fired = 0;
+        now   = TimerGetCurrentTime();
+
+        for (t = timers; t != NULL; t = t->Next) {
+            if ((int32_t) (t->Timestamp - now) <= 0) {
+                TimerStop(t);
+                if (t->Callback != NULL) {
+                    t->Callback(t->Context);
+                }
+                fired = 1;
+                break;
+            }
+        }
+    } while (fired);
+}
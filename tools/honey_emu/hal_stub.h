@@ -0,0 +1,154 @@
+/*
+ * hal_stub.h
+ *
+ *  Thin host stand-in for the STM32 HAL UART/DMA, timeServer and low power
+ *  manager calls ct_honey.c makes. A UART is a file descriptor, usually the
+ *  slave side of the pty honey_emu creates, and interrupts are replaced by
+ *  hal_stub_poll(), which reads the descriptor and fires timers.
+ */
+
+#ifndef HAL_STUB_H_
+#define HAL_STUB_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+/* HAL -----------------------------------------------------------------------*/
+typedef enum {
+    HAL_OK      = 0x00,
+    HAL_ERROR   = 0x01,
+    HAL_BUSY    = 0x02,
+    HAL_TIMEOUT = 0x03
+} HAL_StatusTypeDef;
+
+typedef struct {
+    uint16_t    counter;        // stands in for CNDTR, counts down from the buffer size
+    void*       Parent;
+} DMA_HandleTypeDef;
+
+typedef struct __UART_HandleTypeDef {
+    int                 fd;
+    DMA_HandleTypeDef*  hdmarx;
+
+    // interrupt driven reception
+    uint8_t*            rx_ptr;
+    uint16_t            rx_size;
+    uint16_t            rx_count;
+
+    // circular DMA reception
+    uint8_t*            dma_buff;
+    uint16_t            dma_size;
+    uint16_t            dma_wr;
+
+    uint8_t             it_en;      // UART_IT_ bits enabled
+    uint8_t             flags;      // UART_FLAG_ bits raised
+} UART_HandleTypeDef;
+
+typedef struct {
+    uint32_t            WakeUpEvent;
+} UART_WakeUpTypeDef;
+
+#define UART_IT_IDLE    0x01        // line went idle after a burst of bytes
+#define UART_IT_WUF     0x02        // start bit while waiting in STOP
+#define UART_FLAG_IDLE  UART_IT_IDLE
+#define UART_FLAG_WUF   UART_IT_WUF
+#define UART_CLEAR_WUF  UART_FLAG_WUF
+#define UART_CLEAR_OREF 0x08
+#define UART_RXDATA_FLUSH_REQUEST 0x08
+#define UART_WAKEUP_ON_STARTBIT   0x02
+
+#define __HAL_UART_ENABLE_IT(h, it)     ((h)->it_en |= (it))
+#define __HAL_UART_DISABLE_IT(h, it)    ((h)->it_en &= ~(it))
+#define __HAL_UART_GET_IT_SOURCE(h, it) ((h)->it_en & (it))
+#define __HAL_UART_GET_FLAG(h, flag)    ((h)->flags & (flag))
+#define __HAL_UART_CLEAR_IDLEFLAG(h)    ((h)->flags &= ~UART_FLAG_IDLE)
+#define __HAL_UART_CLEAR_FLAG(h, flag)  ((h)->flags &= ~(flag))
+#define __HAL_UART_SEND_REQ(h, req)     hal_stub_flush(h)
+#define __HAL_DMA_GET_COUNTER(hdma)     ((hdma)->counter)
+
+HAL_StatusTypeDef HAL_UART_Transmit_IT(UART_HandleTypeDef *huart, uint8_t *data, uint16_t size);
+HAL_StatusTypeDef HAL_UART_Receive_IT(UART_HandleTypeDef *huart, uint8_t *data, uint16_t size);
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart, uint8_t *data, uint16_t size);
+HAL_StatusTypeDef HAL_UART_Abort(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *huart);
+void HAL_UART_IRQHandler(UART_HandleTypeDef *huart);
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef *hdma);
+HAL_StatusTypeDef HAL_UARTEx_StopModeWakeUpSourceConfig(UART_HandleTypeDef *huart, UART_WakeUpTypeDef wakeup);
+void HW_SetStopWakeUart(UART_HandleTypeDef *huart);
+
+/* defined by the program linking the driver, as in main.c */
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart);
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart);
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart);
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart);
+
+/* GPIO, load switch writes are dropped */
+typedef struct {
+    uint32_t    unused;
+} GPIO_TypeDef;
+
+typedef struct {
+    uint32_t    Pin;
+    uint32_t    Mode;
+    uint32_t    Pull;
+    uint32_t    Speed;
+} GPIO_InitTypeDef;
+
+#define GPIO_MODE_OUTPUT_PP     0x01
+#define GPIO_NOPULL             0x00
+#define GPIO_SPEED_FREQ_LOW     0x00
+
+void HW_GPIO_Init(GPIO_TypeDef *port, uint16_t pin, GPIO_InitTypeDef *init);
+void HW_GPIO_Write(GPIO_TypeDef *port, uint16_t pin, uint32_t value);
+
+#define __weak          __attribute__((weak))
+
+/* Critical sections, there is a single thread on the host */
+#define DISABLE_IRQ()   do { } while (0)
+#define ENABLE_IRQ()    do { } while (0)
+
+/* timeServer ----------------------------------------------------------------*/
+typedef uint32_t TimerTime_t;
+
+typedef struct TimerEvent_s {
+    TimerTime_t     Timestamp;      // expiry time while started
+    TimerTime_t     ReloadValue;
+    bool            IsStarted;
+    void            (*Callback)(void *context);
+    void*           Context;
+    struct TimerEvent_s* Next;
+} TimerEvent_t;
+
+void        TimerInit(TimerEvent_t *obj, void (*callback)(void *context));
+void        TimerSetContext(TimerEvent_t *obj, void *context);
+void        TimerSetValue(TimerEvent_t *obj, uint32_t value);
+void        TimerStart(TimerEvent_t *obj);
+void        TimerStop(TimerEvent_t *obj);
+TimerTime_t TimerGetCurrentTime(void);
+TimerTime_t TimerGetElapsedTime(TimerTime_t past);
+
+/* Low Power Manager ---------------------------------------------------------*/
+typedef enum {
+    LPM_HONEY_Id = (1 << 6)
+} LPM_Id_t;
+
+typedef enum {
+    LPM_Disable = 0,
+    LPM_Enable
+} LPM_SetMode_t;
+
+void LPM_SetStopMode(LPM_Id_t id, LPM_SetMode_t mode);
+void LPM_EnterLowPower(void);
+
+/* Stub Control --------------------------------------------------------------*/
+int  hal_stub_open(UART_HandleTypeDef *huart, DMA_HandleTypeDef *hdmarx, const char *path);
+void hal_stub_close(UART_HandleTypeDef *huart);
+void hal_stub_set_irq(UART_HandleTypeDef *huart, void (*irq)(void));
+void hal_stub_poll(int timeout_ms);
+void hal_stub_flush(UART_HandleTypeDef *huart);
+void hal_stub_lpm_time(uint64_t *stop_time, uint64_t *sleep_time);
+uint64_t hal_stub_now_us(void);
+
+#endif /* HAL_STUB_H_ */
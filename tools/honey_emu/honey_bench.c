@@ -0,0 +1,276 @@
+/*
+ * honey_bench.c
+ *
+ *  Runs the real ct_honey.c driver on the host against honey_emu (or a
+ *  sensor on a USB serial adapter) and reports command round-trip latency,
+ *  retries under the driver's retry budget, and command and autosend stream throughput.
+ *  Waits in blocking commands are split into the time STOP would be allowed
+ *  and sleep-only time, -w turns the wake-from-STOP transport off.
+ *
+ *  Usage:
+ *  > ./honey_bench -n 200 -r 3 -B 350 -S 5 /tmp/honey
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "ct_honey.h"
+
+#define BENCH_MAX_READS 10000
+
+static UART_HandleTypeDef huart;
+static DMA_HandleTypeDef  hdma_rx;
+static honey_t            honey;
+static volatile uint8_t   process_request = 0;
+
+static uint32_t           async_done = 0;
+static uint32_t           async_ok = 0;
+static uint32_t           async_target = 0;
+
+
+/* Private Prototypes --------------------------------------------------------*/
+static void        on_notify(void);
+static void        on_irq(void);
+static void        on_async_read(honey_t *honey, honey_cmd_resp_t resp);
+static void        run_until(uint64_t deadline_us);
+static void        print_errors(const honey_t *honey);
+static const char* resp_name(honey_cmd_resp_t resp);
+static int         cmp_u32(const void *a, const void *b);
+
+
+int main(int argc, char *argv[]) {
+    static uint32_t lat_us[BENCH_MAX_READS];
+    uint32_t  attempts_hist[8] = { 0 };
+    uint32_t  reads = 100;
+    uint32_t  attempts = HONEY_RETRY_MAX;
+    uint32_t  budget_ms = HONEY_RETRY_BUDGET;
+    uint32_t  stream_s = 5;
+    uint8_t   stop_wake = 1;
+    uint64_t  stop_us = 0;
+    uint64_t  sleep_us = 0;
+    uint32_t  n_lat = 0;
+    uint32_t  failed = 0;
+    uint32_t  i = 0;
+    uint32_t  a = 0;
+    uint64_t  sum = 0;
+    uint64_t  t0 = 0;
+    uint64_t  t1 = 0;
+    uint8_t   stream_buff[2 * HONEY_AUTOSEND_FRAME_SIZE];
+    honey_cmd_resp_t resp = CMD_RESP_IDLE;
+    int       opt = 0;
+
+    while ((opt = getopt(argc, argv, "n:r:B:S:wh")) != -1) {
+        switch (opt) {
+            case 'n': reads     = atoi(optarg); break;
+            case 'r': attempts  = atoi(optarg); break;
+            case 'B': budget_ms = atoi(optarg); break;
+            case 'S': stream_s = atoi(optarg); break;
+            case 'w': stop_wake = 0; break;
+            default:
+                printf("usage: %s [-n reads] [-r attempts] [-B budget ms] [-S stream seconds] [-w] tty\n", argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+    if (optind >= argc) {
+        printf("usage: %s [-n reads] [-r attempts] [-B budget ms] [-S stream seconds] [-w] tty\n", argv[0]);
+        return 1;
+    }
+    if (reads > BENCH_MAX_READS) reads = BENCH_MAX_READS;
+    if (attempts < 1) attempts = 1;
+    if (attempts > 8) attempts = 8;
+
+    if (hal_stub_open(&huart, &hdma_rx, argv[optind]) != 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    hal_stub_set_irq(&huart, on_irq);
+
+    // init ---------------------------------------------------------------
+    t0 = hal_stub_now_us();
+    resp = honey_init(&huart, &honey);
+    printf("init: %s in %.1f ms, coef %u\n", resp_name(resp),
+           (hal_stub_now_us() - t0) / 1000.0, honey.customer_coef);
+    honey_set_notify(&honey, on_notify);
+    honey_set_stop_wake(&honey, stop_wake);
+
+    // the coefficient changes only once the sensor acked it
+    resp = honey_set_coef(&honey, 250);
+    printf("coef 250: %s, coef %u\n", resp_name(resp), honey.customer_coef);
+    resp = honey_set_coef(&honey, 120);
+    printf("coef 120: %s, coef %u\n", resp_name(resp), honey.customer_coef);
+    honey_set_coef(&honey, 100);
+
+    resp = honey_start(&honey);
+    printf("start: %s\n", resp_name(resp));
+
+    // blocking read latency and retries ----------------------------------
+    honey_set_retry(&honey, attempts, budget_ms);
+    hal_stub_lpm_time(&stop_us, &sleep_us);
+
+    for (i = 0; i < reads; ++i) {
+        uint16_t retried = honey.errors.retries;
+
+        t0   = hal_stub_now_us();
+        resp = honey_read(&honey);
+        t1   = hal_stub_now_us();
+
+        a = honey.errors.retries - retried;
+        if (resp == CMD_RESP_SUCCESS) {
+            lat_us[n_lat++] = (uint32_t) (t1 - t0);
+            attempts_hist[a]++;
+        } else {
+            failed++;
+        }
+    }
+
+    printf("\nread x%u, %u attempts within %u ms\n", reads, attempts, budget_ms);
+    for (a = 0; a < attempts; ++a) {
+        printf("  done after %u attempt(s): %u\n", a + 1, attempts_hist[a]);
+    }
+    printf("  failed: %u\n", failed);
+    print_errors(&honey);
+
+    if (n_lat > 0) {
+        qsort(lat_us, n_lat, sizeof(uint32_t), cmp_u32);
+        for (i = 0, sum = 0; i < n_lat; ++i) sum += lat_us[i];
+        printf("  latency ms: min %.2f, avg %.2f, p50 %.2f, p95 %.2f, max %.2f\n",
+               lat_us[0] / 1000.0, sum / 1000.0 / n_lat, lat_us[n_lat / 2] / 1000.0,
+               lat_us[n_lat * 95 / 100] / 1000.0, lat_us[n_lat - 1] / 1000.0);
+    }
+    hal_stub_lpm_time(&t0, &t1);
+    printf("  waiting ms: %.1f in STOP, %.1f in sleep (wake from STOP %s)\n",
+           (t0 - stop_us) / 1000.0, (t1 - sleep_us) / 1000.0, stop_wake ? "on" : "off");
+    printf("  last PM2.5 %u, PM10 %u\n", honey.pm2_5, honey.pm10_0);
+
+    // non-blocking command throughput ------------------------------------
+    async_done   = 0;
+    async_ok     = 0;
+    async_target = reads;
+    t0 = hal_stub_now_us();
+    if (honey_read_async(&honey, on_async_read) == CMD_RESP_SUCCESS) {
+        while (async_done < async_target) {
+            run_until(hal_stub_now_us() + 1000);
+        }
+    }
+    t1 = hal_stub_now_us();
+    printf("\nasync read x%u: %u ok, %.1f commands/s\n", async_done, async_ok,
+           async_done * 1e6 / (double) (t1 - t0 + 1));
+    print_errors(&honey);
+
+    // autosend stream throughput -----------------------------------------
+    if (stream_s > 0) {
+        resp = honey_stream_start(&honey, stream_buff, sizeof(stream_buff));
+        printf("\nstream start: %s\n", resp_name(resp));
+
+        t0 = hal_stub_now_us();
+        run_until(t0 + (uint64_t) stream_s * 1000000);
+        t1 = hal_stub_now_us();
+
+        printf("stream %us: %u frames (%.2f/s, %.0f B/s), %u dropped, last PM2.5 %u\n",
+               stream_s, honey.stream_frames, honey.stream_frames * 1e6 / (double) (t1 - t0),
+               honey.stream_frames * HONEY_AUTOSEND_FRAME_SIZE * 1e6 / (double) (t1 - t0),
+               honey.stream_errors, honey.pm2_5);
+
+        honey_stream_stop(&honey, NULL);
+        while (honey_busy(&honey)) {
+            run_until(hal_stub_now_us() + 1000);
+        }
+    }
+
+    resp = honey_stop(&honey);
+    printf("\nstop: %s\n", resp_name(resp));
+
+    hal_stub_close(&huart);
+    return 0;
+}
+
+
+/* HAL Callbacks, routed as in main.c ----------------------------------------*/
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart) {
+    honey_t* sensor = honey_from_uart(huart);
+
+    if (sensor != NULL) honey_tx_cplt_callback(sensor);
+}
+
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) {
+    honey_t* sensor = honey_from_uart(huart);
+
+    if (sensor != NULL) honey_rx_cplt_callback(sensor);
+}
+
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart) {
+    honey_t* sensor = honey_from_uart(huart);
+
+    if (sensor != NULL) honey_rx_half_cplt_callback(sensor);
+}
+
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart) {
+    honey_t* sensor = honey_from_uart(huart);
+
+    if (sensor != NULL) honey_error_callback(sensor);
+}
+
+
+/* Private Functions ---------------------------------------------------------*/
+static void on_notify(void) {
+    process_request = 1;
+}
+
+static void on_irq(void) {
+    honey_irq_handler(&honey);
+}
+
+static void on_async_read(honey_t *honey, honey_cmd_resp_t resp) {
+    /*
+        Chain the next read straight from the completion, as the app does
+    */
+    async_done++;
+    if (resp == CMD_RESP_SUCCESS) async_ok++;
+
+    if (async_done < async_target && honey_read_async(honey, on_async_read) != CMD_RESP_SUCCESS) {
+        async_target = async_done;
+    }
+}
+
+static void run_until(uint64_t deadline_us) {
+    /*
+        Main loop stand-in, sleep on the UART and timers, handle results
+    */
+    uint64_t now = hal_stub_now_us();
+
+    while (now < deadline_us) {
+        hal_stub_poll((int) ((deadline_us - now + 999) / 1000));
+
+        if (process_request) {
+            process_request = 0;
+            honey_process(&honey);
+        }
+        now = hal_stub_now_us();
+    }
+}
+
+static void print_errors(const honey_t *honey) {
+    printf("  errors: timeout %u, header %u, checksum %u, nack %u, uart %u, retries %u, failed %u\n",
+           honey->errors.timeout, honey->errors.header, honey->errors.checksum, honey->errors.nack,
+           honey->errors.uart, honey->errors.retries, honey->errors.failed);
+}
+
+static const char* resp_name(honey_cmd_resp_t resp) {
+    switch (resp) {
+        case CMD_RESP_IDLE:     return "idle";
+        case CMD_RESP_SUCCESS:  return "success";
+        case CMD_RESP_TIMEOUT:  return "timeout";
+        case CMD_RESP_BAD:      return "bad";
+        case CMD_RESP_NACK:     return "nack";
+        case CMD_RESP_HEADER:   return "header";
+        case CMD_RESP_CHECKSUM: return "checksum";
+        default:               return "error";
+    }
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,534 @@
+/*
+ * honey_emu.c
+ *
+ *  Honeywell HPM sensor emulator on a pty. It answers the 0x68 command
+ *  protocol the way the sensor does (ACK A5 A5, NACK 96 96, 0x40 data
+ *  frames, 0x42 0x4D autosend frames) and can inject faults so the driver
+ *  can be exercised without a sensor on the bench.
+ *
+ *  Usage:
+ *  > ./honey_emu -l 5 -p warmup:35:6 -N 2 -c 5 -L /tmp/honey
+ *  then open /tmp/honey (or the printed /dev/pts/N) with honey_bench.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EMU_FRAME_MAX       32
+#define EMU_SCHED_MAX       8
+#define EMU_FIFO_SIZE       512
+
+typedef enum {
+    PROFILE_CONST = 0,
+    PROFILE_RAMP,       // A to B over S seconds since the emulator started
+    PROFILE_STEP,       // A, then B after S seconds since the emulator started
+    PROFILE_WARMUP      // settles from 3V down to V within S seconds of fan start
+} emu_profile_t;
+
+typedef struct {
+    uint64_t due_us;
+    uint8_t  len;
+    uint8_t  data[EMU_FRAME_MAX];
+} emu_sched_t;
+
+typedef struct {
+    // configuration
+    uint32_t      latency_ms;
+    uint32_t      jitter_ms;
+    uint32_t      baud;           // output pacing, 0 sends at once
+    uint32_t      autosend_ms;
+    emu_profile_t profile;
+    double        pa, pb, ps;     // profile parameters
+    uint32_t      noise;
+    uint32_t      corrupt_pct;
+    uint32_t      drop_pct;
+    uint32_t      nack_pct;
+    uint32_t      mute_pct;
+    int           verbose;
+
+    // sensor state
+    int           fan;
+    int           autosend;
+    uint8_t       coef;
+    uint64_t      start_us;
+    uint64_t      fan_us;
+    uint64_t      next_auto_us;
+
+    // i/o
+    int           fd;
+    uint8_t       in[64];
+    uint8_t       in_len;
+    emu_sched_t   sched[EMU_SCHED_MAX];
+    uint8_t       fifo[EMU_FIFO_SIZE];
+    uint16_t      fifo_rd, fifo_len;
+    uint64_t      next_tx_us;
+
+    // counters
+    uint32_t      n_cmds, n_badcs, n_acks, n_nacks, n_data, n_auto;
+    uint32_t      n_corrupt, n_drop, n_mute, n_overflow;
+} emu_t;
+
+static volatile sig_atomic_t running = 1;
+
+
+/* Private Prototypes --------------------------------------------------------*/
+static uint64_t now_us(void);
+static int      chance(uint32_t pct);
+static uint16_t pm_value(emu_t *emu);
+static uint8_t  cs8(const uint8_t *frame, uint8_t len);
+static void     respond(emu_t *emu, const uint8_t *frame, uint8_t len, int faults);
+static void     ack(emu_t *emu, int ok);
+static void     handle_cmd(emu_t *emu, const uint8_t *frame, uint8_t len);
+static void     parse_input(emu_t *emu);
+static void     autosend(emu_t *emu);
+static void     pump(emu_t *emu);
+static int      parse_profile(emu_t *emu, const char *arg);
+static void     usage(const char *prog);
+static void     on_signal(int sig);
+
+
+int main(int argc, char *argv[]) {
+    emu_t   emu;
+    const char* link_path = NULL;
+    char*   slave = NULL;
+    int     slave_fd = -1;
+    int     opt = 0;
+    struct termios tio;
+
+    memset(&emu, 0x00, sizeof(emu));
+    emu.latency_ms  = 5;
+    emu.baud        = 9600;
+    emu.autosend_ms = 1000;
+    emu.profile     = PROFILE_CONST;
+    emu.pa          = 25;
+    emu.coef        = 100;
+    srand(time(NULL));
+
+    while ((opt = getopt(argc, argv, "l:j:b:a:p:N:c:d:n:t:s:L:vh")) != -1) {
+        switch (opt) {
+            case 'l': emu.latency_ms  = atoi(optarg); break;
+            case 'j': emu.jitter_ms   = atoi(optarg); break;
+            case 'b': emu.baud        = atoi(optarg); break;
+            case 'a': emu.autosend_ms = atoi(optarg); break;
+            case 'N': emu.noise       = atoi(optarg); break;
+            case 'c': emu.corrupt_pct = atoi(optarg); break;
+            case 'd': emu.drop_pct    = atoi(optarg); break;
+            case 'n': emu.nack_pct    = atoi(optarg); break;
+            case 't': emu.mute_pct    = atoi(optarg); break;
+            case 's': srand(atoi(optarg)); break;
+            case 'L': link_path = optarg; break;
+            case 'v': emu.verbose = 1; break;
+            case 'p':
+                if (parse_profile(&emu, optarg) != 0) {
+                    fprintf(stderr, "bad profile: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    emu.fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (emu.fd < 0 || grantpt(emu.fd) != 0 || unlockpt(emu.fd) != 0 ||
+        (slave = ptsname(emu.fd)) == NULL) {
+        perror("pty");
+        return 1;
+    }
+
+    // keep the slave open in raw mode, so clients can come and go
+    slave_fd = open(slave, O_RDWR | O_NOCTTY);
+    if (slave_fd >= 0 && tcgetattr(slave_fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(slave_fd, TCSANOW, &tio);
+    }
+    fcntl(emu.fd, F_SETFL, fcntl(emu.fd, F_GETFL) | O_NONBLOCK);
+
+    if (link_path != NULL) {
+        unlink(link_path);
+        if (symlink(slave, link_path) != 0) perror("symlink");
+    }
+
+    printf("honey_emu on %s%s%s\n", slave, link_path ? " -> " : "", link_path ? link_path : "");
+    fflush(stdout);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    emu.start_us = now_us();
+
+    while (running) {
+        struct pollfd pfd = { emu.fd, POLLIN, 0 };
+        uint8_t  buff[64];
+        ssize_t  n = 0;
+
+        poll(&pfd, 1, 1);
+
+        while ((n = read(emu.fd, buff, sizeof(buff))) > 0) {
+            if (emu.in_len + n > sizeof(emu.in)) emu.in_len = 0; // garbage, start over
+            memcpy(&emu.in[emu.in_len], buff, n);
+            emu.in_len += n;
+        }
+
+        parse_input(&emu);
+        autosend(&emu);
+        pump(&emu);
+    }
+
+    printf("\ncommands %u, bad checksum %u, ack %u, nack %u, data %u, autosend %u\n",
+           emu.n_cmds, emu.n_badcs, emu.n_acks, emu.n_nacks, emu.n_data, emu.n_auto);
+    printf("injected: corrupt %u, drop %u, mute %u, fifo overflow %u\n",
+           emu.n_corrupt, emu.n_drop, emu.n_mute, emu.n_overflow);
+
+    if (link_path != NULL) unlink(link_path);
+    if (slave_fd >= 0) close(slave_fd);
+    close(emu.fd);
+    return 0;
+}
+
+
+/* Private Functions ---------------------------------------------------------*/
+static uint64_t now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int chance(uint32_t pct) {
+    return pct > 0 && (uint32_t) (rand() % 100) < pct;
+}
+
+static uint16_t pm_value(emu_t *emu) {
+    /*
+        PM2.5 from the configured profile plus uniform noise
+    */
+    double t = (now_us() - emu->start_us) / 1e6;
+    double v = emu->pa;
+
+    switch (emu->profile) {
+        case PROFILE_RAMP:
+            v = emu->pa + (emu->pb - emu->pa) * ((t < emu->ps) ? t / emu->ps : 1.0);
+            break;
+        case PROFILE_STEP:
+            v = (t < emu->ps) ? emu->pa : emu->pb;
+            break;
+        case PROFILE_WARMUP:
+            t = (now_us() - emu->fan_us) / 1e6;
+            v = emu->pa + 2 * emu->pa * exp(-3 * t / emu->ps);
+            break;
+        default:
+            break;
+    }
+
+    if (emu->noise > 0) {
+        v += (int) (rand() % (2 * emu->noise + 1)) - (int) emu->noise;
+    }
+    v = v * emu->coef / 100;
+
+    if (v < 0) v = 0;
+    if (v > 1000) v = 1000;
+    return (uint16_t) (v + 0.5);
+}
+
+static uint8_t cs8(const uint8_t *frame, uint8_t len) {
+    /*
+        Command checksum over len bytes, MOD((65536-sum), 256)
+    */
+    uint16_t sum = 0;
+    uint8_t  i   = 0;
+
+    for (i = 0; i < len; ++i) {
+        sum += frame[i];
+    }
+
+    return (65536 - sum) % 256;
+}
+
+static void respond(emu_t *emu, const uint8_t *frame, uint8_t len, int faults) {
+    /*
+        Schedule a response after the configured latency, faults are
+        injected here so every response path can be hit
+    */
+    emu_sched_t* s = NULL;
+    uint8_t      i = 0;
+    uint32_t     delay = emu->latency_ms;
+
+    if (faults && chance(emu->mute_pct)) {
+        emu->n_mute++;
+        return;
+    }
+
+    for (i = 0; i < EMU_SCHED_MAX; ++i) {
+        if (emu->sched[i].len == 0) {
+            s = &emu->sched[i];
+            break;
+        }
+    }
+    if (s == NULL) {
+        emu->n_overflow++;
+        return;
+    }
+
+    if (emu->jitter_ms > 0) delay += rand() % (emu->jitter_ms + 1);
+    s->due_us = now_us() + (uint64_t) delay * 1000;
+    s->len    = len;
+    memcpy(s->data, frame, len);
+
+    if (faults && chance(emu->corrupt_pct)) {
+        s->data[len - 1] ^= 0x5A;
+        emu->n_corrupt++;
+    }
+    if (faults && len > 1 && chance(emu->drop_pct)) {
+        i = rand() % len;
+        memmove(&s->data[i], &s->data[i + 1], len - i - 1);
+        s->len--;
+        emu->n_drop++;
+    }
+}
+
+static void ack(emu_t *emu, int ok) {
+    static const uint8_t ACK[2]  = { 0xA5, 0xA5 };
+    static const uint8_t NACK[2] = { 0x96, 0x96 };
+
+    if (ok && !chance(emu->nack_pct)) {
+        emu->n_acks++;
+        respond(emu, ACK, 2, 1);
+    } else {
+        emu->n_nacks++;
+        respond(emu, NACK, 2, 1);
+    }
+}
+
+static void handle_cmd(emu_t *emu, const uint8_t *frame, uint8_t len) {
+    /*
+        Act on a checked HEAD LEN CMD [DATA] CS frame
+    */
+    uint8_t  resp[8];
+    uint16_t pm2_5  = 0;
+    uint16_t pm10_0 = 0;
+
+    emu->n_cmds++;
+    if (emu->verbose) {
+        printf("cmd %02X len %u fan %d auto %d\n", frame[2], frame[1], emu->fan, emu->autosend);
+    }
+
+    switch (frame[2]) {
+        case 0x01: // start measurement
+            if (!emu->fan) emu->fan_us = now_us();
+            emu->fan = 1;
+            ack(emu, 1);
+            break;
+
+        case 0x02: // stop measurement
+            emu->fan = 0;
+            ack(emu, 1);
+            break;
+
+        case 0x04: // read measurement, the sensor has nothing while the fan is off
+            if (!emu->fan || chance(emu->nack_pct)) {
+                ack(emu, 0);
+                break;
+            }
+            pm2_5  = pm_value(emu);
+            pm10_0 = pm2_5 * 13 / 10;
+            resp[0] = 0x40;
+            resp[1] = 0x05;
+            resp[2] = 0x04;
+            resp[3] = pm2_5 >> 8;
+            resp[4] = pm2_5 & 0xFF;
+            resp[5] = pm10_0 >> 8;
+            resp[6] = pm10_0 & 0xFF;
+            resp[7] = cs8(resp, 7);
+            emu->n_data++;
+            respond(emu, resp, 8, 1);
+            break;
+
+        case 0x40: // enable autosend
+            emu->autosend     = 1;
+            emu->next_auto_us = now_us() + (uint64_t) emu->autosend_ms * 1000;
+            ack(emu, 1);
+            break;
+
+        case 0x20: // stop autosend
+            emu->autosend = 0;
+            ack(emu, 1);
+            break;
+
+        case 0x10: // read customer coefficient
+            resp[0] = 0x40;
+            resp[1] = 0x02;
+            resp[2] = 0x10;
+            resp[3] = emu->coef;
+            resp[4] = cs8(resp, 4);
+            emu->n_data++;
+            respond(emu, resp, 5, 1);
+            break;
+
+        case 0x08: // set customer coefficient
+            if (len != 5 || frame[3] < 30 || frame[3] > 200) {
+                ack(emu, 0);
+                break;
+            }
+            emu->coef = frame[3];
+            ack(emu, 1);
+            break;
+
+        default:
+            ack(emu, 0);
+            break;
+    }
+}
+
+static void parse_input(emu_t *emu) {
+    /*
+        Find HEAD LEN CMD [DATA] CS frames in the input, resync on 0x68
+    */
+    uint8_t len = 0;
+
+    while (emu->in_len >= 2) {
+        if (emu->in[0] != 0x68 || emu->in[1] == 0 || emu->in[1] > 2) {
+            memmove(emu->in, &emu->in[1], --emu->in_len);
+            continue;
+        }
+
+        len = emu->in[1] + 3;
+        if (emu->in_len < len) break;
+
+        if (cs8(emu->in, len - 1) != emu->in[len - 1]) {
+            emu->n_badcs++;
+            ack(emu, 0);
+        } else {
+            handle_cmd(emu, emu->in, len);
+        }
+
+        emu->in_len -= len;
+        memmove(emu->in, &emu->in[len], emu->in_len);
+    }
+}
+
+static void autosend(emu_t *emu) {
+    /*
+        32 byte 0x42 0x4D frame every autosend_ms while the fan runs,
+        PM1.0 in DATA1, PM2.5 in DATA2, PM10 in DATA3, 16 bit sum at the end
+    */
+    uint8_t  frame[EMU_FRAME_MAX];
+    uint16_t pm2_5 = 0;
+    uint16_t pm10_0 = 0;
+    uint16_t pm1_0 = 0;
+    uint16_t sum = 0;
+    uint8_t  i = 0;
+
+    if (!emu->autosend || !emu->fan || now_us() < emu->next_auto_us) return;
+    emu->next_auto_us += (uint64_t) emu->autosend_ms * 1000;
+
+    pm2_5  = pm_value(emu);
+    pm10_0 = pm2_5 * 13 / 10;
+    pm1_0  = pm2_5 * 7 / 10;
+
+    memset(frame, 0x00, sizeof(frame));
+    frame[0] = 0x42;
+    frame[1] = 0x4D;
+    frame[2] = 0x00;
+    frame[3] = EMU_FRAME_MAX - 4;
+    frame[4] = pm1_0 >> 8;
+    frame[5] = pm1_0 & 0xFF;
+    frame[6] = pm2_5 >> 8;
+    frame[7] = pm2_5 & 0xFF;
+    frame[8] = pm10_0 >> 8;
+    frame[9] = pm10_0 & 0xFF;
+
+    for (i = 0; i < EMU_FRAME_MAX - 2; ++i) {
+        sum += frame[i];
+    }
+    frame[30] = sum >> 8;
+    frame[31] = sum & 0xFF;
+
+    emu->n_auto++;
+    respond(emu, frame, EMU_FRAME_MAX, 1);
+}
+
+static void pump(emu_t *emu) {
+    /*
+        Move due responses to the FIFO and send it paced at the baud rate
+    */
+    uint64_t now = now_us();
+    uint64_t byte_us = (emu->baud > 0) ? 10000000ULL / emu->baud : 0;
+    uint16_t wr = 0;
+    uint8_t  i = 0;
+    uint8_t  j = 0;
+
+    for (i = 0; i < EMU_SCHED_MAX; ++i) {
+        emu_sched_t* s = &emu->sched[i];
+
+        if (s->len == 0 || now < s->due_us) continue;
+
+        if (emu->fifo_len + s->len > EMU_FIFO_SIZE) {
+            emu->n_overflow++;
+        } else {
+            for (j = 0; j < s->len; ++j) {
+                wr = (emu->fifo_rd + emu->fifo_len) % EMU_FIFO_SIZE;
+                emu->fifo[wr] = s->data[j];
+                emu->fifo_len++;
+            }
+        }
+        s->len = 0;
+    }
+
+    if (emu->next_tx_us < now - byte_us) emu->next_tx_us = now;
+
+    while (emu->fifo_len > 0 && emu->next_tx_us <= now) {
+        if (write(emu->fd, &emu->fifo[emu->fifo_rd], 1) != 1) break;
+        emu->fifo_rd = (emu->fifo_rd + 1) % EMU_FIFO_SIZE;
+        emu->fifo_len--;
+        emu->next_tx_us += byte_us;
+    }
+}
+
+static int parse_profile(emu_t *emu, const char *arg) {
+    if (sscanf(arg, "const:%lf", &emu->pa) == 1) {
+        emu->profile = PROFILE_CONST;
+    } else if (sscanf(arg, "ramp:%lf:%lf:%lf", &emu->pa, &emu->pb, &emu->ps) == 3 && emu->ps > 0) {
+        emu->profile = PROFILE_RAMP;
+    } else if (sscanf(arg, "step:%lf:%lf:%lf", &emu->pa, &emu->pb, &emu->ps) == 3) {
+        emu->profile = PROFILE_STEP;
+    } else if (sscanf(arg, "warmup:%lf:%lf", &emu->pa, &emu->ps) == 2 && emu->ps > 0) {
+        emu->profile = PROFILE_WARMUP;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void usage(const char *prog) {
+    printf("usage: %s [options]\n"
+           "  -l ms      response latency (5)\n"
+           "  -j ms      extra random latency, 0..ms (0)\n"
+           "  -b baud    output pacing, 0 for none (9600)\n"
+           "  -a ms      autosend period (1000)\n"
+           "  -p prof    PM2.5 profile: const:V, ramp:A:B:S, step:A:B:S, warmup:V:S (const:25)\n"
+           "  -N n       uniform noise of +-n ug/m3 (0)\n"
+           "  -c pct     corrupt the last byte of a response\n"
+           "  -d pct     drop one byte of a response\n"
+           "  -n pct     NACK a valid command\n"
+           "  -t pct     do not respond at all\n"
+           "  -s seed    random seed\n"
+           "  -L path    symlink to the pty slave\n"
+           "  -v         log commands\n", prog);
+}
+
+static void on_signal(int sig) {
+    running = 0;
+}
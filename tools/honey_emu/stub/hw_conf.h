@@ -0,0 +1,5 @@
+/* host build, everything ct_honey.c needs is in hal_stub.h */
+#ifndef STUB_HW_CONF_H_
+#define STUB_HW_CONF_H_
+#include "hal_stub.h"
+#endif
@@ -0,0 +1,5 @@
+/* host build, everything ct_honey.c needs is in hal_stub.h */
+#ifndef STUB_LOW_POWER_MANAGER_H_
+#define STUB_LOW_POWER_MANAGER_H_
+#include "hal_stub.h"
+#endif
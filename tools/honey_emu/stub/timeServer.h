@@ -0,0 +1,5 @@
+/* host build, everything ct_honey.c needs is in hal_stub.h */
+#ifndef STUB_TIMESERVER_H_
+#define STUB_TIMESERVER_H_
+#include "hal_stub.h"
+#endif
@@ -0,0 +1,232 @@
+/*
+ * payload_bench.c
+ *
+ *  Round-trip fuzzing and throughput of the ct_payload.c codec, the same
+ *  source the node runs. Random readings must decode to what was encoded,
+ *  random bytes must be rejected or decode to something that encodes back
+ *  the same, and neither may read past the frame (build with ASan, see the
+ *  Makefile).
+ *
+ *  Usage:
+ *  > ./payload_bench -n 1000000 -s 1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ct_payload.h"
+
+#define BENCH_FRAMES    4096    // frames encoded once and decoded in a loop
+
+static uint32_t rng_state = 1;
+
+
+/* Private Prototypes --------------------------------------------------------*/
+static uint32_t rng(void);
+static void     random_reading(payload_t *p);
+static void     expected(const payload_t *in, payload_t *out);
+static int      same(const payload_t *a, const payload_t *b);
+static void     print_reading(const char *name, const payload_t *p);
+static uint32_t fuzz_round_trip(uint32_t n);
+static uint32_t fuzz_bytes(uint32_t n);
+static void     bench(uint32_t n);
+static uint64_t now_ns(void);
+
+
+int main(int argc, char *argv[]) {
+    uint32_t n = 100000;
+    uint32_t failed = 0;
+    int      opt = 0;
+
+    while ((opt = getopt(argc, argv, "n:s:h")) != -1) {
+        switch (opt) {
+            case 'n': n = atoi(optarg); break;
+            case 's': rng_state = atoi(optarg) | 1; break;
+            default:
+                printf("usage: %s [-n iterations] [-s seed]\n", argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    failed += fuzz_round_trip(n);
+    failed += fuzz_bytes(n);
+    bench(n);
+
+    return failed ? 1 : 0;
+}
+
+
+/* Private Functions ---------------------------------------------------------*/
+static uint32_t rng(void) {
+    // xorshift32, reproducible from the seed
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static void random_reading(payload_t *p) {
+    // edge values half of the time, they are where packing goes wrong
+    static const uint16_t pm_edges[] = { 0, 63, 64, 191, 319, 320, 1000, 1343, 1344, 65535, 256 };
+    static const int32_t  deg_edges[] = { 0, 1, -1, 9000000, -9000000, 18000000, -18000000, 20000000, -20000000 };
+
+    p->fields    = rng() & 0x0F;
+    p->status    = rng() & 0x3F;
+    p->pm2_5     = (rng() & 1) ? pm_edges[rng() % 11] : rng() & 0xFFFF;
+    p->pm10_0    = (rng() & 1) ? pm_edges[rng() % 11] : rng() & 0xFFFF;
+    p->battery   = rng() & 0xFF;
+    p->latitude  = (rng() & 1) ? deg_edges[rng() % 9] : (int32_t) (rng() % 18000001) - 9000000;
+    p->longitude = (rng() & 1) ? deg_edges[rng() % 9] : (int32_t) (rng() % 36000001) - 18000000;
+}
+
+static void expected(const payload_t *in, payload_t *out) {
+    // what the decoder gives back: absent fields zero, locations clamped
+    memset(out, 0x00, sizeof(payload_t));
+    out->fields = in->fields;
+    out->status = in->status;
+    if (in->fields & PAYLOAD_F_PM2_5)   out->pm2_5  = in->pm2_5;
+    if (in->fields & PAYLOAD_F_PM10_0)  out->pm10_0 = in->pm10_0;
+    if (in->fields & PAYLOAD_F_BATTERY) out->battery = in->battery;
+    if (in->fields & PAYLOAD_F_LOCATION) {
+        out->latitude  = in->latitude > 9000000 ? 9000000 : (in->latitude < -9000000 ? -9000000 : in->latitude);
+        out->longitude = in->longitude > 18000000 ? 18000000 : (in->longitude < -18000000 ? -18000000 : in->longitude);
+    }
+}
+
+static int same(const payload_t *a, const payload_t *b) {
+    return a->fields == b->fields && a->status == b->status && a->pm2_5 == b->pm2_5 &&
+           a->pm10_0 == b->pm10_0 && a->battery == b->battery &&
+           a->latitude == b->latitude && a->longitude == b->longitude;
+}
+
+static void print_reading(const char *name, const payload_t *p) {
+    printf("  %s: fields %x status %02x pm2.5 %u pm10 %u batt %u lat %ld lon %ld\n", name,
+           p->fields, p->status, p->pm2_5, p->pm10_0, p->battery, (long) p->latitude, (long) p->longitude);
+}
+
+static uint32_t fuzz_round_trip(uint32_t n) {
+    uint8_t   buff[PAYLOAD_SIZE_MAX];
+    payload_t in, want, out;
+    uint32_t  failed = 0;
+    uint32_t  bytes = 0;
+    uint32_t  i = 0;
+    uint8_t   size = 0;
+    payload_result_t res = PAYLOAD_OK;
+
+    for (i = 0; i < n; ++i) {
+        random_reading(&in);
+        expected(&in, &want);
+
+        // a buffer one byte short is refused
+        size = payload_size(&in);
+        if (payload_encode(&in, buff, size - 1) != 0) {
+            printf("encode accepted %u bytes for a %u byte frame\n", size - 1, size);
+            failed++;
+        }
+
+        size = payload_encode(&in, buff, sizeof(buff));
+        res  = payload_decode(buff, size, &out);
+        bytes += size;
+        if (size == 0 || res != PAYLOAD_OK || !same(&out, &want)) {
+            if (failed++ < 5) {
+                printf("round trip %u failed, size %u, result %d\n", i, size, res);
+                print_reading("want", &want);
+                print_reading("got ", &out);
+            }
+            continue;
+        }
+
+        // every shorter frame is refused
+        while (size-- > 0) {
+            if (payload_decode(buff, size, &out) != PAYLOAD_ERR_SIZE) {
+                if (failed++ < 5) printf("round trip %u: %u byte prefix accepted\n", i, size);
+            }
+        }
+    }
+
+    printf("round trip x%u: %u failed, %.2f bytes a frame\n", n, failed, n ? (double) bytes / n : 0.0);
+    return failed;
+}
+
+static uint32_t fuzz_bytes(uint32_t n) {
+    // exactly size bytes on the heap so ASan sees any read past the frame
+    uint32_t  counts[PAYLOAD_ERR_RANGE + 1] = { 0 };
+    uint32_t  failed = 0;
+    uint32_t  i = 0;
+    uint8_t   again[PAYLOAD_SIZE_MAX];
+    uint8_t   size = 0;
+    uint8_t   k = 0;
+    payload_t out, out2;
+    payload_result_t res = PAYLOAD_OK;
+
+    for (i = 0; i < n; ++i) {
+        uint8_t *buff = NULL;
+
+        size = rng() % (PAYLOAD_SIZE_MAX + 3);
+        buff = malloc(size ? size : 1);
+        for (k = 0; k < size; ++k) buff[k] = rng();
+        // most random tags are rejected at once, steer half of them in,
+        // to every known version and to an unknown one now and then
+        if (size > 0 && (rng() & 1)) buff[0] = PAYLOAD_TAG | ((rng() & 7) ? ((1 + rng() % PAYLOAD_VERSION) << 5) : (rng() & 0xE0));
+
+        res = payload_decode(buff, size, &out);
+        counts[res]++;
+
+        // what decodes must encode to a frame that decodes the same, no
+        // longer unless it came in an older version
+        if (res == PAYLOAD_OK) {
+            k = payload_encode(&out, again, sizeof(again));
+            if (k == 0 || (k > size && (buff[0] >> 5) == PAYLOAD_VERSION) || payload_decode(again, k, &out2) != PAYLOAD_OK || !same(&out, &out2)) {
+                if (failed++ < 5) printf("random frame %u decoded but does not re-encode\n", i);
+            }
+        }
+        free(buff);
+    }
+
+    printf("random bytes x%u: %u failed, ok %u, size %u, tag %u, version %u, range %u\n", n, failed,
+           counts[PAYLOAD_OK], counts[PAYLOAD_ERR_SIZE], counts[PAYLOAD_ERR_TAG],
+           counts[PAYLOAD_ERR_VERSION], counts[PAYLOAD_ERR_RANGE]);
+    return failed;
+}
+
+static void bench(uint32_t n) {
+    static payload_t in[BENCH_FRAMES];
+    static uint8_t   frames[BENCH_FRAMES][PAYLOAD_SIZE_MAX];
+    static uint8_t   sizes[BENCH_FRAMES];
+    payload_t out;
+    uint64_t  t0 = 0;
+    uint64_t  enc_ns = 0;
+    uint64_t  dec_ns = 0;
+    uint32_t  check = 0;
+    uint32_t  i = 0;
+
+    for (i = 0; i < BENCH_FRAMES; ++i) {
+        random_reading(&in[i]);
+    }
+    if (n < BENCH_FRAMES) n = BENCH_FRAMES;
+
+    t0 = now_ns();
+    for (i = 0; i < n; ++i) {
+        sizes[i % BENCH_FRAMES] = payload_encode(&in[i % BENCH_FRAMES], frames[i % BENCH_FRAMES], PAYLOAD_SIZE_MAX);
+    }
+    enc_ns = now_ns() - t0;
+
+    t0 = now_ns();
+    for (i = 0; i < n; ++i) {
+        payload_decode(frames[i % BENCH_FRAMES], sizes[i % BENCH_FRAMES], &out);
+        check += out.pm2_5;
+    }
+    dec_ns = now_ns() - t0;
+
+    printf("throughput x%u: encode %.1f ns, %.2f M/s; decode %.1f ns, %.2f M/s (check %u)\n", n,
+           (double) enc_ns / n, n * 1000.0 / enc_ns, (double) dec_ns / n, n * 1000.0 / dec_ns, check);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}